@@ -0,0 +1,115 @@
+#include "common.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "bandcanvas.h"
+
+#include "chars.h"
+#include "framebuffer.h"
+
+uint8_t BandCanvas::pattern_bits_[BandCanvas::NUM_PATTERN_ROWS];
+static bool s_pattern_bits_ready = false;
+
+void BandCanvas::init_pattern_bits()
+{
+    // Bit i is the i-th texel from the left. Chars are drawn highest bit
+    // first, sprites lowest bit first
+    for (int row = 0; row < PATTERN_SPRITE_START; ++row) {
+        uint8_t bits = 0;
+        for (int i = 0; i < 8; ++i) {
+            if (Chars::charset()[row] & 1 << (7 - i))
+                bits |= 1 << i;
+        }
+        pattern_bits_[row] = bits;
+    }
+    for (int value = 0; value < 256; ++value)
+        pattern_bits_[PATTERN_SPRITE_START + value] = value;
+}
+
+BandCanvas::BandCanvas(SDL_Surface *surface, int y, int h, const Uint32 *colormap, const Uint32 *object_colormap)
+    : y_(y), h_(h), colormap_(colormap)
+{
+    if (!s_pattern_bits_ready) {
+        init_pattern_bits();
+        s_pattern_bits_ready = true;
+    }
+
+    for (int i = 0; i < 8; ++i)
+        object_colormap_[i] = object_colormap[i];
+
+    // A view of the rows of the band, sharing the pixels and the palette
+    const SDL_PixelFormat *format = surface->format;
+    view_ = SDL_CreateRGBSurfaceFrom((Uint8 *)surface->pixels + y * surface->pitch, surface->w, h,
+            format->BitsPerPixel, surface->pitch, format->Rmask, format->Gmask, format->Bmask, format->Amask);
+    if (!view_)
+        throw runtime_error(SDL_GetError());
+    if (format->palette)
+        SDL_SetColors(view_, format->palette->colors, 0, format->palette->ncolors);
+
+    clear_clip_rect();
+}
+
+BandCanvas::~BandCanvas()
+{
+    SDL_FreeSurface(view_);
+}
+
+void BandCanvas::retarget(SDL_Surface *surface)
+{
+    // The view doesn't own its pixels, so it can be pointed at another
+    // surface of the same format
+    view_->pixels = (Uint8 *)surface->pixels + y_ * surface->pitch;
+}
+
+void BandCanvas::set_clip_rect(SDL_Rect &r)
+{
+    int x_begin = max((int)r.x, 0);
+    int x_end = min(r.x + r.w, (int)Framebuffer::SCREEN_WIDTH);
+    int y_begin = max((int)r.y, y_);
+    int y_end = min(r.y + r.h, y_ + h_);
+
+    clip_r_.x = x_begin;
+    clip_r_.y = y_begin;
+    clip_r_.w = max(x_end - x_begin, 0);
+    clip_r_.h = max(y_end - y_begin, 0);
+
+    SDL_Rect view_r = to_view(clip_r_);
+    SDL_SetClipRect(view_, &view_r);
+}
+
+void BandCanvas::clear_clip_rect()
+{
+    SDL_Rect r = {0, y_, Framebuffer::SCREEN_WIDTH, h_};
+    set_clip_rect(r);
+}
+
+template<typename T> void BandCanvas::draw_pattern_rows(SDL_Rect &r, int row, int x_scale, int y_scale,
+        int gap, T color)
+{
+    int x_begin = max((int)r.x, (int)clip_r_.x);
+    int x_end = min(r.x + r.w, clip_r_.x + clip_r_.w);
+    int y_begin = max((int)r.y, (int)clip_r_.y);
+    int y_end = min(r.y + r.h, clip_r_.y + clip_r_.h);
+
+    for (int y = y_begin; y < y_end; ++y) {
+        T *dst = (T *)((Uint8 *)view_->pixels + (y - y_) * view_->pitch);
+        unsigned int bits = pattern_bits_[row + (y - r.y) / y_scale];
+        for (int i = 0; bits; ++i, bits >>= 1) {
+            if (!(bits & 1))
+                continue;
+            int span_begin = max(r.x + i * x_scale + (i ? 0 : gap), x_begin);
+            int span_end = min(r.x + (i + 1) * x_scale, x_end);
+            for (int x = span_begin; x < span_end; ++x)
+                dst[x] = color;
+        }
+    }
+}
+
+void BandCanvas::draw_pattern(SDL_Rect &r, int row, int x_scale, int y_scale, int gap, int color)
+{
+    if (view_->format->BytesPerPixel == 1)
+        draw_pattern_rows<Uint8>(r, row, x_scale, y_scale, gap, object_colormap_[color]);
+    else
+        draw_pattern_rows<Uint32>(r, row, x_scale, y_scale, gap, object_colormap_[color]);
+}
@@ -0,0 +1,189 @@
+#include "common.h"
+
+#include <cstdlib>
+#include <iomanip>
+
+#include "breakpoints.h"
+
+#include "extstorage.h"
+#include "vdc.h"
+
+const char *const Breakpoints::area_names_[NUM_AREAS] = {
+    "intram",
+    "extram",
+    "vdc"
+};
+
+bool Breakpoints::parse_rom_address(const string &str, int &bank, int &pc)
+{
+    // Either an address or bank:address, both in hex
+    const char *begin = str.c_str();
+    char *end;
+    bank = -1;
+    string::size_type colon = str.find(':');
+    if (colon != string::npos) {
+        bank = strtol(begin, &end, 16);
+        if (end != begin + colon || bank < 0 || bank >= NUM_BANKS)
+            return false;
+        begin += colon + 1;
+    }
+
+    pc = strtol(begin, &end, 16);
+    return end != begin && !*end && pc >= 0 && pc < Rom::BANK_SIZE;
+}
+
+bool Breakpoints::parse_area(const string &str, area_t &area)
+{
+    for (int i = 0; i < NUM_AREAS; ++i) {
+        if (str == area_names_[i]) {
+            area = (area_t)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Breakpoints::set(int bank, int pc)
+{
+    if (bank == -1) {
+        for (int i = 0; i < NUM_BANKS; ++i)
+            set(i, pc);
+        return;
+    }
+
+    if (!hit(bank, pc)) {
+        int index = bank * Rom::BANK_SIZE + pc;
+        bitmap_[index >> 3] |= 1 << (index & 7);
+        ++num_breakpoints_;
+    }
+}
+
+bool Breakpoints::clear(int bank, int pc)
+{
+    if (bank == -1) {
+        bool cleared = false;
+        for (int i = 0; i < NUM_BANKS; ++i)
+            cleared |= clear(i, pc);
+        return cleared;
+    }
+
+    if (!hit(bank, pc))
+        return false;
+
+    int index = bank * Rom::BANK_SIZE + pc;
+    bitmap_[index >> 3] &= ~(1 << (index & 7));
+    --num_breakpoints_;
+    return true;
+}
+
+bool Breakpoints::unwatch(unsigned int index)
+{
+    if (index >= watchpoints_.size())
+        return false;
+    watchpoints_.erase(watchpoints_.begin() + index);
+    return true;
+}
+
+uint8_t Breakpoints::peek(area_t area, int address)
+{
+    switch (area) {
+        case INTRAM:
+            return g_cpu.debug_peek_intram(address);
+        case EXTRAM:
+            return g_extstorage.debug_peek_extram(address);
+        default:
+            return g_vdc.debug_peek(address);
+    }
+}
+
+void Breakpoints::add_pending(area_t area, int address, bool write)
+{
+    for (vector<watchpoint_t>::const_iterator it = watchpoints_.begin(); it != watchpoints_.end(); ++it) {
+        if (it->area == area && it->address == address && (write ? it->write : it->read)) {
+            // What was read is known now, what's written only after the instruction
+            pending_t &pending = pending_[num_pending_++];
+            pending.area = area;
+            pending.address = address;
+            pending.write = write;
+            pending.value = peek(area, address);
+            return;
+        }
+    }
+}
+
+void Breakpoints::before_step()
+{
+    num_pending_ = 0;
+    if (watchpoints_.empty())
+        return;
+
+    Cpu::access_t accesses[Cpu::MAX_ACCESSES];
+    int num_accesses = g_cpu.debug_next_accesses(accesses);
+    for (int i = 0; i < num_accesses; ++i) {
+        const Cpu::access_t &access = accesses[i];
+        if (!access.external) {
+            add_pending(INTRAM, access.address, access.write);
+        }
+        else {
+            if (g_extstorage.debug_reaches_vdc(access.write))
+                add_pending(VDC, access.address, access.write);
+            if (g_extstorage.debug_reaches_extram(access.write))
+                add_pending(EXTRAM, access.address, access.write);
+        }
+    }
+}
+
+int Breakpoints::after_step()
+{
+    for (int i = 0; i < num_pending_; ++i) {
+        pending_t &pending = pending_[i];
+        if (pending.write)
+            pending.value = peek(pending.area, pending.address);
+
+        for (unsigned int j = 0; j < watchpoints_.size(); ++j) {
+            const watchpoint_t &watchpoint = watchpoints_[j];
+            if (watchpoint.area == pending.area && watchpoint.address == pending.address
+                    && (pending.write ? watchpoint.write : watchpoint.read)
+                    && (watchpoint.value == -1 || watchpoint.value == pending.value)) {
+                num_pending_ = 0;
+                return j;
+            }
+        }
+    }
+
+    num_pending_ = 0;
+    return -1;
+}
+
+void Breakpoints::debug_print_watchpoint(ostream &out, unsigned int index) const
+{
+    const watchpoint_t &watchpoint = watchpoints_[index];
+    out << dec << index << ": " << (watchpoint.read ? "r" : "") << (watchpoint.write ? "w" : "")
+        << ' ' << area_names_[watchpoint.area] << " 0x" << hex << setw(2) << setfill('0') << watchpoint.address;
+    if (watchpoint.value != -1)
+        out << " == 0x" << setw(2) << watchpoint.value;
+    out << dec << setfill(' ');
+}
+
+void Breakpoints::debug_print(ostream &out) const
+{
+    if (empty()) {
+        out << "No breakpoints or watchpoints set" << endl;
+        return;
+    }
+
+    for (int bank = 0; bank < NUM_BANKS; ++bank) {
+        for (int pc = 0; pc < Rom::BANK_SIZE; ++pc) {
+            if (hit(bank, pc))
+                out << "Breakpoint at " << bank << ":0x" << hex << setw(3) << setfill('0') << pc << dec << '\n';
+        }
+    }
+    out << setfill(' ');
+
+    for (unsigned int i = 0; i < watchpoints_.size(); ++i) {
+        out << "Watchpoint ";
+        debug_print_watchpoint(out, i);
+        out << '\n';
+    }
+    out.flush();
+}
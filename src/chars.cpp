@@ -1,12 +1,16 @@
 #include "common.h"
 
+#include <algorithm>
+#include <cctype>
 #include <iostream>
 #include <stdexcept>
 
 #include "chars.h"
 
 #include "colors.h"
+#include "counters.h"
 #include "framebuffer.h"
+#include "profiler.h"
 
 Chars g_chars;
 
@@ -80,21 +84,14 @@ const uint8_t Chars::charset_[Chars::NUM_CHARS * 8] = {
 void Chars::init()
 {
     // Create the surfaces
-    for (int i = 0; i < 8; ++i) {
-        surfaces_[i] = SDL_CreateRGBSurface(SDL_HWSURFACE,
-                16 * Framebuffer::SCREEN_WIDTH_MULTIPLIER, NUM_CHARS * 16, 32,
-                TRANSPARENT_RMASK, TRANSPARENT_GMASK, TRANSPARENT_BMASK, TRANSPARENT_AMASK);
-        if (!surfaces_[i])
-            throw runtime_error(SDL_GetError());
-        else if (surfaces_[i]->format->BitsPerPixel != 32)
-            throw runtime_error("Unable to create a 32bpp surface");
-    }
+    for (int i = 0; i < 8; ++i)
+        surfaces_[i] = g_framebuffer->create_object_surface(16 * Framebuffer::SCREEN_WIDTH_MULTIPLIER,
+                NUM_CHARS * 16);
 
     // Initialize the colormap
     uint32_t colormap[8];
     for (int i = 0; i < 8; ++i)
-        colormap[i] = SDL_MapRGB(surfaces_[i]->format, colortable[i + COLORTABLE_CHAR_OFFSET][0],
-                colortable[i + COLORTABLE_CHAR_OFFSET][1], colortable[i + COLORTABLE_CHAR_OFFSET][2]);
+        colormap[i] = g_framebuffer->map_object_color(surfaces_[i], i + COLORTABLE_CHAR_OFFSET);
 
     // Draw the chars
     cout << "Creating chars" << endl;;
@@ -111,7 +108,7 @@ void Chars::init()
 
 void Chars::create_chars(SDL_Surface *surface, uint32_t color)
 {
-    memset(surface->pixels, SDL_ALPHA_TRANSPARENT, surface->pitch * 16);
+    g_framebuffer->clear_object_surface(surface);
 
     for (int chr_idx = 0; chr_idx < NUM_CHARS; ++chr_idx) {
         for (int byte_idx = 0; byte_idx < 8; ++byte_idx) {
@@ -137,7 +134,7 @@ inline SDL_Rect Chars::get_rect(int index, int cut_top, int cut_bottom)
     return r;
 }
 
-inline void Chars::draw_char(int x, int y, uint8_t *ptr, SDL_Rect &clip_r, int cut_bottom)
+inline void Chars::draw_char(Canvas &canvas, int x, int y, uint8_t *ptr, SDL_Rect &clip_r, int cut_bottom)
 {
     if (x < 4 || x > 228 || y + 16 < clip_r.y || y > clip_r.y + clip_r.h)
         return;
@@ -146,24 +143,68 @@ inline void Chars::draw_char(int x, int y, uint8_t *ptr, SDL_Rect &clip_r, int c
     uint8_t &control = ptr[3];
 
     int charset_index = (ptr[2] + ((control & 1 << 0) << 8) + y / 2) % (NUM_CHARS * 8);
+    int color = (control & (1 << 1 | 1 << 2 | 1 << 3)) >> 1;
+
+    if (canvas.composes_objects()) {
+        // Rows past the end of the charset are cut, just like they are when
+        // blitting from the surfaces
+        int num_rows = cut_bottom == -1 ? 8 - charset_index % 8 : cut_bottom;
+        num_rows = min(num_rows, NUM_CHARS * 8 - charset_index);
+        SDL_Rect r = {x * Framebuffer::SCREEN_WIDTH_MULTIPLIER - 1, y,
+            8 * Framebuffer::SCREEN_WIDTH_MULTIPLIER, num_rows * 2};
+        canvas.draw_pattern(r, charset_index, Framebuffer::SCREEN_WIDTH_MULTIPLIER, 2, 0, color);
+        return;
+    }
+
     SDL_Rect r = get_rect(charset_index, charset_index % 8, cut_bottom);
 
     // Note that chars are 1/Framebuffer::SCREEN_WIDTH_MULTIPLIER pixels shifted to the left
-    g_framebuffer->paste_surface(x * Framebuffer::SCREEN_WIDTH_MULTIPLIER - 1, y,
-            surfaces_[(control & (1 << 1 | 1 << 2 | 1 << 3)) >> 1], r);
+    COUNT_SHARED(SURFACES_PASTED, 1);
+    canvas.paste_surface(x * Framebuffer::SCREEN_WIDTH_MULTIPLIER - 1, y,
+            surfaces_[color], r);
+}
+
+void Chars::draw_text(Canvas &canvas, int x, int y, const char *text, int color)
+{
+    // The characters of the charset, in order. Multiplication and division
+    // signs have no ASCII counterpart.
+    static const char glyphs[] = "0123456789:$ ?LP+WERTUIOQSDFGHJKAZXCVBM.-\1\1=YN/";
+
+    for (; *text; ++text, x += 8 * Framebuffer::SCREEN_WIDTH_MULTIPLIER) {
+        const char *glyph = strchr(glyphs, toupper(*text));
+        int charset_index = (glyph && *glyph != '\1' ? glyph - glyphs : 12) * 8;
+
+        if (canvas.composes_objects()) {
+            SDL_Rect r = {x, y, 8 * Framebuffer::SCREEN_WIDTH_MULTIPLIER, 16};
+            canvas.draw_pattern(r, charset_index, Framebuffer::SCREEN_WIDTH_MULTIPLIER, 2, 0, color);
+        }
+        else {
+            SDL_Rect r = get_rect(charset_index, 0, -1);
+            canvas.paste_surface(x, y, surfaces_[color], r);
+        }
+    }
 }
 
-void Chars::draw(uint8_t *mem, SDL_Rect &clip_r)
+void Chars::draw(Canvas &canvas, uint8_t *mem, SDL_Rect &clip_r, uint32_t objects)
 {
-    for (uint8_t *ptr = &mem[CHARS_START]; ptr != &mem[CHARS_START + 48]; ptr += 4)
-        draw_char(ptr[1], ptr[0], ptr, clip_r);
+    PROFILE_ZONE(CHARS);
+
+    int slot = SINGLE_SLOTS_START;
+    for (uint8_t *ptr = &mem[CHARS_START]; ptr != &mem[CHARS_START + 48]; ptr += 4, ++slot) {
+        if (objects & 1 << slot)
+            draw_char(canvas, ptr[1], ptr[0], ptr, clip_r);
+    }
+
+    slot = QUAD_SLOTS_START;
+    for (uint8_t *ptr = &mem[QUADS_START]; ptr != &mem[QUADS_START + 64]; ptr += 16, slot += 4) {
+        if (!(objects & 0xf << slot))
+            continue;
 
-    for (uint8_t *ptr = &mem[QUADS_START]; ptr != &mem[QUADS_START + 64]; ptr += 16) {
         int y = ptr[0];
         int x = ptr[1];
         int cut_bottom = 8 - (ptr[14] + (ptr[15] & 1 << 0) + y / 2) % 8;
         for (int i = 0; i < 16; i += 4) {
-            draw_char(x, y, &ptr[i], clip_r, cut_bottom);
+            draw_char(canvas, x, y, &ptr[i], clip_r, cut_bottom);
             x += 16;
         }
     }
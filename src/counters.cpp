@@ -0,0 +1,140 @@
+#include "common.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#if defined(HAVE_SYS_SOCKET_H) && defined(HAVE_SYS_UN_H)
+# define COUNTERS_UNIX_SOCKET
+# include <sys/socket.h>
+# include <sys/un.h>
+#endif
+
+#include "counters.h"
+
+Counters g_counters;
+
+const char *const Counters::names_[NUM_COUNTERS] = {
+    "instructions",
+    "cycles",
+    "interrupts",
+    "vdc_reads",
+    "vdc_writes",
+    "extram_reads",
+    "extram_writes",
+    "bank_switches",
+    "screen_updates",
+    "pixels_redrawn",
+    "rects_filled",
+    "surfaces_pasted",
+    "blit_nsecs"
+};
+
+Counters::~Counters()
+{
+    if (file_)
+        fclose(file_);
+#ifdef COUNTERS_UNIX_SOCKET
+    if (socket_ != -1)
+        close(socket_);
+#endif
+}
+
+void Counters::init(const string &output, unsigned int interval)
+{
+    if (output.empty())
+        return;
+
+#ifndef ENABLE_COUNTERS
+    LOGWARNING << "Performance counters weren't enabled at build time, ignoring counters_output" << endl;
+    return;
+#endif
+
+    interval_ = max(interval, 1U);
+
+    if (output.compare(0, 5, "unix:") == 0) {
+#ifdef COUNTERS_UNIX_SOCKET
+        socket_path_ = output.substr(5);
+        if (socket_path_.size() >= sizeof(((sockaddr_un *)NULL)->sun_path))
+            throw runtime_error("Counters socket path is too long");
+        if (!connect_socket())
+            LOGWARNING << "Unable to connect to " << socket_path_ << ", will keep trying" << endl;
+#else
+        throw runtime_error("Unix sockets aren't supported on this platform");
+#endif
+    }
+    else {
+        file_ = fopen(output.c_str(), "a");
+        if (!file_)
+            throw runtime_error(string("Unable to open ") + output + ": " + strerror(errno));
+    }
+    cout << "Writing performance counters to " << output << " every " << interval_ << " frames" << endl;
+}
+
+bool Counters::connect_socket()
+{
+#ifdef COUNTERS_UNIX_SOCKET
+    socket_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socket_ == -1)
+        return false;
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path_.c_str());
+    if (connect(socket_, (sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(socket_);
+        socket_ = -1;
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+void Counters::write_line(const string &line)
+{
+    if (file_) {
+        fputs(line.c_str(), file_);
+        fflush(file_);
+        return;
+    }
+
+#ifdef COUNTERS_UNIX_SOCKET
+    // Lines are dropped while there's nobody listening, emulation never
+    // waits for the monitoring side
+    if (socket_ == -1 && !connect_socket())
+        return;
+
+    int flags = MSG_DONTWAIT;
+# ifdef MSG_NOSIGNAL
+    flags |= MSG_NOSIGNAL;
+# endif
+    if (send(socket_, line.data(), line.size(), flags) == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        close(socket_);
+        socket_ = -1;
+    }
+#endif
+}
+
+void Counters::end_frame()
+{
+    ++frame_;
+    if (!interval_ || ++frames_ < interval_)
+        return;
+
+    ostringstream oss;
+    oss << "{\"frame\": " << frame_ << ", \"frames\": " << frames_;
+    for (int i = 0; i < NUM_COUNTERS; ++i)
+        oss << ", \"" << names_[i] << "\": " << counters_[i];
+    oss << "}\n";
+    write_line(oss.str());
+
+    fill(counters_, counters_ + NUM_COUNTERS, 0);
+    frames_ = 0;
+}
@@ -1,13 +1,18 @@
 #include "common.h"
 
+#include <algorithm>
 #include <iomanip>
 #include <iostream>
 
 #include "cpu.h"
 
+#include "counters.h"
+#include "heatmap.h"
+#include "latencytracer.h"
 #include "opcodes.h"
 #include "options.h"
 #include "rom.h"
+#include "tracering.h"
 
 Cpu g_cpu;
 
@@ -20,8 +25,131 @@ void Cpu::tcnt_increment()
     }
 }
 
+void Cpu::timer_sync()
+{
+    if (tcnt_status_ != TCNT_STATUS_TIMER_ON)
+        return;
+
+    if (reference_timer_) {
+        for (; cycles_ - timer_start_ >= TIMER_PRESCALER; timer_start_ += TIMER_PRESCALER)
+            tcnt_increment();
+        return;
+    }
+
+    uint64_t ticks = (cycles_ - timer_start_) / TIMER_PRESCALER;
+    if (!ticks)
+        return;
+    timer_start_ += ticks * TIMER_PRESCALER;
+
+    if (ticks >= (uint64_t)(0x100 - tcnt_)) {
+        tcnt_overflow_ = true;
+        if (tcntirq_en_)
+            tcntirq_pending_ = true;
+    }
+    tcnt_ = (tcnt_ + ticks) & 0xff;
+    timer_schedule();
+}
+
+void Cpu::timer_schedule()
+{
+    if (tcnt_status_ == TCNT_STATUS_TIMER_ON)
+        next_event_ = reference_timer_ ? 0 : timer_start_ + (0x100 - tcnt_) * TIMER_PRESCALER;
+    else
+        next_event_ = NO_EVENT;
+}
+
+void Cpu::timer_start()
+{
+    if (tcnt_status_ == TCNT_STATUS_TIMER_ON)
+        return;
+
+    // Carry on from wherever the prescaler was when the timer was stopped
+    tcnt_status_ = TCNT_STATUS_TIMER_ON;
+    timer_start_ = cycles_ - prescaler_;
+    timer_schedule();
+}
+
+void Cpu::timer_stop()
+{
+    if (tcnt_status_ != TCNT_STATUS_TIMER_ON)
+        return;
+
+    timer_sync();
+    prescaler_ = cycles_ - timer_start_;
+    tcnt_status_ = TCNT_STATUS_ALL_OFF;
+    timer_schedule();
+}
+
+inline int Cpu::retire(int clock)
+{
+    COUNT(INSTRUCTIONS, 1);
+    COUNT(CYCLES, clock);
+
+    cycles_ += clock;
+    if (cycles_ >= next_event_)
+        timer_sync();
+    return clock;
+}
+
+void Cpu::save_state(state_t &state)
+{
+    timer_sync();
+
+    state.pc = pc_;
+    state.last_pc = last_pc_;
+    state.a11_on = a11_on_;
+    state.acc = acc_;
+    state.f1 = f1_;
+    state.psw = psw_();
+    state.tcnt_status = tcnt_status_;
+    state.tcnt_overflow = tcnt_overflow_;
+    state.tcnt = tcnt_;
+    state.prescaler = tcnt_status_ == TCNT_STATUS_TIMER_ON ? cycles_ - timer_start_ : prescaler_;
+    state.cycles = cycles_;
+    state.extirq_en = extirq_en_;
+    state.tcntirq_en = tcntirq_en_;
+    state.extirq_pending = extirq_pending_;
+    state.tcntirq_pending = tcntirq_pending_;
+    state.in_irq = in_irq_;
+    copy(intram_.begin(), intram_.end(), state.intram);
+}
+
+void Cpu::load_state(const state_t &state)
+{
+    pc_ = state.pc;
+    last_pc_ = state.last_pc;
+    a11_on_ = state.a11_on;
+    acc_ = state.acc;
+    f1_ = state.f1;
+
+    psw_.cy = state.psw >> 7;
+    psw_.ac = state.psw & 1 << 6;
+    psw_.f0 = state.psw & 1 << 5;
+    psw_.bs = state.psw & 1 << 4;
+    psw_.sp = state.psw & (1 << 2 | 1 << 1 | 1 << 0);
+
+    tcnt_status_ = state.tcnt_status;
+    tcnt_overflow_ = state.tcnt_overflow;
+    tcnt_ = state.tcnt;
+    cycles_ = state.cycles;
+    prescaler_ = state.prescaler;
+    timer_start_ = cycles_ - prescaler_;
+    timer_schedule();
+
+    extirq_en_ = state.extirq_en;
+    tcntirq_en_ = state.tcntirq_en;
+    extirq_pending_ = state.extirq_pending;
+    tcntirq_pending_ = state.tcntirq_pending;
+    in_irq_ = state.in_irq;
+
+    copy(state.intram, state.intram + INTRAM_SIZE, intram_.begin());
+    regptr_ = psw_.bs ? &intram_[STACK_START + STACK_SIZE] : &intram_[0];
+}
+
 void Cpu::debug_print(ostream &out)
 {
+    timer_sync();
+
     out << setfill('0') << hex;
 
     out << "0x" << setw(4) << last_pc_ << ": " << opcode_names[g_rom[last_pc_]]
@@ -50,13 +178,16 @@ void Cpu::debug_print(ostream &out)
 
 inline void Cpu::push(uint8_t val)
 {
+    HEAT(INTRAM, WRITE, STACK_START + psw_.sp);
     intram_[STACK_START + psw_.sp] = val;
     ++psw_.sp %= STACK_SIZE;
 }
 
 inline uint8_t Cpu::pop()
 {
-    return intram_[STACK_START + --psw_.sp];
+    --psw_.sp;
+    HEAT(INTRAM, READ, STACK_START + psw_.sp);
+    return intram_[STACK_START + psw_.sp];
 }
 
 inline void Cpu::add(uint8_t val)
@@ -116,12 +247,115 @@ inline void Cpu::call(int page)
 
 inline void Cpu::irq(int addr)
 {
+    COUNT(INTERRUPTS, 1);
+    TRACE(IRQ, addr, 0);
     in_irq_ = true;
     push(pc_ & 0xff);
     push((pc_ & 0xf00) >> 8 | (psw_() & 0xf0));
     pc_ = addr;
 }
 
+int Cpu::debug_next_accesses(access_t *accesses) const
+{
+    int num_accesses = 0;
+#define ACCESS(ext, addr, wr) \
+    do { \
+        accesses[num_accesses].external = ext; \
+        accesses[num_accesses].address = addr; \
+        accesses[num_accesses++].write = wr; \
+    } while (0)
+
+    // Taking an interrupt pushes the return address
+    if (!in_irq_ && (extirq_pending_ || tcntirq_pending_)) {
+        ACCESS(false, STACK_START + psw_.sp, true);
+        ACCESS(false, STACK_START + (psw_.sp + 1) % STACK_SIZE, true);
+        return num_accesses;
+    }
+
+    uint8_t opcode = g_rom[pc_];
+    int group = opcode >> 4;
+    int regs = regptr_ - &intram_[0];
+
+    if ((opcode & 0x0f) >= 0x08) {
+        // Rn in the upper half of most rows
+        int reg = regs + (opcode & 0x07);
+        switch (group) {
+            case 0x1: // INC Rn
+            case 0x2: // XCH A, Rn
+            case 0xc: // DEC Rn
+            case 0xe: // DJNZ Rn
+                ACCESS(false, reg, false);
+                ACCESS(false, reg, true);
+                break;
+            case 0x4: // ORL A, Rn
+            case 0x5: // ANL A, Rn
+            case 0x6: // ADD A, Rn
+            case 0x7: // ADDC A, Rn
+            case 0xd: // XRL A, Rn
+            case 0xf: // MOV A, Rn
+                ACCESS(false, reg, false);
+                break;
+            case 0xa: // MOV Rn, A
+            case 0xb: // MOV Rn, #data
+                ACCESS(false, reg, true);
+                break;
+        }
+    }
+    else if ((opcode & 0x0f) < 0x02) {
+        // @Rn in the first two columns
+        int reg = regs + (opcode & 0x01);
+        int target = regptr_[opcode & 0x01] & (INTRAM_SIZE - 1);
+        switch (group) {
+            case 0x1: // INC @Rn
+            case 0x2: // XCH A, @Rn
+            case 0x3: // XCHD A, @Rn
+                ACCESS(false, reg, false);
+                ACCESS(false, target, false);
+                ACCESS(false, target, true);
+                break;
+            case 0x4: // ORL A, @Rn
+            case 0x5: // ANL A, @Rn
+            case 0x6: // ADD A, @Rn
+            case 0x7: // ADDC A, @Rn
+            case 0xd: // XRL A, @Rn
+            case 0xf: // MOV A, @Rn
+                ACCESS(false, reg, false);
+                ACCESS(false, target, false);
+                break;
+            case 0xa: // MOV @Rn, A
+            case 0xb: // MOV @Rn, #data
+                ACCESS(false, reg, false);
+                ACCESS(false, target, true);
+                break;
+            case 0x8: // MOVX A, @Rn
+                ACCESS(false, reg, false);
+                ACCESS(true, regptr_[opcode & 0x01], false);
+                break;
+            case 0x9: // MOVX @Rn, A
+                ACCESS(false, reg, false);
+                ACCESS(true, regptr_[opcode & 0x01], true);
+                break;
+        }
+    }
+    else if ((opcode & 0x1f) == 0x14) {
+        // CALL
+        ACCESS(false, STACK_START + psw_.sp, true);
+        ACCESS(false, STACK_START + (psw_.sp + 1) % STACK_SIZE, true);
+    }
+    else if (opcode == 0x83 || opcode == 0x93) {
+        // RET and RETR
+        ACCESS(false, STACK_START + (psw_.sp + STACK_SIZE - 1) % STACK_SIZE, false);
+        ACCESS(false, STACK_START + (psw_.sp + STACK_SIZE - 2) % STACK_SIZE, false);
+    }
+
+#undef ACCESS
+    return num_accesses;
+}
+
+// Accesses to the working registers and to what they point to
+#define HEAT_REG(access, n) HEAT(INTRAM, access, regptr_ - &intram_[0] + n)
+#define HEAT_RPTR(access, n) HEAT(INTRAM, access, r(n) & (INTRAM_SIZE - 1))
+
 int Cpu::step()
 {
     last_pc_ = pc_;
@@ -129,17 +363,18 @@ int Cpu::step()
     if (!in_irq_) {
         if (extirq_pending_) {
             irq(CPU_EXTIRQ_INTERRUPT_VECTOR);
-            return 2;
+            return retire(2);
         }
         else if (tcntirq_pending_) {
             tcntirq_pending_ = false;
             irq(CPU_TCNTIRQ_INTERRUPT_VECTOR);
-            return 2;
+            return retire(2);
         }
     }
 
     uint8_t opcode = g_rom[pc_++];
     pc_ = pc_ & (Rom::BANK_SIZE - 1);
+    TRACE(INSTRUCTION, opcode, acc_);
     int clock;
 
 #ifdef DEBUG
@@ -170,6 +405,7 @@ int Cpu::step()
             clock = 1;
             break;
         case 0x08: // INS A, BUS
+            g_latency_tracer.scan();
             acc_ = g_joysticks.get_bus();
             clock = 2;
             break;
@@ -178,6 +414,7 @@ int Cpu::step()
             clock = 2;
             break;
         case 0x0a: // IN A, P2
+            g_latency_tracer.scan();
             g_keyboard.calculate_p2();
             acc_ = g_p2;
             clock = 2;
@@ -194,6 +431,9 @@ int Cpu::step()
         MOVD_A_P(3, p7_)
 #define INC_RPTR(n) \
         case 0x10 + n: \
+            HEAT_REG(READ, n); \
+            HEAT_RPTR(READ, n); \
+            HEAT_RPTR(WRITE, n); \
             intram_[r(n) & (INTRAM_SIZE - 1)]++; \
             clock = 1; \
             break;
@@ -217,6 +457,7 @@ int Cpu::step()
             clock = 1;
             break;
         case 0x16: // JTF
+            timer_sync();
             jmp_if(tcnt_overflow_);
             tcnt_overflow_ = false;
             clock = 2;
@@ -227,6 +468,8 @@ int Cpu::step()
             break;
 #define INC_R(n) \
         case 0x18 + n: \
+            HEAT_REG(READ, n); \
+            HEAT_REG(WRITE, n); \
             ++r(n); \
             clock = 1; \
             break;
@@ -241,6 +484,9 @@ int Cpu::step()
         INC_R(7)
 #define XCH_A_RPTR(n) \
         case 0x20 + n: \
+            HEAT_REG(READ, n); \
+            HEAT_RPTR(READ, n); \
+            HEAT_RPTR(WRITE, n); \
             tmp = (uint8_t)acc_; \
             acc_ = intram_[r(n) & (INTRAM_SIZE - 1)]; \
             intram_[r(n) & (INTRAM_SIZE - 1)] = tmp; \
@@ -258,6 +504,7 @@ int Cpu::step()
             clock = 2;
             break;
         case 0x25: // EN TCNTI
+            timer_sync();
             tcntirq_en_ = true;
             clock = 1;
             break;
@@ -271,6 +518,8 @@ int Cpu::step()
             break;
 #define XCH_A_R(n) \
         case 0x28 + n: \
+            HEAT_REG(READ, n); \
+            HEAT_REG(WRITE, n); \
             tmp = (uint8_t)acc_; \
             acc_ = r(n); \
             r(n) = tmp; \
@@ -287,6 +536,9 @@ int Cpu::step()
         XCH_A_R(7)
 #define XCHD_A_RPTR(n) \
         case 0x30 + n: \
+            HEAT_REG(READ, n); \
+            HEAT_RPTR(READ, n); \
+            HEAT_RPTR(WRITE, n); \
             tmp = (uint8_t)acc_ & 0x0f; \
             acc_ = (acc_ & 0xf0) | (intram_[r(n) & (INTRAM_SIZE - 1)] & 0x0f); \
             intram_[r(n) & 0x3f] = (intram_[r(n) & (INTRAM_SIZE - 1)] \
@@ -305,6 +557,7 @@ int Cpu::step()
             clock = 2;
             break;
         case 0x35: // DIS TCNTI
+            timer_sync();
             tcntirq_en_ = false;
             clock = 1;
             break;
@@ -317,8 +570,7 @@ int Cpu::step()
             clock = 1;
             break;
         case 0x39: // OUTL P1, A
-            g_p1 = acc_;
-            g_rom.calculate_current_bank();
+            write_p1(acc_);
             clock = 2;
             break;
         case 0x3a: // OUTL P2, A
@@ -336,6 +588,8 @@ int Cpu::step()
         MOVD_P_A(3, p7_)
 #define ORL_A_RPTR(n) \
         case 0x40 + n: \
+            HEAT_REG(READ, n); \
+            HEAT_RPTR(READ, n); \
             acc_ |= intram_[r(n) & (INTRAM_SIZE - 1)]; \
             clock = 1; \
             break;
@@ -343,6 +597,7 @@ int Cpu::step()
         ORL_A_RPTR(0)
         ORL_A_RPTR(1)
         case 0x42: // MOV A, T
+            timer_sync();
             acc_ = tcnt_;
             clock = 1;
             break;
@@ -355,6 +610,7 @@ int Cpu::step()
             clock = 2;
             break;
         case 0x45: // STRT CNT
+            timer_stop();
             tcnt_status_ = TCNT_STATUS_COUNTER_ON;
             clock = 1;
             break;
@@ -368,6 +624,7 @@ int Cpu::step()
             break;
 #define ORL_A_R(n) \
         case 0x48 + n: \
+            HEAT_REG(READ, n); \
             acc_ |= r(n); \
             clock = 1; \
             break;
@@ -382,6 +639,8 @@ int Cpu::step()
         ORL_A_R(7)
 #define ANL_A_RPTR(n) \
         case 0x50 + n: \
+            HEAT_REG(READ, n); \
+            HEAT_RPTR(READ, n); \
             acc_ &= intram_[r(n) & (INTRAM_SIZE - 1)]; \
             clock = 1; \
             break;
@@ -401,7 +660,7 @@ int Cpu::step()
             clock = 2;
             break;
         case 0x55: // STRT T
-            tcnt_status_ = TCNT_STATUS_TIMER_ON;
+            timer_start();
             clock = 1;
             break;
         case 0x56: // JT1
@@ -426,6 +685,7 @@ int Cpu::step()
             break;
 #define ANL_A_R(n) \
         case 0x58 + n: \
+            HEAT_REG(READ, n); \
             acc_ &= r(n); \
             clock = 1; \
             break;
@@ -440,6 +700,8 @@ int Cpu::step()
         ANL_A_R(7)
 #define ADD_A_RPTR(n) \
         case 0x60 + n: \
+            HEAT_REG(READ, n); \
+            HEAT_RPTR(READ, n); \
             add(intram_[r(n) & (INTRAM_SIZE - 1)]); \
             clock = 1; \
             break;
@@ -447,7 +709,9 @@ int Cpu::step()
         ADD_A_RPTR(0)
         ADD_A_RPTR(1)
         case 0x62: // MOV T, A
+            timer_sync();
             tcnt_ = acc_;
+            timer_schedule();
             clock = 1;
             break;
         case 0x64: // JMP (page 3)
@@ -455,6 +719,7 @@ int Cpu::step()
             clock = 2;
             break;
         case 0x65: // STOP TCNT
+            timer_stop();
             tcnt_status_ = TCNT_STATUS_ALL_OFF;
             clock = 1;
             break;
@@ -466,6 +731,7 @@ int Cpu::step()
             break;
 #define ADD_A_R(n) \
         case 0x68 + n: \
+            HEAT_REG(READ, n); \
             add(r(n)); \
             clock = 1; \
             break;
@@ -480,6 +746,8 @@ int Cpu::step()
         ADD_A_R(7)
 #define ADDC_A_RPTR(n) \
         case 0x70 + n: \
+            HEAT_REG(READ, n); \
+            HEAT_RPTR(READ, n); \
             addc(intram_[r(n) & (INTRAM_SIZE - 1)]); \
             clock = 1; \
             break;
@@ -505,6 +773,7 @@ int Cpu::step()
             break;
 #define ADDC_A_R(n) \
         case 0x78 + n: \
+            HEAT_REG(READ, n); \
             addc(r(n));
             clock = 1;
             break;
@@ -519,6 +788,7 @@ int Cpu::step()
         ADDC_A_R(7)
 #define MOVX_A_RPTR(n) \
         case 0x80 + n: \
+            HEAT_REG(READ, n); \
             g_extstorage.read(r(n), acc_); \
             clock = 2; \
             break;
@@ -543,8 +813,7 @@ int Cpu::step()
             clock = 2;
             break;
         case 0x89: // ORL P1, #data
-            g_p1 |= g_rom[pc_++];
-            g_rom.calculate_current_bank();
+            write_p1(g_p1 | g_rom[pc_++]);
             clock = 2;
             break;
         case 0x8a: // ORL P2, #data
@@ -562,6 +831,7 @@ int Cpu::step()
         ORLD_P_A(3, p7_)
 #define MOVX_RPTR_A(n) \
         case 0x90 + n: \
+            HEAT_REG(READ, n); \
             g_extstorage.write(r(n), acc_); \
             clock = 2; \
             break;
@@ -597,8 +867,7 @@ int Cpu::step()
             clock = 1;
             break;
         case 0x99: // ANL P1, #data
-            g_p1 &= g_rom[pc_++];
-            g_rom.calculate_current_bank();
+            write_p1(g_p1 & g_rom[pc_++]);
             clock = 2;
             break;
         case 0x9a: // ANL P2, #data
@@ -616,6 +885,8 @@ int Cpu::step()
         ANLD_P_A(3, p7_)
 #define MOV_RPTR_A(n) \
         case 0xa0 + n: \
+            HEAT_REG(READ, n); \
+            HEAT_RPTR(WRITE, n); \
             intram_[r(n) & (INTRAM_SIZE - 1)] = acc_; \
             clock = 1; \
             break;
@@ -640,6 +911,7 @@ int Cpu::step()
             break;
 #define MOV_R_A(n) \
         case 0xa8 + n: \
+            HEAT_REG(WRITE, n); \
             r(n) = acc_; \
             clock = 1; \
             break;
@@ -654,6 +926,8 @@ int Cpu::step()
         MOV_R_A(7)
 #define MOV_RPTR_DATA(n) \
         case 0xb0 + n: \
+            HEAT_REG(READ, n); \
+            HEAT_RPTR(WRITE, n); \
             intram_[r(n) & (INTRAM_SIZE - 1)] = g_rom[pc_++]; \
             clock = 2; \
             break;
@@ -682,6 +956,7 @@ int Cpu::step()
             break;
 #define MOV_R_DATA(n) \
         case 0xB8 + n: \
+            HEAT_REG(WRITE, n); \
             r(n) = g_rom[pc_++]; \
             clock = 2; \
             break;
@@ -712,6 +987,8 @@ int Cpu::step()
             break;
 #define DEC_R(n) \
         case 0xc8 + n: \
+            HEAT_REG(READ, n); \
+            HEAT_REG(WRITE, n); \
             --r(n); \
             clock = 1; \
             break;
@@ -726,7 +1003,9 @@ int Cpu::step()
         DEC_R(7)
 #define XRL_A_RPTR(n) \
         case 0xd0 + n: \
-            acc_ ^= g_rom[r(n) & (INTRAM_SIZE - 1)]; \
+            HEAT_REG(READ, n); \
+            HEAT_RPTR(READ, n); \
+            acc_ ^= intram_[r(n) & (INTRAM_SIZE - 1)]; \
             clock = 1; \
             break;
         // XRL A, @Rn
@@ -754,6 +1033,7 @@ int Cpu::step()
             break;
 #define XRL_A_R(n) \
         case 0xd8 + n: \
+            HEAT_REG(READ, n); \
             acc_ ^= r(n); \
             clock = 1; \
             break;
@@ -788,6 +1068,8 @@ int Cpu::step()
             break;
 #define DJNZ_R(n) \
         case 0xe8 + n: \
+            HEAT_REG(READ, n); \
+            HEAT_REG(WRITE, n); \
             jmp_if(--r(n)); \
             clock = 2; \
             break;
@@ -802,6 +1084,8 @@ int Cpu::step()
         DJNZ_R(7)
 #define MOV_A_RPTR(n) \
         case 0xf0 + n: \
+            HEAT_REG(READ, n); \
+            HEAT_RPTR(READ, n); \
             acc_ = intram_[r(n) & (INTRAM_SIZE - 1)]; \
             clock = 1; \
             break;
@@ -834,6 +1118,7 @@ int Cpu::step()
             break;
 #define MOV_A_R(n) \
         case 0xf8 + n: \
+            HEAT_REG(READ, n); \
             acc_ = r(n); \
             clock = 1; \
             break;
@@ -847,7 +1132,12 @@ int Cpu::step()
         MOV_A_R(6)
         MOV_A_R(7)
         default:
-            cout << "Caught illegal instruction!" << endl;
+            // Some games run into these all the time, so only the first one is reported
+            TRACE(ILLEGAL, opcode, 0);
+            if (!illegal_reported_ || g_options.debug_on_ill) {
+                cout << "Caught illegal instruction!" << endl;
+                illegal_reported_ = true;
+            }
             if (g_options.debug_on_ill) {
                 debug_print(cout);
                 g_options.debug = true;
@@ -856,17 +1146,8 @@ int Cpu::step()
             break;
     }
 
-    if (tcnt_status_ == TCNT_STATUS_TIMER_ON) {
-        // Increment the timer every 32 8048 cycles
-        timer_timer_ -= clock;
-        if (timer_timer_ <= 0) {
-            timer_timer_ = TIMER_TIMER_INITIAL_VALUE;
-            tcnt_increment();
-        }
-    }
-
     assert(pc_ >= 0 && pc_ < Rom::BANK_SIZE);
     assert(acc_ >= 0 && acc_ <= 0xff);
     assert(clock == 1 || clock == 2);
-    return clock;
+    return retire(clock);
 }
@@ -3,3 +3,32 @@
 #include "extstorage.h"
 
 ExternalStorage g_extstorage;
+
+void ExternalStorage::calculate_bus_targets()
+{
+    if (reference_decode_) {
+        read_target_ = READ_REFERENCE;
+        write_target_ = WRITE_REFERENCE;
+        return;
+    }
+
+    if (p1_bit_low(3) && p1_bit_high(4) && p1_bit_low(6))
+        read_target_ = READ_VDC;
+    else if ((p1_bit_low(3) && p1_bit_low(4) && p1_bit_high(6)) || (p1_bit_high(3) && p1_bit_low(4)))
+        read_target_ = READ_EXTRAM;
+    else if (!g_p1)
+        read_target_ = READ_JUNK;
+    else
+        read_target_ = READ_NONE;
+
+    bool vdc = p1_bit_low(3);
+    bool extram = p1_bit_low(4) && p1_bit_low(6);
+    if (vdc && extram)
+        write_target_ = WRITE_BOTH;
+    else if (vdc)
+        write_target_ = WRITE_VDC;
+    else if (extram)
+        write_target_ = WRITE_EXTRAM;
+    else
+        write_target_ = WRITE_NONE;
+}
@@ -1,10 +1,14 @@
 #include "common.h"
 
+#include <cstring>
 #include <sstream>
+#include <stdexcept>
 
 #include "framebuffer.h"
 
+#include "colors.h"
 #include "options.h"
+#include "workerpool.h"
 
 Framebuffer *g_framebuffer = NULL;
 
@@ -30,6 +34,17 @@ const uint8_t Framebuffer::colortable_[Framebuffer::COLORTABLE_SIZE][3] = {
     {225, 209, 225}  // light gray
 };
 
+const int Framebuffer::object_colors_[8] = {
+    0, // dark gray
+    4, // red
+    2, // green
+    6, // yellow
+    1, // blue
+    5, // violet
+    3, // cyan
+    7  // white
+};
+
 Framebuffer::Framebuffer()
 {
     if (g_options.keep_aspect) {
@@ -57,6 +72,57 @@ Framebuffer::Framebuffer()
     }
 }
 
+Framebuffer::~Framebuffer()
+{
+    for (size_t i = 0; i < bands_.size(); ++i)
+        delete bands_[i];
+}
+
+void Framebuffer::create_bands(SDL_Surface *surface, const Uint32 *colormap)
+{
+    int num_bands = g_workers.size();
+    if (num_bands < 2)
+        return;
+
+    Uint32 object_colormap[8];
+    for (int i = 0; i < 8; ++i)
+        object_colormap[i] = colormap[object_colors_[i]];
+
+    for (int i = 0; i < num_bands; ++i) {
+        int y = SCREEN_HEIGHT * i / num_bands;
+        int y_end = SCREEN_HEIGHT * (i + 1) / num_bands;
+        bands_.push_back(new BandCanvas(surface, y, y_end - y, colormap, object_colormap));
+    }
+}
+
+void Framebuffer::retarget_bands(SDL_Surface *surface)
+{
+    for (size_t i = 0; i < bands_.size(); ++i)
+        bands_[i]->retarget(surface);
+}
+
+SDL_Surface *Framebuffer::create_object_surface(int w, int h)
+{
+    SDL_Surface *surface = SDL_CreateRGBSurface(SDL_HWSURFACE, w, h, 32,
+            TRANSPARENT_RMASK, TRANSPARENT_GMASK, TRANSPARENT_BMASK, TRANSPARENT_AMASK);
+    if (!surface)
+        throw runtime_error(SDL_GetError());
+    else if (surface->format->BitsPerPixel != 32)
+        throw runtime_error("Unable to create a 32bpp surface");
+    return surface;
+}
+
+Uint32 Framebuffer::map_object_color(SDL_Surface *surface, int color)
+{
+    const uint8_t *rgb = colortable_[object_colors_[color]];
+    return SDL_MapRGB(surface->format, rgb[0], rgb[1], rgb[2]);
+}
+
+void Framebuffer::clear_object_surface(SDL_Surface *surface)
+{
+    memset(surface->pixels, SDL_ALPHA_TRANSPARENT, surface->pitch * surface->h);
+}
+
 void Framebuffer::take_snapshot()
 {
     static int snapshot_index = 0;
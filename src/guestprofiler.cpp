@@ -0,0 +1,179 @@
+#include "common.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <iomanip>
+
+#include "guestprofiler.h"
+
+GuestProfiler g_guest_profiler;
+
+namespace {
+    struct routine_t {
+        int bank, entry, hottest;
+        uint64_t instructions, cycles;
+    };
+
+    bool hotter(const routine_t &a, const routine_t &b)
+    {
+        return a.cycles > b.cycles;
+    }
+}
+
+int GuestProfiler::instruction_length(uint8_t opcode)
+{
+    switch (opcode) {
+        // Immediate operands
+        case 0x03: case 0x13: case 0x23: case 0x43: case 0x53: case 0xd3:
+        case 0x88: case 0x89: case 0x8a: case 0x98: case 0x99: case 0x9a:
+        case 0xb0: case 0xb1:
+        case 0xb8: case 0xb9: case 0xba: case 0xbb: case 0xbc: case 0xbd: case 0xbe: case 0xbf:
+        // Conditional jumps
+        case 0x16: case 0x26: case 0x36: case 0x46: case 0x56: case 0x76: case 0x86:
+        case 0x96: case 0xb6: case 0xc6: case 0xe6: case 0xf6:
+        case 0xe8: case 0xe9: case 0xea: case 0xeb: case 0xec: case 0xed: case 0xee: case 0xef:
+            return 2;
+        default:
+            // JMP, CALL and JBb
+            switch (opcode & 0x1f) {
+                case 0x04: case 0x14: case 0x12:
+                    return 2;
+                default:
+                    return 1;
+            }
+    }
+}
+
+void GuestProfiler::enable()
+{
+    if (!enabled_) {
+        enabled_ = true;
+        reset();
+    }
+}
+
+void GuestProfiler::reset()
+{
+    instructions_.assign(NUM_ADDRESSES, 0);
+    cycles_.assign(NUM_ADDRESSES, 0);
+    entries_.assign(NUM_ADDRESSES, 0);
+    call_pending_ = false;
+
+    // The reset and interrupt vectors
+    for (int bank = 0; bank < NUM_BANKS; ++bank) {
+        entries_[bank * Rom::BANK_SIZE + 0x000] = 1;
+        entries_[bank * Rom::BANK_SIZE + 0x003] = 1;
+        entries_[bank * Rom::BANK_SIZE + 0x007] = 1;
+    }
+}
+
+void GuestProfiler::debug_print_report(ostream &out) const
+{
+    if (!enabled_) {
+        out << "The guest profiler is disabled" << endl;
+        return;
+    }
+
+    // Charge every address to the closest entry at or before it
+    vector<routine_t> routines;
+    uint64_t total_instructions = 0, total_cycles = 0;
+    for (int bank = 0; bank < NUM_BANKS; ++bank) {
+        const int base = bank * Rom::BANK_SIZE;
+        for (int pc = 0; pc < Rom::BANK_SIZE; ++pc) {
+            if (entries_[base + pc] && (routines.empty() || routines.back().instructions)) {
+                routine_t routine = {bank, pc, pc, 0, 0};
+                routines.push_back(routine);
+            }
+            else if (entries_[base + pc]) {
+                routines.back().bank = bank;
+                routines.back().entry = routines.back().hottest = pc;
+            }
+
+            if (!instructions_[base + pc])
+                continue;
+            routine_t &routine = routines.back();
+            routine.instructions += instructions_[base + pc];
+            routine.cycles += cycles_[base + pc];
+            if (cycles_[base + pc] > cycles_[base + routine.hottest])
+                routine.hottest = pc;
+
+            total_instructions += instructions_[base + pc];
+            total_cycles += cycles_[base + pc];
+        }
+    }
+    if (!total_cycles) {
+        out << "No guest code has been profiled yet" << endl;
+        return;
+    }
+
+    sort(routines.begin(), routines.end(), hotter);
+    while (!routines.back().instructions)
+        routines.pop_back();
+    if (routines.size() > (size_t)NUM_ROUTINES_SHOWN)
+        routines.resize(NUM_ROUTINES_SHOWN);
+
+    out << "Profiled " << total_instructions << " instructions over " << total_cycles
+        << " cycles, hottest routines:\n"
+        << "Bank  Entry      Cycles      %  Instructions  Hottest\n";
+    for (vector<routine_t>::const_iterator it = routines.begin(); it != routines.end(); ++it) {
+        out << setfill(' ') << dec << setw(4) << it->bank
+            << "  0x" << hex << setfill('0') << setw(3) << it->entry
+            << setfill(' ') << dec << setw(12) << it->cycles
+            << fixed << setprecision(1) << setw(7) << 100.0 * it->cycles / total_cycles
+            << setw(14) << it->instructions
+            << "  0x" << hex << setfill('0') << setw(3) << it->hottest << '\n';
+    }
+    out << setfill(' ') << dec;
+    out.unsetf(ios::floatfield);
+
+    vector<uint8_t> covered;
+    mark_covered(covered);
+    for (int bank = 0; bank < NUM_BANKS; ++bank) {
+        const int base = bank * Rom::BANK_SIZE;
+        out << "Bank " << bank << ": " << count(covered.begin() + base, covered.begin() + base + Rom::BANK_SIZE, 1)
+            << " of " << Rom::BANK_SIZE << " bytes executed\n";
+    }
+    out.flush();
+}
+
+void GuestProfiler::mark_covered(vector<uint8_t> &covered) const
+{
+    // Operands count as executed along with their instructions
+    covered.assign(NUM_ADDRESSES, 0);
+    for (int index = 0; index < NUM_ADDRESSES; ++index) {
+        if (!instructions_[index])
+            continue;
+        int bank = index / Rom::BANK_SIZE, pc = index % Rom::BANK_SIZE;
+        int end = min(pc + instruction_length(g_rom.at(bank, pc)), (int)Rom::BANK_SIZE);
+        fill(covered.begin() + index, covered.begin() + bank * Rom::BANK_SIZE + end, 1);
+    }
+}
+
+bool GuestProfiler::write_coverage(const string &path) const
+{
+    FILE *file = fopen(path.c_str(), "w");
+    if (!file)
+        return false;
+
+    vector<uint8_t> covered;
+    mark_covered(covered);
+
+    // Every bank is followed by the ranges of bytes that were executed in it
+    for (int bank = 0; bank < NUM_BANKS; ++bank) {
+        const int base = bank * Rom::BANK_SIZE;
+        fprintf(file, "bank %d: %d of %d bytes executed\n", bank,
+                (int)count(covered.begin() + base, covered.begin() + base + Rom::BANK_SIZE, 1), Rom::BANK_SIZE);
+        for (int pc = 0; pc < Rom::BANK_SIZE;) {
+            if (!covered[base + pc]) {
+                ++pc;
+                continue;
+            }
+            int first = pc;
+            while (pc < Rom::BANK_SIZE && covered[base + pc])
+                ++pc;
+            fprintf(file, "  0x%03x-0x%03x\n", first, pc - 1);
+        }
+    }
+
+    return fclose(file) == 0;
+}
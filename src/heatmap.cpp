@@ -0,0 +1,172 @@
+#include "common.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <stdexcept>
+#include <vector>
+
+#include "heatmap.h"
+
+Heatmap g_heatmap;
+
+const char *const Heatmap::names_[NUM_AREAS] = {
+    "intram",
+    "extram",
+    "vdc"
+};
+
+const int Heatmap::sizes_[NUM_AREAS] = {
+    64,
+    256,
+    256
+};
+
+namespace {
+    struct address_t {
+        int address;
+        uint64_t reads, writes;
+    };
+
+    bool busier(const address_t &a, const address_t &b)
+    {
+        return a.reads + a.writes > b.reads + b.writes;
+    }
+}
+
+Heatmap::Heatmap()
+    : frames_(0), muted_(false), csv_(NULL)
+{
+    fill(&frame_[0][0][0], &frame_[0][0][0] + NUM_AREAS * NUM_ACCESSES * AREA_SIZE, 0);
+    fill(&total_[0][0][0], &total_[0][0][0] + NUM_AREAS * NUM_ACCESSES * AREA_SIZE, 0);
+}
+
+Heatmap::~Heatmap()
+{
+    if (csv_)
+        fclose(csv_);
+}
+
+void Heatmap::init(const string &csv, const string &image)
+{
+    if (csv.empty() && image.empty())
+        return;
+
+#ifndef ENABLE_HEATMAP
+    LOGWARNING << "The memory heatmap wasn't enabled at build time, ignoring heatmap_csv and heatmap_image" << endl;
+    return;
+#endif
+
+    if (!csv.empty()) {
+        csv_ = fopen(csv.c_str(), "w");
+        if (!csv_)
+            throw runtime_error(string("Unable to open ") + csv + ": " + strerror(errno));
+        fputs("frame,area,address,reads,writes\n", csv_);
+        cout << "Writing memory accesses of every frame to " << csv << endl;
+    }
+    image_ = image;
+}
+
+void Heatmap::end_frame()
+{
+#ifndef ENABLE_HEATMAP
+    return;
+#endif
+
+    for (int area = 0; area < NUM_AREAS; ++area) {
+        for (int address = 0; address < sizes_[area]; ++address) {
+            uint32_t reads = frame_[area][READ][address];
+            uint32_t writes = frame_[area][WRITE][address];
+            if (!reads && !writes)
+                continue;
+
+            if (csv_)
+                fprintf(csv_, "%lu,%s,%d,%u,%u\n", frames_, names_[area], address, reads, writes);
+            total_[area][READ][address] += reads;
+            total_[area][WRITE][address] += writes;
+        }
+    }
+
+    fill(&frame_[0][0][0], &frame_[0][0][0] + NUM_AREAS * NUM_ACCESSES * AREA_SIZE, 0);
+    ++frames_;
+}
+
+void Heatmap::save_image() const
+{
+    if (image_.empty() || !frames_)
+        return;
+
+    const int area_width = CELLS_PER_ROW * CELL_SIZE;
+    const int area_height = AREA_SIZE / CELLS_PER_ROW * CELL_SIZE;
+    const int width = NUM_AREAS * (area_width + MARGIN) + MARGIN;
+    const int height = NUM_ACCESSES * (area_height + MARGIN) + MARGIN;
+
+    SDL_Surface *surface = SDL_CreateRGBSurface(SDL_SWSURFACE, width, height, 32, 0, 0, 0, 0);
+    if (!surface) {
+        LOGWARNING << "Unable to create the heatmap image: " << SDL_GetError() << endl;
+        return;
+    }
+    SDL_FillRect(surface, NULL, SDL_MapRGB(surface->format, 0x40, 0x40, 0x40));
+
+    // Areas are laid out left to right, reads on top of writes. The scale is
+    // logarithmic and shared by the reads and writes of the same area.
+    for (int area = 0; area < NUM_AREAS; ++area) {
+        uint64_t busiest = 1;
+        for (int access = 0; access < NUM_ACCESSES; ++access)
+            busiest = max(busiest, *max_element(total_[area][access], total_[area][access] + sizes_[area]));
+
+        for (int access = 0; access < NUM_ACCESSES; ++access) {
+            for (int address = 0; address < sizes_[area]; ++address) {
+                double heat = log(1.0 + total_[area][access][address]) / log(1.0 + busiest);
+                Uint8 r = (Uint8)(255 * min(1.0, heat * 3));
+                Uint8 g = (Uint8)(255 * max(0.0, min(1.0, heat * 3 - 1)));
+                Uint8 b = (Uint8)(255 * max(0.0, min(1.0, heat * 3 - 2)));
+
+                SDL_Rect rect = {
+                    MARGIN + area * (area_width + MARGIN) + address % CELLS_PER_ROW * CELL_SIZE,
+                    MARGIN + access * (area_height + MARGIN) + address / CELLS_PER_ROW * CELL_SIZE,
+                    CELL_SIZE - 1,
+                    CELL_SIZE - 1
+                };
+                SDL_FillRect(surface, &rect, SDL_MapRGB(surface->format, r, g, b));
+            }
+        }
+    }
+
+    if (SDL_SaveBMP(surface, image_.c_str()) == 0)
+        cout << "Saved the memory heatmap to " << image_ << endl;
+    else
+        LOGWARNING << "Unable to save the memory heatmap to " << image_ << ": " << SDL_GetError() << endl;
+    SDL_FreeSurface(surface);
+}
+
+void Heatmap::debug_print_stats(ostream &out) const
+{
+    if (!frames_)
+        return;
+
+    for (int area = 0; area < NUM_AREAS; ++area) {
+        vector<address_t> addresses;
+        for (int address = 0; address < sizes_[area]; ++address) {
+            address_t a = {address, total_[area][READ][address], total_[area][WRITE][address]};
+            if (a.reads || a.writes)
+                addresses.push_back(a);
+        }
+        if (addresses.empty())
+            continue;
+
+        sort(addresses.begin(), addresses.end(), busier);
+        if (addresses.size() > (size_t)NUM_HOTTEST)
+            addresses.resize(NUM_HOTTEST);
+
+        out << "Busiest " << names_[area] << " addresses over " << frames_ << " frames:";
+        for (vector<address_t>::const_iterator it = addresses.begin(); it != addresses.end(); ++it) {
+            out << " 0x" << hex << setw(2) << setfill('0') << it->address << dec
+                << " (" << it->reads << "r/" << it->writes << "w)";
+        }
+        out << endl;
+    }
+    out << setfill(' ');
+}
@@ -0,0 +1,88 @@
+#include "common.h"
+
+#include <algorithm>
+#include <cstdio>
+
+#include "hud.h"
+
+#include "chars.h"
+#include "framebuffer.h"
+#include "options.h"
+#include "speedlimit.h"
+#include "vdc.h"
+
+Hud g_hud;
+
+// Colors in the background color table and the char colors
+static const int BACKGROUND_COLOR = 8; // black
+static const int TEXT_COLOR = 7; // white
+static const int GOOD_FRAME_COLOR = 2; // green
+static const int LATE_FRAME_COLOR = 4; // red
+
+static const int TEXT_WIDTH = 9;
+static const int GLYPH_WIDTH = 8 * Framebuffer::SCREEN_WIDTH_MULTIPLIER;
+static const int GLYPH_HEIGHT = 16;
+
+Hud::Hud()
+    : enabled_(false), last_frame_(0), graph_pos_(0), fps_start_(0), fps_frames_(0), fps_(0)
+{
+    fill(frame_msecs_, frame_msecs_ + GRAPH_FRAMES, 0);
+}
+
+void Hud::toggle()
+{
+    enabled_ = !enabled_;
+    last_frame_ = fps_start_ = SpeedLimit::get_nsecs();
+    fps_frames_ = 0;
+    fps_ = 0;
+    fill(frame_msecs_, frame_msecs_ + GRAPH_FRAMES, 0);
+}
+
+void Hud::draw_text(Canvas &canvas, int line, const char *text)
+{
+    g_chars.draw_text(canvas, 0, line * GLYPH_HEIGHT, text, TEXT_COLOR);
+}
+
+void Hud::draw_graph(Canvas &canvas)
+{
+    // The height of a frame at full speed is half the graph
+    double target_msecs = 1000.0 / Vdc::frame_rate(g_options.pal_emulation);
+    int x = TEXT_WIDTH * GLYPH_WIDTH;
+    for (int i = 0; i < GRAPH_FRAMES; ++i, x += GRAPH_BAR_WIDTH) {
+        double msecs = frame_msecs_[(graph_pos_ + i) % GRAPH_FRAMES];
+        int h = min((int)(msecs / target_msecs * GRAPH_HEIGHT / 2), (int)GRAPH_HEIGHT);
+        SDL_Rect r = {x, GRAPH_HEIGHT - h, GRAPH_BAR_WIDTH - 1, h};
+        canvas.fill_rect(r, msecs > target_msecs * 1.1 ? LATE_FRAME_COLOR : GOOD_FRAME_COLOR);
+    }
+}
+
+void Hud::draw(Canvas &canvas, int redraws)
+{
+    uint64_t now = SpeedLimit::get_nsecs();
+    frame_msecs_[graph_pos_] = (now - last_frame_) / 1e6;
+    graph_pos_ = (graph_pos_ + 1) % GRAPH_FRAMES;
+    last_frame_ = now;
+
+    ++fps_frames_;
+    if (now - fps_start_ >= 1000000000ULL) {
+        fps_ = fps_frames_ * 1e9 / (now - fps_start_);
+        fps_start_ = now;
+        fps_frames_ = 0;
+    }
+
+    SDL_Rect r = {0, 0, TEXT_WIDTH * GLYPH_WIDTH + GRAPH_FRAMES * GRAPH_BAR_WIDTH, HEIGHT};
+    canvas.clear_clip_rect();
+    canvas.fill_rect(r, BACKGROUND_COLOR);
+
+    char text[16];
+    snprintf(text, sizeof(text), "FPS %.1f", fps_);
+    draw_text(canvas, 0, text);
+    snprintf(text, sizeof(text), "SPEED %d", (int)(fps_ * 100 / Vdc::frame_rate(g_options.pal_emulation) + 0.5));
+    draw_text(canvas, 1, text);
+    snprintf(text, sizeof(text), "SKIP %lu", g_framebuffer->debug_frames_dropped());
+    draw_text(canvas, 2, text);
+    snprintf(text, sizeof(text), "DRAW %d", redraws);
+    draw_text(canvas, 3, text);
+
+    draw_graph(canvas);
+}
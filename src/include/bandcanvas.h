@@ -0,0 +1,70 @@
+#ifndef BANDCANVAS_H
+#define BANDCANVAS_H
+
+#include "common.h"
+
+#include "canvas.h"
+
+// A horizontal band of a framebuffer's surface that can be drawn to
+// concurrently with the other bands. Coordinates are those of the whole
+// framebuffer. Objects are rasterized from the pattern atlas instead of being
+// blitted, as blitting a surface onto a different destination makes SDL
+// rebuild the blit mapping stored in the source surface.
+class BandCanvas : public Canvas
+{
+    private:
+        SDL_Surface *view_;
+        int y_, h_;
+        const Uint32 *colormap_;
+        Uint32 object_colormap_[8];
+        SDL_Rect clip_r_;
+
+        static uint8_t pattern_bits_[NUM_PATTERN_ROWS];
+        static void init_pattern_bits();
+
+        SDL_Rect to_view(const SDL_Rect &r) const;
+        template<typename T> void draw_pattern_rows(SDL_Rect &r, int row, int x_scale, int y_scale,
+                int gap, T color);
+
+    public:
+        BandCanvas(SDL_Surface *surface, int y, int h, const Uint32 *colormap, const Uint32 *object_colormap);
+        ~BandCanvas();
+
+        void retarget(SDL_Surface *surface);
+
+        void set_clip_rect(SDL_Rect &r);
+        void clear_clip_rect();
+        void fill_rect(SDL_Rect &r, int color);
+
+        void paste_surface(int x, int y, SDL_Surface *surface);
+        void paste_surface(int x, int y, SDL_Surface *surface, SDL_Rect &src_r);
+
+        bool composes_objects() const { return true; }
+        void draw_pattern(SDL_Rect &r, int row, int x_scale, int y_scale, int gap, int color);
+};
+
+inline SDL_Rect BandCanvas::to_view(const SDL_Rect &r) const
+{
+    SDL_Rect view_r = {r.x, r.y - y_, r.w, r.h};
+    return view_r;
+}
+
+inline void BandCanvas::fill_rect(SDL_Rect &r, int color)
+{
+    SDL_Rect view_r = to_view(r);
+    SDL_FillRect(view_, &view_r, colormap_[color]);
+}
+
+inline void BandCanvas::paste_surface(int x, int y, SDL_Surface *surface)
+{
+    SDL_Rect r = {x, y - y_, 0, 0};
+    SDL_BlitSurface(surface, NULL, view_, &r);
+}
+
+inline void BandCanvas::paste_surface(int x, int y, SDL_Surface *surface, SDL_Rect &src_r)
+{
+    SDL_Rect r = {x, y - y_, 0, 0};
+    SDL_BlitSurface(surface, &src_r, view_, &r);
+}
+
+#endif
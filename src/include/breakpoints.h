@@ -0,0 +1,94 @@
+#ifndef BREAKPOINTS_H
+#define BREAKPOINTS_H
+
+#include "common.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "cpu.h"
+#include "rom.h"
+
+// Breakpoints and watchpoints of the debugger. Breakpoints are kept in a
+// bitmap with a bit for every address of every ROM bank. Watchpoints break
+// on reads or writes to an address of the internal RAM, the external RAM or
+// the VDC, optionally only if a given value was read or written. They're
+// checked around every instruction by the debugging variant of the
+// emulation loop, from the accesses the CPU says the instruction will make.
+class Breakpoints
+{
+    public:
+        enum area_t {
+            INTRAM,
+            EXTRAM,
+            VDC,
+            NUM_AREAS
+        };
+
+        struct watchpoint_t {
+            area_t area;
+            int address;
+            bool read, write;
+            int value; // -1 for any value
+        };
+
+    private:
+        static const int NUM_BANKS = 4;
+        static const char *const area_names_[NUM_AREAS];
+
+        vector<uint8_t> bitmap_;
+        int num_breakpoints_;
+
+        vector<watchpoint_t> watchpoints_;
+
+        // Accesses of the instruction being run that some watchpoint is on
+        struct pending_t {
+            area_t area;
+            int address;
+            bool write;
+            uint8_t value;
+        };
+        pending_t pending_[Cpu::MAX_ACCESSES * 2];
+        int num_pending_;
+
+        static uint8_t peek(area_t area, int address);
+        void add_pending(area_t area, int address, bool write);
+
+    public:
+        Breakpoints();
+
+        static bool parse_rom_address(const string &str, int &bank, int &pc);
+        static bool parse_area(const string &str, area_t &area);
+
+        bool empty() const { return !num_breakpoints_ && watchpoints_.empty(); }
+
+        // A bank of -1 stands for all of them
+        void set(int bank, int pc);
+        bool clear(int bank, int pc);
+        bool hit(int bank, int pc) const;
+
+        void watch(const watchpoint_t &watchpoint) { watchpoints_.push_back(watchpoint); }
+        bool unwatch(unsigned int index);
+
+        // Around every instruction, returns the index of the watchpoint that
+        // was hit or -1
+        void before_step();
+        int after_step();
+
+        void debug_print(ostream &out) const;
+        void debug_print_watchpoint(ostream &out, unsigned int index) const;
+};
+
+inline Breakpoints::Breakpoints()
+    : bitmap_(NUM_BANKS * Rom::BANK_SIZE / 8), num_breakpoints_(0), num_pending_(0)
+{
+}
+
+inline bool Breakpoints::hit(int bank, int pc) const
+{
+    int index = bank * Rom::BANK_SIZE + pc;
+    return bitmap_[index >> 3] & 1 << (index & 7);
+}
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef CANVAS_H
+#define CANVAS_H
+
+#include "common.h"
+
+// Something the VDC draws onto: a whole framebuffer, or a band of it
+class Canvas
+{
+    public:
+        // Rows of the pattern atlas used by canvases that compose the objects
+        // themselves: the charset, followed by every possible byte with its
+        // bits reversed for the sprites
+        static const int PATTERN_SPRITE_START = 512;
+        static const int NUM_PATTERN_ROWS = PATTERN_SPRITE_START + 256;
+
+        virtual ~Canvas() {}
+
+        virtual void set_clip_rect(SDL_Rect &r) = 0;
+        virtual void clear_clip_rect() = 0;
+        virtual void fill_rect(SDL_Rect &r, int color) = 0;
+
+        virtual void paste_surface(int x, int y, SDL_Surface *surface) = 0;
+        virtual void paste_surface(int x, int y, SDL_Surface *surface, SDL_Rect &src_r) = 0;
+
+        // Canvases that compose the chars and sprites themselves get them as
+        // patterns to draw instead of having surfaces pasted onto them
+        virtual bool composes_objects() const { return false; }
+        virtual void draw_pattern(SDL_Rect &r, int row, int x_scale, int y_scale, int gap, int color) {}
+};
+
+#endif
@@ -5,6 +5,8 @@
 
 #include "common.h"
 
+#include "canvas.h"
+
 class Chars
 {
     private:
@@ -17,12 +19,23 @@ class Chars
 
         void create_chars(SDL_Surface *surface, uint32_t color);
         SDL_Rect get_rect(int index, int cut_top, int cut_bottom);
-        void draw_char(int x, int y, uint8_t *ptr, SDL_Rect &clip_r, int cut_buttom = -1);
+        void draw_char(Canvas &canvas, int x, int y, uint8_t *ptr, SDL_Rect &clip_r, int cut_buttom = -1);
 
     public:
+        static const int NUM_PATTERN_ROWS = NUM_CHARS * 8;
+
+        // Bits of the object masks for the single chars and the chars of the quads
+        static const int SINGLE_SLOTS_START = 0;
+        static const int QUAD_SLOTS_START = 12;
+        static const uint8_t *charset() { return charset_; }
+
         void init();
 
-        void draw(uint8_t *mem, SDL_Rect &clip_r);
+        void draw(Canvas &canvas, uint8_t *mem, SDL_Rect &clip_r, uint32_t objects = ~0u);
+
+        // Draws a string with the glyphs of the charset. Characters that
+        // aren't in it are drawn as blanks.
+        void draw_text(Canvas &canvas, int x, int y, const char *text, int color);
 };
 
 extern Chars g_chars;
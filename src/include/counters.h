@@ -0,0 +1,81 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include "common.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+
+// Registry of performance counters. Counters are bumped through the COUNT
+// macros, which compile to nothing unless ENABLE_COUNTERS is set. Every few
+// frames their sums over those frames are written as a line of JSON to a file
+// or to a Unix socket that some monitoring tool listens on.
+class Counters
+{
+    public:
+        enum counter_t {
+            INSTRUCTIONS,
+            CYCLES,
+            INTERRUPTS,
+            VDC_READS,
+            VDC_WRITES,
+            EXTRAM_READS,
+            EXTRAM_WRITES,
+            BANK_SWITCHES,
+            SCREEN_UPDATES,
+            PIXELS_REDRAWN,
+            RECTS_FILLED,
+            SURFACES_PASTED,
+            BLIT_NSECS,
+            NUM_COUNTERS
+        };
+
+    private:
+        static const char *const names_[NUM_COUNTERS];
+
+        uint64_t counters_[NUM_COUNTERS];
+        unsigned long frame_, frames_, interval_;
+        bool muted_;
+
+        FILE *file_;
+        string socket_path_;
+        int socket_;
+
+        bool connect_socket();
+        void write_line(const string &line);
+
+    public:
+        Counters();
+        ~Counters();
+
+        void init(const string &output, unsigned int interval);
+
+        void add(counter_t counter, uint64_t value) { if (!muted_) counters_[counter] += value; }
+
+        // For counters that might be bumped from the worker threads
+        void add_shared(counter_t counter, uint64_t value) { if (!muted_) __sync_fetch_and_add(&counters_[counter], value); }
+
+        void end_frame();
+
+        // While muted, nothing is counted
+        void set_muted(bool muted) { muted_ = muted; }
+};
+
+extern Counters g_counters;
+
+#ifdef ENABLE_COUNTERS
+# define COUNT(counter, value) g_counters.add(Counters::counter, value)
+# define COUNT_SHARED(counter, value) g_counters.add_shared(Counters::counter, value)
+#else
+# define COUNT(counter, value) ((void)0)
+# define COUNT_SHARED(counter, value) ((void)0)
+#endif
+
+inline Counters::Counters()
+    : frame_(0), frames_(0), interval_(0), muted_(false), file_(NULL), socket_(-1)
+{
+    fill(counters_, counters_ + NUM_COUNTERS, 0);
+}
+
+#endif
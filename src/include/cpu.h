@@ -5,6 +5,7 @@
 
 #include <iostream>
 
+#include "counters.h"
 #include "extstorage.h"
 #include "joysticks.h"
 #include "keyboard.h"
@@ -41,7 +42,7 @@ class Cpu
             void cpl_cy() { cy ^= 1; }
             void cpl_f0() { f0 ^= 1 << 5; };
 
-            uint8_t operator()() { return cy << 7 | ac | f0 | bs | sp; }
+            uint8_t operator()() const { return cy << 7 | ac | f0 | bs | sp; }
         } psw_;
 
         void load_psw_no_sp(uint8_t val)
@@ -69,17 +70,35 @@ class Cpu
         // Programmable flag 1
         bool f1_;
 
+        // Port 1 selects the ROM bank and what's on the external bus
+        void write_p1(uint8_t val);
+
         // The counter
-        enum {
+        typedef enum {
             TCNT_STATUS_ALL_OFF,
             TCNT_STATUS_COUNTER_ON,
             TCNT_STATUS_TIMER_ON,
-        } tcnt_status_;
+        } tcnt_status_t;
+        tcnt_status_t tcnt_status_;
         bool tcnt_overflow_;
         uint8_t tcnt_;
         void tcnt_increment();
-        int timer_timer_;
-        static const int TIMER_TIMER_INITIAL_VALUE = 31;
+
+        // In timer mode tcnt_ is only brought up to date when it's read or
+        // written, from the cycles run since the timer was last synced. Its
+        // next overflow is scheduled as an event on the cycle count. The
+        // reference timer instead counts every prescaler period on its own
+        // after every instruction, as the hardware does.
+        static const int TIMER_PRESCALER = 32;
+        static const uint64_t NO_EVENT = ~0ULL;
+        uint64_t cycles_, timer_start_, next_event_;
+        int prescaler_;
+        bool reference_timer_;
+        void timer_sync();
+        void timer_schedule();
+        void timer_start();
+        void timer_stop();
+        int retire(int clock);
 
         // Internal RAM
         vector<uint8_t> intram_;
@@ -95,6 +114,8 @@ class Cpu
         bool extirq_pending_, tcntirq_pending_;
         bool in_irq_;
 
+        bool illegal_reported_;
+
         // Stack operations
         void push(uint8_t val);
         uint8_t pop();
@@ -111,16 +132,53 @@ class Cpu
     public:
         static const int EXTRAM_SIZE = 128;
 
+        // A memory access the next instruction is going to make, external
+        // ones go to whatever the external bus reaches
+        struct access_t {
+            bool external, write;
+            int address;
+        };
+        static const int MAX_ACCESSES = 3;
+
+        // Everything that affects how the program runs. The timer is brought
+        // up to date first, prescaler holds the cycles into its current period
+        struct state_t {
+            int pc, last_pc;
+            bool a11_on;
+            int acc;
+            bool f1;
+            uint8_t psw;
+            tcnt_status_t tcnt_status;
+            bool tcnt_overflow;
+            uint8_t tcnt;
+            int prescaler;
+            uint64_t cycles;
+            bool extirq_en, tcntirq_en;
+            bool extirq_pending, tcntirq_pending;
+            bool in_irq;
+            uint8_t intram[INTRAM_SIZE];
+        };
+
         Cpu();
 
         // Debug stuff
         int debug_get_pc() { return last_pc_; }
+        int debug_get_next_pc() const { return pc_; }
+        bool debug_in_irq() const { return in_irq_; }
+        int debug_get_sp() const { return psw_.sp; }
+        int debug_get_caller_sp() const { return (psw_.sp + STACK_SIZE - 2) % STACK_SIZE; }
+        uint8_t debug_peek_intram(int address) const { return intram_[address]; }
+        int debug_next_accesses(access_t *accesses) const;
         void debug_print(ostream &out);
         void debug_dump_intram(ostream &out) { dump_memory(out, intram_, INTRAM_SIZE); }
 
         void reset();
         int step();
 
+        void save_state(state_t &state);
+        void load_state(const state_t &state);
+        void set_reference_timer(bool enabled) { reference_timer_ = enabled; timer_schedule(); }
+
         void external_irq();
         void clear_external_irq() { extirq_pending_ = false; }
         void counter_increment() { if (tcnt_status_ == TCNT_STATUS_COUNTER_ON) tcnt_increment(); }
@@ -129,7 +187,7 @@ class Cpu
 extern Cpu g_cpu;
 
 inline Cpu::Cpu()
-    : intram_(INTRAM_SIZE)
+    : reference_timer_(false), intram_(INTRAM_SIZE), illegal_reported_(false)
 {
 }
 
@@ -146,11 +204,21 @@ inline void Cpu::reset()
 
     tcnt_status_ = TCNT_STATUS_ALL_OFF;
     tcnt_overflow_ = false;
-    timer_timer_ = TIMER_TIMER_INITIAL_VALUE;
+    cycles_ = timer_start_ = 0;
+    next_event_ = NO_EVENT;
+    prescaler_ = 0;
 
     regptr_ = &intram_[0];
 }
 
+inline void Cpu::write_p1(uint8_t val)
+{
+    COUNT(BANK_SWITCHES, (val ^ g_p1) & (1 << 0 | 1 << 1) ? 1 : 0);
+    g_p1 = val;
+    g_rom.calculate_current_bank();
+    g_extstorage.calculate_bus_targets();
+}
+
 inline void Cpu::external_irq()
 {
     if (extirq_en_)
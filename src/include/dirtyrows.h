@@ -0,0 +1,70 @@
+#ifndef DIRTYROWS_H
+#define DIRTYROWS_H
+
+#include "common.h"
+
+#include <algorithm>
+#include <vector>
+
+// Keeps track of which rows of a framebuffer have been drawn to since the
+// last time it was cleared
+class DirtyRows
+{
+    private:
+        vector<uint8_t> rows_;
+        int first_, last_;
+
+    public:
+        DirtyRows();
+
+        void resize(int height);
+
+        void mark(int y, int h);
+        void mark(const SDL_Rect &r) { mark(r.y, r.h); }
+        void mark_all() { mark(0, rows_.size()); }
+        void clear();
+
+        bool empty() const { return first_ > last_; }
+        int first() const { return first_; }
+        int last() const { return last_; }
+        bool operator[](int y) const { return rows_[y]; }
+};
+
+inline DirtyRows::DirtyRows()
+    : first_(0), last_(-1)
+{
+}
+
+inline void DirtyRows::resize(int height)
+{
+    rows_.assign(height, 0);
+    first_ = height;
+    last_ = -1;
+}
+
+inline void DirtyRows::mark(int y, int h)
+{
+    int end = y + h;
+    if (y < 0)
+        y = 0;
+    if (end > (int)rows_.size())
+        end = rows_.size();
+    if (y >= end)
+        return;
+
+    fill(rows_.begin() + y, rows_.begin() + end, 1);
+    if (y < first_)
+        first_ = y;
+    if (end - 1 > last_)
+        last_ = end - 1;
+}
+
+inline void DirtyRows::clear()
+{
+    if (!empty())
+        fill(rows_.begin() + first_, rows_.begin() + last_ + 1, 0);
+    first_ = rows_.size();
+    last_ = -1;
+}
+
+#endif
@@ -1,10 +1,13 @@
 #ifndef EXTSTORAGE_H
 #define EXTSTORAGE_H
 
+#include <algorithm>
 #include <vector>
 
 #include "common.h"
 
+#include "counters.h"
+#include "heatmap.h"
 #include "vdc.h"
 #include "util.h"
 
@@ -17,10 +20,48 @@ class ExternalStorage
         bool p1_bit_high(int index) const;
         bool p1_bit_low(int index) const;
 
+        // What MOVX reaches with the current value of P1. The reference
+        // targets decode P1 on every access instead
+        enum {
+            READ_NONE,
+            READ_VDC,
+            READ_EXTRAM,
+            READ_JUNK,
+            READ_REFERENCE,
+        } read_target_;
+        enum {
+            WRITE_NONE,
+            WRITE_VDC,
+            WRITE_EXTRAM,
+            WRITE_BOTH,
+            WRITE_REFERENCE,
+        } write_target_;
+        bool reference_decode_;
+
+        template<typename T> void read_reference(uint8_t offset, T &reg) const;
+        void write_reference(uint8_t offset, uint8_t value);
+
     public:
+        struct state_t {
+            uint8_t extram[EXTRAM_SIZE];
+        };
+
         ExternalStorage();
 
+        // The bus targets aren't part of the state, they follow P1
+        void save_state(state_t &state) const { copy(extram_.begin(), extram_.end(), state.extram); }
+        void load_state(const state_t &state) { copy(state.extram, state.extram + EXTRAM_SIZE, extram_.begin()); }
+
         void debug_dump_extram(ostream &out) const { dump_memory(out, extram_, EXTRAM_SIZE); }
+        uint8_t debug_peek_extram(uint8_t offset) const { return extram_[offset]; }
+
+        // Whether MOVX would reach the VDC or the external RAM right now
+        bool debug_reaches_vdc(bool write) const;
+        bool debug_reaches_extram(bool write) const;
+
+        // Must be called whenever P1 changes
+        void calculate_bus_targets();
+        void set_reference_decode(bool enabled) { reference_decode_ = enabled; calculate_bus_targets(); }
 
         template<typename T> void read(uint8_t offset, T &reg) const;
         void write(uint8_t offset, uint8_t value);
@@ -29,7 +70,7 @@ class ExternalStorage
 extern ExternalStorage g_extstorage;
 
 inline ExternalStorage::ExternalStorage()
-    : extram_(EXTRAM_SIZE)
+    : extram_(EXTRAM_SIZE), read_target_(READ_NONE), write_target_(WRITE_NONE), reference_decode_(false)
 {
 }
 
@@ -43,22 +84,97 @@ inline bool ExternalStorage::p1_bit_low(int index) const
     return !(g_p1 & 1 << index);
 }
 
+inline bool ExternalStorage::debug_reaches_vdc(bool write) const
+{
+    if (write)
+        return write_target_ == WRITE_VDC || write_target_ == WRITE_BOTH;
+    return read_target_ == READ_VDC;
+}
+
+inline bool ExternalStorage::debug_reaches_extram(bool write) const
+{
+    if (write)
+        return write_target_ == WRITE_EXTRAM || write_target_ == WRITE_BOTH;
+    return read_target_ == READ_EXTRAM;
+}
+
 template<typename T> inline void ExternalStorage::read(uint8_t offset, T &reg) const
 {
-    if (p1_bit_low(3) && p1_bit_high(4) && p1_bit_low(6))
+    switch (read_target_) {
+        case READ_VDC:
+            COUNT(VDC_READS, 1);
+            reg = g_vdc.read(offset);
+            break;
+        case READ_EXTRAM:
+            COUNT(EXTRAM_READS, 1);
+            HEAT(EXTRAM, READ, offset);
+            reg = extram_[offset];
+            break;
+        case READ_JUNK:
+            reg = g_junk;
+            break;
+        case READ_REFERENCE:
+            read_reference(offset, reg);
+            break;
+        case READ_NONE:
+            break;
+    }
+}
+
+template<typename T> inline void ExternalStorage::read_reference(uint8_t offset, T &reg) const
+{
+    if (p1_bit_low(3) && p1_bit_high(4) && p1_bit_low(6)) {
+        COUNT(VDC_READS, 1);
         reg = g_vdc.read(offset);
-    else if ((p1_bit_low(3) && p1_bit_low(4) && p1_bit_high(6)) || (p1_bit_high(3) && p1_bit_low(4)))
+    }
+    else if ((p1_bit_low(3) && p1_bit_low(4) && p1_bit_high(6)) || (p1_bit_high(3) && p1_bit_low(4))) {
+        COUNT(EXTRAM_READS, 1);
+        HEAT(EXTRAM, READ, offset);
         reg = extram_[offset];
-    else if (!g_p1)
+    }
+    else if (!g_p1) {
         reg = g_junk;
+    }
 }
 
 inline void ExternalStorage::write(uint8_t offset, uint8_t value)
 {
-    if (p1_bit_low(3))
+    switch (write_target_) {
+        case WRITE_VDC:
+            COUNT(VDC_WRITES, 1);
+            g_vdc.write(offset, value);
+            break;
+        case WRITE_EXTRAM:
+            COUNT(EXTRAM_WRITES, 1);
+            HEAT(EXTRAM, WRITE, offset);
+            extram_[offset] = value;
+            break;
+        case WRITE_BOTH:
+            COUNT(VDC_WRITES, 1);
+            COUNT(EXTRAM_WRITES, 1);
+            HEAT(EXTRAM, WRITE, offset);
+            g_vdc.write(offset, value);
+            extram_[offset] = value;
+            break;
+        case WRITE_REFERENCE:
+            write_reference(offset, value);
+            break;
+        case WRITE_NONE:
+            break;
+    }
+}
+
+inline void ExternalStorage::write_reference(uint8_t offset, uint8_t value)
+{
+    if (p1_bit_low(3)) {
+        COUNT(VDC_WRITES, 1);
         g_vdc.write(offset, value);
-    if (p1_bit_low(4) && p1_bit_low(6))
+    }
+    if (p1_bit_low(4) && p1_bit_low(6)) {
+        COUNT(EXTRAM_WRITES, 1);
+        HEAT(EXTRAM, WRITE, offset);
         extram_[offset] = value;
+    }
 }
 
 #endif
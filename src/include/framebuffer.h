@@ -3,7 +3,12 @@
 
 #include "common.h"
 
-class Framebuffer
+#include <vector>
+
+#include "bandcanvas.h"
+#include "canvas.h"
+
+class Framebuffer : public Canvas
 {
     protected:
         struct {
@@ -15,27 +20,46 @@ class Framebuffer
         static const int COLORTABLE_SIZE = 16;
         static const uint8_t colortable_[COLORTABLE_SIZE][3];
 
+        // Index in colortable_ of each of the 8 char and sprite colors
+        static const int object_colors_[8];
+
+        // Bands of the frame that can be drawn to concurrently, one per worker
+        vector<BandCanvas *> bands_;
+        void create_bands(SDL_Surface *surface, const Uint32 *colormap);
+        void retarget_bands(SDL_Surface *surface);
+
     public:
         static const int SCREEN_WIDTH_MULTIPLIER = 5;
         static const int SCREEN_WIDTH = 170 * SCREEN_WIDTH_MULTIPLIER;
         static const int SCREEN_HEIGHT = 242;
 
         Framebuffer();
-        virtual ~Framebuffer() {}
+        virtual ~Framebuffer();
 
         virtual void init() = 0;
 
-        virtual void set_clip_rect(SDL_Rect &r) = 0;
-        virtual void clear_clip_rect() = 0;
-        virtual void fill_rect(SDL_Rect &r, int color) = 0;
+        // Make the given lines the same as in the previous frame. Nothing to
+        // do unless frames are drawn to different buffers
+        virtual void copy_previous_lines(int y, int h) {}
+
+        // Chars and sprites are drawn to surfaces created by the framebuffer
+        // so that they can be pasted onto it without any conversion
+        virtual SDL_Surface *create_object_surface(int w, int h);
+        virtual Uint32 map_object_color(SDL_Surface *surface, int color);
+        virtual void clear_object_surface(SDL_Surface *surface);
 
-        virtual void paste_surface(int x, int y, SDL_Surface *surface) = 0;
-        virtual void paste_surface(int x, int y, SDL_Surface *surface, SDL_Rect &src_r) = 0;
+        // Prepare the bands for drawing a whole frame, returns how many of
+        // them there are or 0 if the frame can't be drawn in bands
+        virtual int begin_bands() { return 0; }
+        Canvas &band(int index) { return *bands_[index]; }
 
         virtual void blit() = 0;
 
         void take_snapshot();
         virtual void take_snapshot(const string &str) = 0;
+
+        virtual void debug_print_stats(ostream &out) const {}
+        virtual unsigned long debug_frames_dropped() const { return 0; }
 };
 
 extern Framebuffer *g_framebuffer;
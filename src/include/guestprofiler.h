@@ -0,0 +1,85 @@
+#ifndef GUESTPROFILER_H
+#define GUESTPROFILER_H
+
+#include "common.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "rom.h"
+
+// Profiles the guest code: counts the instructions executed and the cycles
+// spent at every address of every ROM bank. Addresses reached through a CALL
+// and the interrupt vectors are marked as routine entries, so the report can
+// charge every instruction to the closest entry before it. Samples are taken
+// by a variant of the emulation loop of its own, so the profiler costs
+// nothing until it's enabled.
+class GuestProfiler
+{
+    private:
+        static const int NUM_BANKS = 4;
+        static const int NUM_ADDRESSES = NUM_BANKS * Rom::BANK_SIZE;
+        static const int NUM_ROUTINES_SHOWN = 20;
+
+        bool enabled_;
+        vector<uint64_t> instructions_, cycles_;
+        vector<uint8_t> entries_;
+        bool call_pending_;
+
+        static int instruction_length(uint8_t opcode);
+        void mark_covered(vector<uint8_t> &covered) const;
+
+    public:
+        GuestProfiler();
+
+        bool enabled() const { return enabled_; }
+        void enable();
+        void reset();
+
+        // Called after every instruction with the bank it was fetched from
+        void record(int bank, int pc, int cycles);
+
+        // Called instead when an interrupt was taken before the instruction
+        // at pc, with the vector jumped to
+        void record_interrupt(int bank, int pc, int vector, int cycles);
+
+        void debug_print_report(ostream &out) const;
+        bool write_coverage(const string &path) const;
+};
+
+extern GuestProfiler g_guest_profiler;
+
+inline GuestProfiler::GuestProfiler()
+    : enabled_(false), call_pending_(false)
+{
+}
+
+inline void GuestProfiler::record(int bank, int pc, int cycles)
+{
+    int index = bank * Rom::BANK_SIZE + pc;
+    if (call_pending_) {
+        entries_[index] = 1;
+        call_pending_ = false;
+    }
+
+    ++instructions_[index];
+    cycles_[index] += cycles;
+
+    // The destination of a CALL only becomes known with the next instruction
+    call_pending_ = (g_rom.at(bank, pc) & 0x1f) == 0x14;
+}
+
+inline void GuestProfiler::record_interrupt(int bank, int pc, int vector, int cycles)
+{
+    // No instruction was run, the instruction at pc only runs once the
+    // handler returns. Its cycles are charged to the handler instead
+    if (call_pending_) {
+        entries_[bank * Rom::BANK_SIZE + pc] = 1;
+        call_pending_ = false;
+    }
+
+    cycles_[bank * Rom::BANK_SIZE + vector] += cycles;
+}
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef HEATMAP_H
+#define HEATMAP_H
+
+#include "common.h"
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+// Counts the guest's reads and writes to every address of the internal RAM,
+// the external RAM and the VDC. Accesses are counted through the HEAT macro,
+// which compiles to nothing unless ENABLE_HEATMAP is set. Every frame the
+// addresses that were accessed during it can be appended to a CSV file, and
+// the totals can be saved as an image on exit.
+class Heatmap
+{
+    public:
+        enum area_t {
+            INTRAM,
+            EXTRAM,
+            VDC,
+            NUM_AREAS
+        };
+
+        enum access_t {
+            READ,
+            WRITE,
+            NUM_ACCESSES
+        };
+
+    private:
+        static const int AREA_SIZE = 256;
+        static const int NUM_HOTTEST = 8;
+
+        // Layout of the image, every area is shown as a grid of cells
+        static const int CELL_SIZE = 8;
+        static const int CELLS_PER_ROW = 16;
+        static const int MARGIN = 8;
+
+        static const char *const names_[NUM_AREAS];
+        static const int sizes_[NUM_AREAS];
+
+        uint32_t frame_[NUM_AREAS][NUM_ACCESSES][AREA_SIZE];
+        uint64_t total_[NUM_AREAS][NUM_ACCESSES][AREA_SIZE];
+        unsigned long frames_;
+        bool muted_;
+
+        FILE *csv_;
+        string image_;
+
+    public:
+        Heatmap();
+        ~Heatmap();
+
+        void init(const string &csv, const string &image);
+
+        void add(area_t area, access_t access, int address) { if (!muted_) ++frame_[area][access][address]; }
+        void end_frame();
+
+        // While muted, accesses aren't counted
+        void set_muted(bool muted) { muted_ = muted; }
+
+        // Must be called before SDL is shut down
+        void save_image() const;
+
+        void debug_print_stats(ostream &out) const;
+};
+
+extern Heatmap g_heatmap;
+
+#ifdef ENABLE_HEATMAP
+# define HEAT(area, access, address) g_heatmap.add(Heatmap::area, Heatmap::access, address)
+#else
+# define HEAT(area, access, address) ((void)0)
+#endif
+
+#endif
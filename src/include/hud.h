@@ -0,0 +1,45 @@
+#ifndef HUD_H
+#define HUD_H
+
+#include "common.h"
+
+#include "canvas.h"
+
+// Performance overlay drawn on top of every frame right before it's blitted:
+// frame rate, emulation speed, dropped frames, screen redraws and a graph of
+// the latest frame times. Text uses the console's own charset.
+class Hud
+{
+    private:
+        static const int GRAPH_FRAMES = 64;
+        static const int GRAPH_BAR_WIDTH = 5;
+        static const int GRAPH_HEIGHT = 64;
+
+        bool enabled_;
+
+        uint64_t last_frame_;
+        double frame_msecs_[GRAPH_FRAMES];
+        int graph_pos_;
+
+        // Frame rate, updated every second
+        uint64_t fps_start_;
+        int fps_frames_;
+        double fps_;
+
+        void draw_text(Canvas &canvas, int line, const char *text);
+        void draw_graph(Canvas &canvas);
+
+    public:
+        static const int HEIGHT = GRAPH_HEIGHT;
+
+        Hud();
+
+        bool enabled() const { return enabled_; }
+        void toggle();
+
+        void draw(Canvas &canvas, int redraws);
+};
+
+extern Hud g_hud;
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef INPUTTHREAD_H
+#define INPUTTHREAD_H
+
+#include "common.h"
+
+#include "spscring.h"
+
+// Collects SDL events from a separate thread, so that emulation doesn't
+// stall while the window system is slow. Events are timestamped and queued
+// for the emulation thread, which applies them between frames. Requires SDL
+// to have been initialized with its own event thread, as events can't be
+// pumped from anywhere else.
+class InputThread
+{
+    private:
+        struct event_t
+        {
+            uint64_t when;
+            SDL_Event event;
+        };
+
+        SpscRing<event_t, 256> ring_;
+
+        SDL_Thread *thread_;
+        volatile bool quit_;
+
+        static int thread_main(void *data);
+
+    public:
+        InputThread();
+        ~InputThread();
+
+        void start();
+        void stop();
+        bool running() const { return thread_; }
+
+        bool pop(SDL_Event &event, uint64_t &when);
+};
+
+inline InputThread::InputThread()
+    : thread_(NULL), quit_(false)
+{
+}
+
+inline InputThread::~InputThread()
+{
+    stop();
+}
+
+#endif
@@ -3,6 +3,8 @@
 
 #include "common.h"
 
+#include <algorithm>
+
 class Joysticks
 {
     private:
@@ -15,6 +17,20 @@ class Joysticks
         };
         uint8_t buses_[2];
 
+        // Joystick and bit that every SDL key is bound to, as joystick << 3 | bit,
+        // or UNBOUND. Built from the controls in the options.
+        static const uint8_t UNBOUND = 0xff;
+        uint8_t bindings_[SDLK_LAST];
+
+        void bind(int index, SDLKey key, int bit);
+
+        // The reference scan works out the buses from the keys held down
+        // every time they're read, looking every key up in the controls
+        bool held_[SDLK_LAST];
+        bool reference_scan_;
+        static uint8_t scan_binding(SDLKey key);
+        uint8_t scan_bus(int index) const;
+
     public:
         struct controls_t
         {
@@ -34,18 +50,47 @@ class Joysticks
 
         Joysticks();
 
+        void init();
+
         bool handle_key_down(const SDL_keysym &keysym);
         bool handle_key_up(const SDL_keysym &keysym);
 
         uint8_t get_bus();
+        void set_reference_scan(bool enabled) { reference_scan_ = enabled; }
 };
 
 extern Joysticks g_joysticks;
 
 inline Joysticks::Joysticks()
+    : reference_scan_(false)
 {
     buses_[0] = (1 << (JOYSTICK_ACTION + 1)) - 1;
     buses_[1] = (1 << (JOYSTICK_ACTION + 1)) - 1;
+    fill(held_, held_ + SDLK_LAST, false);
+}
+
+inline bool Joysticks::handle_key_down(const SDL_keysym &keysym)
+{
+    held_[keysym.sym] = true;
+
+    uint8_t binding = bindings_[keysym.sym];
+    if (binding == UNBOUND)
+        return false;
+
+    buses_[binding >> 3] &= ~(1 << (binding & 7));
+    return true;
+}
+
+inline bool Joysticks::handle_key_up(const SDL_keysym &keysym)
+{
+    held_[keysym.sym] = false;
+
+    uint8_t binding = bindings_[keysym.sym];
+    if (binding == UNBOUND)
+        return false;
+
+    buses_[binding >> 3] |= 1 << (binding & 7);
+    return true;
 }
 
 #endif
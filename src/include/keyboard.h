@@ -3,79 +3,85 @@
 
 #include "common.h"
 
-#include <map>
-#include <set>
-
 class Keyboard
 {
     private:
         static const SDLKey keymap_[6][8];
-        set<SDLKey> possible_keys_;
-        map<SDLKey, SDLKey> aliases_;
+
+        static const int NUM_ALIASES = 7;
+        static const SDLKey aliases_[NUM_ALIASES][2];
+
+        // Maps every SDL key to the key it stands for in keymap_, if any
+        SDLKey translations_[SDLK_LAST];
+
+        // Upper nibble of P2 for every pressed key and selected row, or
+        // P2_UNCHANGED if reading the row leaves P2 alone
+        static const uint8_t P2_UNCHANGED = 1 << 4;
+        uint8_t p2_columns_[SDLK_LAST][8];
+
         SDLKey pressed_;
 
+        // The reference scan looks the untranslated key up in keymap_ and
+        // the aliases every time P2 is read, instead of using the tables
+        SDLKey pressed_key_;
+        bool reference_scan_;
+        SDLKey scan_key(SDLKey key) const;
+        void calculate_p2_reference();
+
     public:
         Keyboard();
 
         SDLKey translate_key(SDLKey key) const;
 
-        void handle_key_down(const SDL_keysym &keysym);
-        void handle_key_up(const SDL_keysym &keysym);
+        bool handle_key_down(const SDL_keysym &keysym);
+        bool handle_key_up(const SDL_keysym &keysym);
 
         void calculate_p2();
+        void set_reference_scan(bool enabled) { reference_scan_ = enabled; }
 };
 
 extern Keyboard g_keyboard;
 
 inline SDLKey Keyboard::translate_key(SDLKey key) const
 {
-    set<SDLKey>::const_iterator it = possible_keys_.find(key);
-    if (it == possible_keys_.end()) {
-        map<SDLKey, SDLKey>::const_iterator it = aliases_.find(key);
-        if (it == aliases_.end())
-            return SDLK_UNKNOWN;
-        else
-            key = it->second;
-    }
-
-    return key;
+    return translations_[key];
 }
 
-inline void Keyboard::handle_key_down(const SDL_keysym &keysym)
+inline bool Keyboard::handle_key_down(const SDL_keysym &keysym)
 {
-    if (translate_key(keysym.sym) != SDLK_UNKNOWN)
-        pressed_ = keysym.sym;
+    SDLKey key = translate_key(keysym.sym);
+    if (key == SDLK_UNKNOWN)
+        return false;
+
+    pressed_ = key;
+    pressed_key_ = keysym.sym;
+    return true;
 }
 
-inline void Keyboard::handle_key_up(const SDL_keysym &keysym)
+inline bool Keyboard::handle_key_up(const SDL_keysym &keysym)
 {
-    if (translate_key(keysym.sym) != SDLK_UNKNOWN)
-        pressed_ = SDLK_UNKNOWN;
+    if (translate_key(keysym.sym) == SDLK_UNKNOWN)
+        return false;
+
+    pressed_ = pressed_key_ = SDLK_UNKNOWN;
+    return true;
 }
 
 inline void Keyboard::calculate_p2()
 {
-    if (pressed_ == SDLK_UNKNOWN || g_p1 & (1 << 2)) {
-        g_p2 |= 0xf0; // no key pressed or keyboard scan disabled
+    if (reference_scan_) {
+        calculate_p2_reference();
         return;
     }
 
-    int row = g_p2 & (1 << 0 | 1 << 1 | 1 << 2);
-    if (row > 5)
+    if (g_p1 & (1 << 2)) {
+        g_p2 |= 0xf0; // keyboard scan disabled
         return;
-
-    int pressed_col = -1;
-    for (int col = 0; col < 8; ++col) {
-        if (pressed_ == keymap_[row][col]) {
-            pressed_col = col ^ (1 << 0 | 1 << 1 | 1 << 2);
-            break;
-        }
     }
 
-    if (pressed_col == -1)
-        g_p2 |= 0xf0;
-    else
-        g_p2 = (g_p2 & 0x0f) | pressed_col << 5;
+    uint8_t columns = p2_columns_[pressed_][g_p2 & (1 << 0 | 1 << 1 | 1 << 2)];
+    if (columns != P2_UNCHANGED)
+        g_p2 = (g_p2 & 0x0f) | columns;
 }
 
 #endif
@@ -0,0 +1,58 @@
+#ifndef LATENCYTRACER_H
+#define LATENCYTRACER_H
+
+#include "common.h"
+
+#include <iostream>
+#include <vector>
+
+// Measures how long it takes for input to make it to the screen. Every input
+// event is timestamped, then matched to the first keyboard or joystick scan
+// that follows it and to the first frame presented after that scan.
+class LatencyTracer
+{
+    private:
+        // Inputs that no scan has seen yet
+        vector<uint64_t> pending_;
+
+        // Inputs that have been scanned, with the time of the scan
+        vector<pair<uint64_t, uint64_t> > scanned_;
+
+        vector<uint64_t> input_to_scan_, input_to_present_;
+        bool muted_;
+
+        void mark_scanned();
+        static void print_percentiles(ostream &out, vector<uint64_t> samples);
+
+    public:
+        LatencyTracer();
+
+        void input(uint64_t when);
+        void scan();
+        void frame_presented(uint64_t when);
+
+        // While muted, scans don't see the pending inputs
+        void set_muted(bool muted) { muted_ = muted; }
+
+        void debug_print_stats(ostream &out) const;
+};
+
+extern LatencyTracer g_latency_tracer;
+
+inline LatencyTracer::LatencyTracer()
+    : muted_(false)
+{
+}
+
+inline void LatencyTracer::input(uint64_t when)
+{
+    pending_.push_back(when);
+}
+
+inline void LatencyTracer::scan()
+{
+    if (!muted_ && !pending_.empty())
+        mark_scanned();
+}
+
+#endif
@@ -5,15 +5,22 @@
 
 #include <SDL_opengl.h>
 #include <algorithm>
+#include <cstring>
 #include <stdexcept>
+#include <vector>
 
+#include "dirtyrows.h"
 #include "framebuffer.h"
 
 class OpenGLFramebuffer : public Framebuffer
 {
     private:
-        static const int SCREEN_WIDTH_POWER2 = 512;
+        static const int SCREEN_WIDTH_POWER2 = 1024;
         static const int SCREEN_HEIGHT_POWER2 = 256;
+        static const int NUM_PBOS = 2;
+        static const int TRANSPARENT_INDEX = 0xff;
+        static const int ATLAS_WIDTH = 8;
+        static const int ATLAS_HEIGHT = 1024;
 
         SDL_Surface *screen_, *buffer_;
 
@@ -21,12 +28,63 @@ class OpenGLFramebuffer : public Framebuffer
 
         Uint32 colormap_[COLORTABLE_SIZE];
 
+        // If shaders are supported, frames are uploaded as color indices and
+        // the palette lookup and scaling are done in a fragment shader
+        bool indexed_;
+        GLuint program_, palette_texture_;
+        SDL_Color palette_[256];
+        GLenum upload_format_;
+
+        // Width and size in bytes of the rows uploaded, never wider than
+        // the texture
+        int upload_width_, row_size_;
+
         GLuint texture_;
         GLenum texture_target_;
         GLfloat texture_x_, texture_y_;
         GLsizei texture_width_, texture_height_;
 
+        // Only the rows that changed since the last frame are uploaded. The
+        // rows drawn to are compared against a copy of what's in the texture
+        DirtyRows dirty_rows_;
+        vector<Uint8> texture_copy_;
+        vector<uint8_t> changed_rows_;
+        unsigned long rows_drawn_, rows_uploaded_;
+
+        // Uploads are done through pixel buffer objects if supported
+        bool pbo_support_;
+        GLuint pbos_[NUM_PBOS];
+        int cur_pbo_;
+
+        // With GPU compositing, the objects drawn during the frame are
+        // collected and drawn as instanced quads into the frame texture
+        struct ObjectInstance {
+            GLfloat rect[4];
+            GLfloat clip[4];
+            GLfloat pattern[4];
+            GLfloat color;
+        };
+        bool compositing_;
+        GLuint compositor_program_, atlas_texture_, framebuffer_object_;
+        GLuint quad_buffer_, instance_buffer_;
+        SDL_Rect clip_r_;
+        vector<ObjectInstance> objects_;
+        unsigned long objects_composed_, frames_composed_;
+
         template<typename T> void load_proc(T &var, const char *procname);
+        template<typename T> bool try_load_proc(T &var, const char *procname);
+
+        bool init_shaders();
+        GLuint compile_shader(GLenum type, const char *prologue, const char *source);
+        GLuint link_program(GLuint vertex_shader, GLuint fragment_shader, const char **attributes);
+        SDL_Surface *create_indexed_surface(int w, int h);
+        void init_pbos();
+        int find_changed_rows();
+        void upload_rows(int num_rows);
+
+        bool init_compositor();
+        void add_object(const SDL_Rect &r, int row, int x_scale, int y_scale, int gap, int color);
+        void compose_objects();
 
         string snapshot_;
 
@@ -43,41 +101,115 @@ class OpenGLFramebuffer : public Framebuffer
         void paste_surface(int x, int y, SDL_Surface *surface);
         void paste_surface(int x, int y, SDL_Surface *surface, SDL_Rect &src_r);
 
+        SDL_Surface *create_object_surface(int w, int h);
+        Uint32 map_object_color(SDL_Surface *surface, int color);
+        void clear_object_surface(SDL_Surface *surface);
+
+        bool composes_objects() const { return compositing_; }
+        void draw_pattern(SDL_Rect &r, int row, int x_scale, int y_scale, int gap, int color);
+
+        int begin_bands();
+
         void blit();
 
         void take_snapshot(const string &str) { snapshot_ = str; }
+
+        void debug_print_stats(ostream &out) const;
 };
 
 inline OpenGLFramebuffer::OpenGLFramebuffer()
-    : screen_(NULL), buffer_(NULL)
+    : screen_(NULL), buffer_(NULL),
+      indexed_(false), program_(0), palette_texture_(0),
+      rows_drawn_(0), rows_uploaded_(0),
+      pbo_support_(false), cur_pbo_(0),
+      compositing_(false), objects_composed_(0), frames_composed_(0)
 {
+    clip_r_.x = 0;
+    clip_r_.y = 0;
+    clip_r_.w = SCREEN_WIDTH;
+    clip_r_.h = SCREEN_HEIGHT;
 }
 
 inline void OpenGLFramebuffer::set_clip_rect(SDL_Rect &r)
 {
+    clip_r_ = r;
     SDL_SetClipRect(buffer_, &r);
 }
 
 inline void OpenGLFramebuffer::clear_clip_rect()
 {
+    clip_r_.x = 0;
+    clip_r_.y = 0;
+    clip_r_.w = SCREEN_WIDTH;
+    clip_r_.h = SCREEN_HEIGHT;
     SDL_SetClipRect(buffer_, NULL);
 }
 
+inline void OpenGLFramebuffer::add_object(const SDL_Rect &r, int row, int x_scale, int y_scale, int gap, int color)
+{
+    ObjectInstance object = {
+        {r.x, r.y, r.w, r.h},
+        {clip_r_.x, clip_r_.y, clip_r_.x + clip_r_.w, clip_r_.y + clip_r_.h},
+        {row, x_scale, y_scale, gap},
+        color
+    };
+    objects_.push_back(object);
+}
+
 inline void OpenGLFramebuffer::fill_rect(SDL_Rect &r, int color)
 {
+    if (compositing_) {
+        add_object(r, -1, 1, 1, 0, color);
+        return;
+    }
+
+    dirty_rows_.mark(r);
     SDL_FillRect(buffer_, &r, colormap_[color]);
 }
 
 inline void OpenGLFramebuffer::paste_surface(int x, int y, SDL_Surface *surface)
 {
     SDL_Rect r = {x, y, 0, 0};
+    dirty_rows_.mark(y, surface->h);
     SDL_BlitSurface(surface, NULL, buffer_, &r);
 }
 
 inline void OpenGLFramebuffer::paste_surface(int x, int y, SDL_Surface *surface, SDL_Rect &src_r)
 {
     SDL_Rect r = {x, y, 0, 0};
+    dirty_rows_.mark(y, src_r.h);
     SDL_BlitSurface(surface, &src_r, buffer_, &r);
 }
 
+inline void OpenGLFramebuffer::draw_pattern(SDL_Rect &r, int row, int x_scale, int y_scale, int gap, int color)
+{
+    add_object(r, row, x_scale, y_scale, gap, object_colors_[color]);
+}
+
+inline int OpenGLFramebuffer::begin_bands()
+{
+    if (bands_.empty())
+        return 0;
+
+    // The bands can't mark rows concurrently, so mark them all beforehand
+    dirty_rows_.mark_all();
+    return bands_.size();
+}
+
+inline Uint32 OpenGLFramebuffer::map_object_color(SDL_Surface *surface, int color)
+{
+    if (indexed_)
+        return object_colors_[color];
+    else
+        return Framebuffer::map_object_color(surface, color);
+}
+
+inline void OpenGLFramebuffer::clear_object_surface(SDL_Surface *surface)
+{
+    if (indexed_)
+        memset(surface->pixels, TRANSPARENT_INDEX, surface->pitch * surface->h);
+    else
+        Framebuffer::clear_object_surface(surface);
+}
+
 #endif
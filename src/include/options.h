@@ -16,6 +16,7 @@ class Options
         map <string, SDLKey> keymap_;
 
         SDLKey parse_key(IniParser &parser, const string &name, const string &section);
+        static unsigned int parse_count(const char *arg, const char *what);
 
     public:
         typedef enum {
@@ -23,19 +24,39 @@ class Options
             SCALING_MODE_LINEAR
         } scaling_mode_t;
 
+        typedef enum {
+            COMPOSITING_SOFTWARE,
+            COMPOSITING_GPU
+        } compositing_t;
+
         string bios, rom;
         string snapshot_dir;
 
         bool pal_emulation;
         unsigned int speed_limit;
+        unsigned int threads;
+        bool input_thread;
+        unsigned int max_frames;
 
         bool debug, debug_on_ill;
+        string counters_output;
+        unsigned int counters_interval;
+        string profiler_trace;
+        bool guest_profile;
+        string coverage_output;
+        string heatmap_csv, heatmap_image;
+        string trace_crash_dump;
+        unsigned int validate_interval;
 
-        bool opengl;
+        bool headless;
+        bool opengl, opengl_shaders;
         unsigned int x_res, y_res;
         bool fullscreen, double_buffering;
         bool keep_aspect;
         scaling_mode_t scaling_mode;
+        compositing_t compositing;
+        bool present_thread;
+        bool line_cache;
 
         Joysticks::controls_t controls[2];
 
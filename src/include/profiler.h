@@ -0,0 +1,127 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "common.h"
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+#include "speedlimit.h"
+
+// Measures how much time the host spends in every part of the emulator.
+// Zones are entered and left through PROFILE_ZONE, which compiles to nothing
+// unless ENABLE_PROFILER is set. Time is charged to the innermost zone only,
+// so nested zones don't count twice. Zones entered from the worker threads
+// aren't measured, a parallel draw is accounted as a whole. Optionally every
+// zone other than the per-instruction ones is written to a trace file in the
+// Chrome trace event format.
+class Profiler
+{
+    public:
+        enum zone_t {
+            ZONE_CPU,
+            ZONE_VDC,
+            ZONE_BACKGROUND,
+            ZONE_GRID,
+            ZONE_CHARS,
+            ZONE_SPRITES,
+            ZONE_BANDS,
+            ZONE_BLIT,
+            ZONE_PACING,
+            NUM_ZONES
+        };
+
+    private:
+        static const int MAX_DEPTH = 16;
+
+        static const char *const names_[NUM_ZONES];
+
+        static __thread bool profiled_thread_;
+
+        zone_t stack_[MAX_DEPTH];
+        uint64_t entered_[MAX_DEPTH];
+        int depth_;
+        uint64_t last_;
+
+        uint64_t frame_[NUM_ZONES], total_[NUM_ZONES], max_[NUM_ZONES];
+        unsigned long frames_;
+
+        uint64_t start_ticks_, start_nsecs_;
+        double nsecs_per_tick_;
+
+        FILE *trace_;
+        unsigned long trace_events_;
+
+        static uint64_t ticks();
+        void calibrate();
+        double to_usecs(uint64_t ticks) const;
+        void begin_trace_event();
+        void trace_zone(zone_t zone, uint64_t begin, uint64_t end);
+
+    public:
+        Profiler();
+        ~Profiler();
+
+        void init(const string &trace);
+
+        void enter(zone_t zone);
+        void leave();
+        void end_frame();
+
+        void debug_print_stats(ostream &out) const;
+};
+
+extern Profiler g_profiler;
+
+class ProfileZone
+{
+    public:
+        ProfileZone(Profiler::zone_t zone) { g_profiler.enter(zone); }
+        ~ProfileZone() { g_profiler.leave(); }
+};
+
+#ifdef ENABLE_PROFILER
+# define PROFILE_ZONE(zone) ProfileZone profile_zone_(Profiler::ZONE_##zone)
+#else
+# define PROFILE_ZONE(zone) ((void)0)
+#endif
+
+inline uint64_t Profiler::ticks()
+{
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+    return __builtin_ia32_rdtsc();
+#else
+    return SpeedLimit::get_nsecs();
+#endif
+}
+
+inline void Profiler::enter(zone_t zone)
+{
+    if (!profiled_thread_)
+        return;
+    assert(depth_ < MAX_DEPTH);
+
+    uint64_t now = ticks();
+    if (depth_)
+        frame_[stack_[depth_ - 1]] += now - last_;
+    stack_[depth_] = zone;
+    entered_[depth_++] = now;
+    last_ = now;
+}
+
+inline void Profiler::leave()
+{
+    if (!profiled_thread_ || !depth_)
+        return;
+
+    uint64_t now = ticks();
+    zone_t zone = stack_[--depth_];
+    frame_[zone] += now - last_;
+    last_ = now;
+
+    if (trace_ && zone != ZONE_CPU && zone != ZONE_VDC)
+        trace_zone(zone, entered_[depth_], now);
+}
+
+#endif
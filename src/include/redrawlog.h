@@ -0,0 +1,64 @@
+#ifndef REDRAWLOG_H
+#define REDRAWLOG_H
+
+#include "common.h"
+
+#include <iostream>
+#include <map>
+
+// Records every screen redraw triggered by a VDC write in the middle of a
+// frame: which register was written, its old and new values, the beam
+// position, how many pixels had to be redrawn and the guest instruction that
+// did it. The latest redraws are kept in a ring buffer of fixed size records,
+// and totals per register and per ROM address are kept for the whole run.
+class RedrawLog
+{
+    public:
+        struct record_t {
+            uint32_t frame;
+            uint32_t pixels;
+            uint16_t pc; // ROM bank in the top bits
+            int16_t line;
+            uint16_t x;
+            uint8_t offset, old_value, new_value;
+        };
+
+    private:
+        static const int RING_SIZE = 4096;
+        static const int NUM_SHOWN = 8;
+
+        record_t ring_[RING_SIZE];
+        unsigned long recorded_;
+        uint32_t frame_;
+        bool muted_;
+
+        struct total_t {
+            unsigned long redraws;
+            uint64_t pixels;
+            total_t() : redraws(0), pixels(0) {}
+        };
+        map<int, total_t> offsets_, pcs_;
+
+        void print_totals(ostream &out, const char *what, const map<int, total_t> &totals, bool pcs) const;
+
+    public:
+        RedrawLog();
+
+        void record(uint8_t offset, uint8_t old_value, uint8_t new_value, int line, int x, int pixels);
+        void end_frame() { ++frame_; }
+
+        // While muted, redraws aren't recorded
+        void set_muted(bool muted) { muted_ = muted; }
+
+        void debug_dump(ostream &out, int count) const;
+        void debug_print_stats(ostream &out) const;
+};
+
+extern RedrawLog g_redraw_log;
+
+inline RedrawLog::RedrawLog()
+    : recorded_(0), frame_(0), muted_(false)
+{
+}
+
+#endif
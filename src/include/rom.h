@@ -22,6 +22,7 @@ class Rom : public ifstream
 
         uint8_t &operator[](int index) { return current_bank_[index % BANK_SIZE]; }
         uint8_t operator[](int index) const { return current_bank_[index % BANK_SIZE]; }
+        uint8_t at(int bank, int index) const { return banks_[bank][index % BANK_SIZE]; }
 };
 
 extern Rom g_rom;
@@ -0,0 +1,61 @@
+#ifndef SCALER_H
+#define SCALER_H
+
+#include "common.h"
+
+#include <algorithm>
+#include <vector>
+
+// Nearest neighbour scaler used by the software framebuffer. Scaling is
+// separable: one table maps destination columns to source columns and another
+// maps destination rows to source rows, so memory use grows with the window
+// dimensions instead of with its area. Destination rows that map to the same
+// source row as the previous one are simply copied.
+class Scaler
+{
+    private:
+        typedef void (*row_kernel_t)(const Uint32 *src, Uint32 *dst,
+                const int *x_table, unsigned int width, int factor);
+
+        // Scaling of outputs bigger than this is split among the worker pool
+        static const unsigned int PARALLEL_THRESHOLD = 1024 * 768;
+
+        vector<int> x_table_, y_table_;
+        int x_factor_;
+        row_kernel_t row_kernel_;
+
+        class ScaleJob;
+        void scale_rows_serial(const Uint32 *src, unsigned int src_pitch, Uint32 *dst, unsigned int dst_pitch,
+                unsigned int y_begin, unsigned int y_end) const;
+
+    public:
+        Scaler();
+
+        void init(unsigned int width, unsigned int height, float x_scale, float y_scale);
+
+        unsigned int width() const { return x_table_.size(); }
+        unsigned int height() const { return y_table_.size(); }
+        int source_row(unsigned int y) const { return y_table_[y]; }
+        unsigned int first_row_from(int src_y) const;
+
+        void scale_rows(const Uint32 *src, unsigned int src_pitch, Uint32 *dst, unsigned int dst_pitch,
+                unsigned int y_begin, unsigned int y_end) const;
+        void scale(const Uint32 *src, unsigned int src_pitch, Uint32 *dst, unsigned int dst_pitch) const;
+};
+
+inline Scaler::Scaler()
+    : x_factor_(0), row_kernel_(NULL)
+{
+}
+
+inline unsigned int Scaler::first_row_from(int src_y) const
+{
+    return lower_bound(y_table_.begin(), y_table_.end(), src_y) - y_table_.begin();
+}
+
+inline void Scaler::scale(const Uint32 *src, unsigned int src_pitch, Uint32 *dst, unsigned int dst_pitch) const
+{
+    scale_rows(src, src_pitch, dst, dst_pitch, 0, height());
+}
+
+#endif
@@ -4,20 +4,59 @@
 #include "common.h"
 
 #include <algorithm>
+#include <cstring>
 #include <stdexcept>
 #include <vector>
 
+#include "dirtyrows.h"
 #include "framebuffer.h"
+#include "scaler.h"
+#include "triplebuffer.h"
 
 class SoftwareFramebuffer : public Framebuffer
 {
     private:
+        static const int NUM_BUFFERS = 3;
+        static const int BAND_HEIGHT = 8;
+        static const int NUM_BANDS = (SCREEN_HEIGHT + BAND_HEIGHT - 1) / BAND_HEIGHT;
+
         SDL_Surface *screen_, *buffer_;
 
-        vector<int> scaling_table_;
+        Scaler scaler_;
 
         Uint32 colormap_[COLORTABLE_SIZE];
 
+        // When presenting from a separate thread, buffer_ is the back buffer
+        // of a triple buffer and finished frames are handed to the presenter
+        SDL_Surface *buffers_[NUM_BUFFERS];
+        TripleBuffer triple_buffer_;
+        int previous_;
+        SDL_Thread *presenter_;
+        SDL_sem *frame_sem_;
+        volatile bool quit_;
+        unsigned long frames_published_, frames_dropped_;
+
+        SDL_mutex *snapshot_mutex_;
+        string snapshot_;
+
+        // Damage tracking. Every buffer remembers which rows were drawn to
+        // and the hash of each of its bands, and every page of the screen the
+        // hashes of the bands shown on it. Only the bands that differ from
+        // what's on the page are rescaled, and unchanged frames are skipped
+        DirtyRows dirty_rows_[NUM_BUFFERS];
+        uint64_t buffer_hashes_[NUM_BUFFERS][NUM_BANDS];
+        uint64_t page_hashes_[2][NUM_BANDS];
+        int num_pages_, back_page_;
+        unsigned long frames_presented_, frames_skipped_;
+        unsigned long bands_presented_, bands_scaled_;
+
+        DirtyRows &dirty_rows() { return dirty_rows_[presenter_ ? triple_buffer_.back() : 0]; }
+
+        SDL_Surface *create_buffer();
+        void start_presenter();
+        static int presenter_main(void *data);
+        void present(int index);
+
     public:
         SoftwareFramebuffer();
         ~SoftwareFramebuffer();
@@ -31,19 +70,29 @@ class SoftwareFramebuffer : public Framebuffer
         void paste_surface(int x, int y, SDL_Surface *surface);
         void paste_surface(int x, int y, SDL_Surface *surface, SDL_Rect &src_r);
 
+        void copy_previous_lines(int y, int h);
+
+        int begin_bands();
+
         void blit();
 
         void take_snapshot(const string &str);
+
+        void debug_print_stats(ostream &out) const;
+        unsigned long debug_frames_dropped() const { return frames_dropped_; }
 };
 
 inline SoftwareFramebuffer::SoftwareFramebuffer()
-    : screen_(NULL), buffer_(NULL)
-{
-}
-
-inline SoftwareFramebuffer::~SoftwareFramebuffer()
+    : screen_(NULL), buffer_(NULL),
+      previous_(0), presenter_(NULL), frame_sem_(NULL), quit_(false),
+      frames_published_(0), frames_dropped_(0),
+      snapshot_mutex_(NULL),
+      num_pages_(1), back_page_(0),
+      frames_presented_(0), frames_skipped_(0),
+      bands_presented_(0), bands_scaled_(0)
 {
-    SDL_FreeSurface(buffer_);
+    for (int i = 0; i < NUM_BUFFERS; ++i)
+        buffers_[i] = NULL;
 }
 
 inline void SoftwareFramebuffer::set_clip_rect(SDL_Rect &r)
@@ -58,24 +107,59 @@ inline void SoftwareFramebuffer::clear_clip_rect()
 
 inline void SoftwareFramebuffer::fill_rect(SDL_Rect &r, int color)
 {
+    dirty_rows().mark(r);
     SDL_FillRect(buffer_, &r, colormap_[color]);
 }
 
 inline void SoftwareFramebuffer::paste_surface(int x, int y, SDL_Surface *surface)
 {
     SDL_Rect r = {x, y, 0, 0};
+    dirty_rows().mark(y, surface->h);
     SDL_BlitSurface(surface, NULL, buffer_, &r);
 }
 
 inline void SoftwareFramebuffer::paste_surface(int x, int y, SDL_Surface *surface, SDL_Rect &src_r)
 {
     SDL_Rect r = {x, y, 0, 0};
+    dirty_rows().mark(y, src_r.h);
     SDL_BlitSurface(surface, &src_r, buffer_, &r);
 }
 
+inline void SoftwareFramebuffer::copy_previous_lines(int y, int h)
+{
+    // Only needed when rendering to a different buffer every frame
+    if (!presenter_)
+        return;
+
+    SDL_Surface *previous = buffers_[previous_];
+    for (int i = y; i < y + h; ++i)
+        memcpy((Uint8 *)buffer_->pixels + i * buffer_->pitch, (Uint8 *)previous->pixels + i * previous->pitch,
+                SCREEN_WIDTH * sizeof(Uint32));
+    dirty_rows().mark(y, h);
+}
+
+inline int SoftwareFramebuffer::begin_bands()
+{
+    if (bands_.empty())
+        return 0;
+
+    // The bands can't mark rows concurrently, so mark them all beforehand
+    dirty_rows().mark_all();
+    retarget_bands(buffer_);
+    return bands_.size();
+}
+
 inline void SoftwareFramebuffer::take_snapshot(const string &str)
 {
-    SDL_SaveBMP(screen_, str.c_str());
+    if (presenter_) {
+        // The screen belongs to the presenter, let it take the snapshot
+        SDL_mutexP(snapshot_mutex_);
+        snapshot_ = str;
+        SDL_mutexV(snapshot_mutex_);
+    }
+    else {
+        SDL_SaveBMP(screen_, str.c_str());
+    }
 }
 
 #endif
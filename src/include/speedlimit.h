@@ -3,61 +3,47 @@
 
 #include "common.h"
 
-#ifdef HAVE_GETTIMEOFDAY
-# ifdef HAVE_SYS_TIME_H
-#  include <sys/time.h>
-# endif
-# ifdef HAVE_TIME_H
-#  include <time.h>
-# endif
-#endif
-
-#include "options.h"
+#include <iostream>
+#include <vector>
 
+// Paces emulation to the frame rate of the emulated machine. Frame deadlines
+// are computed from the start time and the number of frames run so far, so
+// rounding errors don't accumulate. It sleeps until shortly before every
+// deadline and spins for the rest, and keeps a histogram of frame times.
 class SpeedLimit
 {
     private:
-        const uint32_t ticks_per_frame_;
-        uint32_t last_ticks_;
-        int32_t delta_;
+        static const uint64_t NSECS_PER_SEC = 1000000000ULL;
+
+        // Sleeping is only trusted up to this close to the deadline
+        static const uint64_t SPIN_NSECS = 1000000;
+
+        // Give up on catching up if we fall this far behind
+        static const uint64_t MAX_LAG_NSECS = 100000000;
+
+        // Frame times are kept in buckets of 100 us, up to 100 ms
+        static const uint64_t BUCKET_NSECS = 100000;
+        static const int NUM_BUCKETS = 1000;
+
+        double frame_nsecs_;
+        uint64_t start_, frames_, last_frame_end_;
+
+        vector<unsigned long> histogram_;
+        unsigned long frames_measured_;
+        uint64_t max_frame_nsecs_;
+
+        void sleep_until(uint64_t deadline);
+        void measure(uint64_t frame_nsecs);
+        double percentile(int percent) const;
 
     public:
         SpeedLimit();
+        ~SpeedLimit();
 
-        uint32_t get_ticks();
+        static uint64_t get_nsecs();
         void limit_on_frame_end();
-};
-
-inline SpeedLimit::SpeedLimit()
-    : ticks_per_frame_((uint32_t)(1000000 / ((g_options.pal_emulation ? 50 : 60) * g_options.speed_limit / 100.0))),
-      last_ticks_(get_ticks()),
-      delta_(0)
-{
-}
-
-inline uint32_t SpeedLimit::get_ticks()
-{
-#ifdef HAVE_GETTIMEOFDAY
-    timeval now;
-    gettimeofday(&now, 0);
-    return now.tv_sec * 1000000 + now.tv_usec;
-#else
-    return SDL_GetTicks() * 1000;
-#endif
-}
 
-inline void SpeedLimit::limit_on_frame_end()
-{
-    delta_ += last_ticks_ + ticks_per_frame_ - get_ticks();
-    if (delta_ < 0) {
-        last_ticks_ = get_ticks();
-        delta_ = 0;
-    }
-    else if (delta_ > 10000) {
-        SDL_Delay(delta_ / 1000);
-        last_ticks_ = get_ticks();
-        delta_ = 0;
-    }
-}
+        void debug_print_stats(ostream &out) const;
+};
 
 #endif
@@ -3,21 +3,28 @@
 
 #include "common.h"
 
+#include "framebuffer.h"
+
 class Sprites
 {
     private:
         static const int SPRITE_CONTROL_START = 0x00;
         static const int SPRITE_SHAPE_START = 0x80;
 
+        static const int SURFACE_WIDTH = 16 * Framebuffer::SCREEN_WIDTH_MULTIPLIER;
+
         SDL_Surface *surface_;
         uint32_t colormap_[8];
 
-        void draw_sprite(uint8_t *ptr, uint8_t *shape, SDL_Rect &clip_r);
+        void draw_sprite(Canvas &canvas, uint8_t *ptr, uint8_t *shape, SDL_Rect &clip_r);
 
     public:
+        // Bits of the object masks for the sprites
+        static const int SLOTS_START = 28;
+
         void init();
 
-        void draw(uint8_t *mem, SDL_Rect &clip_r);
+        void draw(Canvas &canvas, uint8_t *mem, SDL_Rect &clip_r, uint32_t objects = ~0u);
 };
 
 extern Sprites g_sprites;
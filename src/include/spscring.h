@@ -0,0 +1,61 @@
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include "common.h"
+
+// Lock-free ring buffer shared by one producer and one consumer. SIZE must be
+// a power of two, and one slot is always left empty to tell a full ring from
+// an empty one.
+template<typename T, unsigned int SIZE> class SpscRing
+{
+    private:
+        static const unsigned int MASK = SIZE - 1;
+
+        T items_[SIZE];
+
+        // Next slot to be read and next slot to be written
+        volatile unsigned int head_, tail_;
+
+    public:
+        SpscRing();
+
+        // Producer side, returns false if the ring is full
+        bool push(const T &item);
+
+        // Consumer side, returns false if the ring is empty
+        bool pop(T &item);
+};
+
+template<typename T, unsigned int SIZE> inline SpscRing<T, SIZE>::SpscRing()
+    : head_(0), tail_(0)
+{
+}
+
+template<typename T, unsigned int SIZE> inline bool SpscRing<T, SIZE>::push(const T &item)
+{
+    unsigned int tail = tail_;
+    if (((tail + 1) & MASK) == head_)
+        return false;
+
+    // The item has to be visible before the consumer sees the new tail
+    items_[tail] = item;
+    __sync_synchronize();
+    tail_ = (tail + 1) & MASK;
+    return true;
+}
+
+template<typename T, unsigned int SIZE> inline bool SpscRing<T, SIZE>::pop(T &item)
+{
+    unsigned int head = head_;
+    if (head == tail_)
+        return false;
+
+    // And it has to be read before the producer sees the slot as free
+    __sync_synchronize();
+    item = items_[head];
+    __sync_synchronize();
+    head_ = (head + 1) & MASK;
+    return true;
+}
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef TRACERING_H
+#define TRACERING_H
+
+#include "common.h"
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Fixed size ring of binary trace events: instructions, interrupts, VDC
+// accesses and redraws and so on. Events are added through the TRACE macro,
+// which compiles to nothing unless ENABLE_TRACE is set. The emulation thread
+// is the only writer, so adding an event is just a couple of stores. The ring
+// can be saved to a file from the debugger or when the emulator crashes, and
+// turned into text by ttear-tracedump, or shown from the debugger.
+class TraceRing
+{
+    public:
+        enum event_type_t {
+            EVENT_INSTRUCTION,  // arg0: opcode, arg1: accumulator
+            EVENT_IRQ,          // arg0: vector
+            EVENT_VDC_READ,     // arg0: value << 8 | offset, arg1: line << 16 | beam
+            EVENT_VDC_WRITE,    // arg0: value << 8 | offset, arg1: line << 16 | beam
+            EVENT_REDRAW,       // arg0: pixels, arg1: line << 16 | beam
+            EVENT_VBLANK,
+            EVENT_ILLEGAL,      // arg0: opcode
+            EVENT_BREAKPOINT,
+            NUM_EVENT_TYPES
+        };
+
+        struct event_t {
+            uint32_t frame;
+            uint16_t type;
+            uint16_t pc; // ROM bank in the top bits
+            uint32_t arg0, arg1;
+        };
+
+        // Layout of saved traces, followed by the events from oldest to newest
+        struct header_t {
+            char magic[8];
+            uint32_t version, event_size;
+            uint64_t num_events;
+        };
+
+        static const char MAGIC[8];
+        static const uint32_t VERSION = 1;
+
+    private:
+        static const int RING_SIZE = 1 << 16;
+
+        vector<event_t> ring_;
+        uint64_t added_;
+        uint32_t frame_;
+        bool muted_;
+
+        static char crash_path_[1024];
+        static void crash_handler(int sig);
+
+        void write_events(FILE *file) const;
+
+    public:
+        TraceRing();
+
+        void init(const string &crash_path);
+        bool enabled() const { return !ring_.empty(); }
+
+        void add(event_type_t type, int pc, uint32_t arg0, uint32_t arg1);
+        void end_frame() { ++frame_; }
+
+        // While muted, events are dropped
+        void set_muted(bool muted) { muted_ = muted; }
+
+        bool save(const string &path) const;
+
+        static void format(ostream &out, const event_t &event);
+        void debug_dump(ostream &out, int count) const;
+};
+
+extern TraceRing g_trace_ring;
+
+// Must be used where g_cpu is known, events are tagged with the current PC
+#ifdef ENABLE_TRACE
+# define TRACE(type, arg0, arg1) g_trace_ring.add(TraceRing::EVENT_##type, \
+        (g_p1 & (1 << 0 | 1 << 1)) << 12 | g_cpu.debug_get_pc(), arg0, arg1)
+#else
+# define TRACE(type, arg0, arg1) ((void)0)
+#endif
+
+inline TraceRing::TraceRing()
+    : added_(0), frame_(0), muted_(false)
+{
+}
+
+inline void TraceRing::add(event_type_t type, int pc, uint32_t arg0, uint32_t arg1)
+{
+    if (muted_)
+        return;
+
+    event_t &event = ring_[added_++ & (RING_SIZE - 1)];
+    event.frame = frame_;
+    event.type = type;
+    event.pc = pc;
+    event.arg0 = arg0;
+    event.arg1 = arg1;
+}
+
+#endif
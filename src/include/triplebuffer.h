@@ -0,0 +1,77 @@
+#ifndef TRIPLEBUFFER_H
+#define TRIPLEBUFFER_H
+
+#include "common.h"
+
+// Lock-free bookkeeping for a triple buffer shared by one producer and one
+// consumer. The producer always owns the back buffer and the consumer the
+// front one, the third one holds the latest published frame. Publishing never
+// waits for the consumer: if it hasn't fetched the previous frame yet, that
+// frame is simply dropped.
+class TripleBuffer
+{
+    private:
+        static const int INDEX_MASK = 3;
+        static const int FRESH = 4;
+
+        // Index of the buffer in the middle, plus FRESH if it hasn't been fetched yet
+        volatile int middle_;
+        int back_, front_;
+
+        int exchange_middle(int value);
+
+    public:
+        TripleBuffer();
+
+        void reset();
+
+        int back() const { return back_; }
+        int front() const { return front_; }
+
+        // Producer side, returns whether the previous frame was dropped
+        bool publish();
+
+        // Consumer side, returns whether a new frame was moved to the front
+        bool fetch();
+};
+
+inline TripleBuffer::TripleBuffer()
+{
+    reset();
+}
+
+inline void TripleBuffer::reset()
+{
+    back_ = 0;
+    middle_ = 1;
+    front_ = 2;
+}
+
+inline int TripleBuffer::exchange_middle(int value)
+{
+    // The compare-and-swap is a full barrier, so the contents of the buffer
+    // are visible to the other side before its index is
+    int old;
+    do {
+        old = middle_;
+    } while (__sync_val_compare_and_swap(&middle_, old, value) != old);
+    return old;
+}
+
+inline bool TripleBuffer::publish()
+{
+    int old = exchange_middle(back_ | FRESH);
+    back_ = old & INDEX_MASK;
+    return old & FRESH;
+}
+
+inline bool TripleBuffer::fetch()
+{
+    if (!(middle_ & FRESH))
+        return false;
+
+    front_ = exchange_middle(front_) & INDEX_MASK;
+    return true;
+}
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef VALIDATOR_H
+#define VALIDATOR_H
+
+#include "common.h"
+
+#include <iostream>
+
+#include "cpu.h"
+#include "extstorage.h"
+#include "vdc.h"
+
+// Checks the fast execution paths against the reference ones. Emulation is
+// run in chunks of a fixed number of instructions, every chunk twice from the
+// same machine state: first on the fast paths, then on the reference ones. Those
+// cover the lazy timer, the MOVX bus decode and the keyboard and joystick
+// lookups. The CPU, VDC and external RAM states both runs end up in must be
+// the same.
+// When they aren't, the chunk is replayed one instruction at a time to find
+// the first one where they part, which is reported along with the latest
+// instructions run. The machine always carries on from the reference state.
+// Everything run after the first pass is a replay, which the counters, the
+// heatmap, the latency tracer, the trace, the redraw log and the display don't
+// see.
+class Validator
+{
+    private:
+        static const int WINDOW_SIZE = 32;
+
+        struct machine_state_t {
+            Cpu::state_t cpu;
+            Vdc::state_t vdc;
+            ExternalStorage::state_t extstorage;
+            uint8_t p1, p2;
+            bool t1;
+        };
+        machine_state_t start_, fast_, reference_;
+
+        unsigned int interval_;
+        uint64_t instructions_, chunks_;
+        bool diverged_;
+
+        // The latest instructions run, ROM bank in the top bits
+        uint16_t window_[WINDOW_SIZE];
+
+        static void save(machine_state_t &state);
+        static void load(const machine_state_t &state);
+        static void set_reference(bool enabled);
+        static void set_replaying(bool replaying);
+        static bool compare(const machine_state_t &fast, const machine_state_t &reference, ostream *out);
+
+        // Returns true if the VDC entered VBLANK
+        template<bool pal> bool step(uint64_t index);
+
+        // Replays the chunk from its start, returns how many instructions
+        // were run until the first one that diverged. vblank is set to
+        // whether the last of them entered VBLANK on the reference path
+        template<bool pal> unsigned long find_divergence(unsigned long count, bool &vblank);
+        void print_window(ostream &out, uint64_t end) const;
+
+    public:
+        Validator();
+
+        void init(unsigned int interval) { interval_ = interval; }
+        bool enabled() const { return interval_ && !diverged_; }
+        bool diverged() const { return diverged_; }
+
+        // Runs a chunk on both paths, returns true if the VDC entered VBLANK
+        template<bool pal> bool run_chunk();
+
+        void debug_print_stats(ostream &out) const;
+};
+
+extern Validator g_validator;
+
+inline Validator::Validator()
+    : interval_(0), instructions_(0), chunks_(0), diverged_(false)
+{
+}
+
+#endif
@@ -20,6 +20,11 @@ class Vdc
         static const int Y_REGISTER = 0xa4;
         static const int X_REGISTER = 0xa5;
 
+        static const int SPRITE_CONTROL_START = 0x00;
+        static const int CHARS_START = 0x10;
+        static const int QUADS_START = 0x40;
+        static const int SPRITE_SHAPE_START = 0x80;
+
         static const int HORIZONTAL_GRID_START = 0xc0;
         static const int HORIZONTAL_GRID9_START = 0xd0;
         static const int VERTICAL_GRID_START = 0xe0;
@@ -33,10 +38,16 @@ class Vdc
         static const int COLLISION_EXTERNAL = 6;
         static const int COLLISION_CHAR = 7;
 
+        static const int BIN_HEIGHT = 8;
+        static const int NUM_BINS = (Framebuffer::SCREEN_HEIGHT + BIN_HEIGHT - 1) / BIN_HEIGHT;
+
         static const int CYCLES_PER_SCANLINE = 228;
         static const int HBLANK_START = 178;
         static const int HBLANK_END = 222;
 
+        static const int NTSC_FIRST_DRAWING_SCANLINE = 21;
+        static const int PAL_FIRST_DRAWING_SCANLINE = 70;
+
         vector<uint8_t> mem_;
 
         int cycles_, scanlines_, cur_frame_;
@@ -47,31 +58,83 @@ class Vdc
         bool grid_enabled() { return mem_[CONTROL_REGISTER] & 1 << 3; }
         bool foreground_enabled() { return mem_[CONTROL_REGISTER] & 1 << 5; }
 
-        void draw_background(SDL_Rect &clip_r);
-        void draw_grid(SDL_Rect &clip_r);
-        void draw_rect(SDL_Rect &clip_r);
+        // Mask of the objects that can be seen on every band of scanlines,
+        // updated whenever the position or the size of an object changes
+        uint32_t bins_[NUM_BINS];
+        void bin_object(int slot, int y, int h);
+        void update_bins(int offset);
+        void rebuild_bins();
+        uint32_t objects_in(const SDL_Rect &r) const;
+
+        void draw_background(Canvas &canvas, SDL_Rect &clip_r);
+        void draw_grid(Canvas &canvas, SDL_Rect &clip_r);
+        void draw_rect(Canvas &canvas, SDL_Rect &clip_r);
 
         bool screen_drawn_;
+        int redraws_;
+
+        // Set while the validator runs instructions again, the frame was
+        // already shown the first time around
+        bool replaying_;
+        class DrawJob;
         void draw_screen();
-        void update_screen();
+        void update_screen(uint8_t offset, uint8_t old_value, uint8_t new_value);
+
+        // Per-scanline render cache for the full screen draw at the start of
+        // every frame. Lines whose inputs hash the same as in the previous
+        // frame are kept from it instead of being drawn again. Lines redrawn
+        // by update_screen() don't match their hash, so they're invalidated
+        bool line_cache_;
+        vector<uint64_t> line_hashes_, prev_line_hashes_;
+        vector<uint8_t> line_valid_;
+        unsigned long line_hits_, line_misses_;
+
+        void hash_lines(vector<uint64_t> &hashes);
+        void draw_screen_cached();
 
         uint8_t latched_x_, latched_y_;
 
+        // Packed as in the trace events
+        uint32_t beam_position() const { return (uint32_t)(uint16_t)(scanlines_ - first_drawing_scanline_) << 16 | (uint16_t)cycles_; }
+
     public:
+        // Everything that affects how the program runs, the render caches
+        // are thrown away when a state is loaded
+        struct state_t {
+            uint8_t mem[MEMORY_SIZE];
+            int cycles, scanlines, cur_frame;
+            bool entered_vblank, screen_drawn;
+            int redraws;
+            uint8_t latched_x, latched_y;
+        };
+
         Vdc();
 
         void init();
 
         void reset();
-        void step();
+
+        void save_state(state_t &state) const;
+        void load_state(const state_t &state);
+
+        // Runs the VDC for the given number of cycles, specialized for the
+        // TV standard so that it isn't looked up on every cycle
+        template<bool pal> void step(int cycles);
 
         uint8_t read(uint8_t offset);
         void write(uint8_t offset, uint8_t value);
 
         bool entered_vblank();
+        void set_replaying(bool replaying) { replaying_ = replaying; }
+
+        // Average number of frames per second the emulated machine outputs
+        static double frame_rate(bool pal);
 
         void debug_dump(ostream &out) const { dump_memory(out, mem_, MEMORY_SIZE); }
+        uint8_t debug_peek(uint8_t offset) const { return mem_[offset]; }
+        int debug_get_scanline() const { return scanlines_; }
         void debug_print_timing(ostream &out);
+        void debug_print_stats(ostream &out) const;
 };
 
 extern Vdc g_vdc;
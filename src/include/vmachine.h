@@ -3,18 +3,72 @@
 
 #include "common.h"
 
+#include <string>
+
+#include "breakpoints.h"
+#include "inputthread.h"
+
 class VirtualMachine
 {
     private:
-        static const int UNPOLLED_FRAMES = 3;
+        typedef bool (VirtualMachine::*run_frame_t)();
+
+        static const int NUM_REDRAWS_SHOWN = 32;
+        static const int NUM_TRACE_EVENTS_SHOWN = 16;
+
+        Breakpoints breakpoints_;
+        bool paused_;
+        unsigned long frames_;
+
+        // What the debugger's run commands wait for before breaking. The
+        // count is the number of instructions left, the scanline or the stack
+        // pointer once the current routine returns
+        enum {
+            RUN_FREELY,
+            RUN_INSTRUCTIONS,
+            RUN_UNTIL_VBLANK,
+            RUN_UNTIL_SCANLINE,
+            RUN_UNTIL_RETURN
+        } run_until_;
+        unsigned long run_count_;
+
+        // Called after every instruction while debugging, returns true to break
+        bool debug_stop(int bank);
+        void debug_break();
+
+        InputThread input_thread_;
+
+        // Returns false if the event asks us to quit
+        bool handle_event(const SDL_Event &event, uint64_t when);
+
+        // Returns false if the input dropped asks us to quit
+        bool drop_stale_input();
+
+        // Variant of the emulation loop for the current TV standard and
+        // debugger state, picked whenever we return to emulation
+        run_frame_t run_frame_;
+        void select_run_frame();
+
+        // Return false if the frame was cut short before VBLANK
+        template<bool pal, bool debugging, bool profiling> bool run_frame();
+        template<bool pal> bool run_frame_validated();
+        template<bool pal> void step_instruction();
+        template<bool profiling> int step_cpu();
 
         void reset();
+        void write_coverage(const string &path);
 
     public:
+        VirtualMachine();
         ~VirtualMachine();
 
         void init(const char *romfile, const char *biosfile);
         void run();
 };
 
+inline VirtualMachine::VirtualMachine()
+    : paused_(false), frames_(0), run_until_(RUN_FREELY), run_count_(0), run_frame_(NULL)
+{
+}
+
 #endif
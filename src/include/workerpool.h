@@ -0,0 +1,55 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include "common.h"
+
+#include <vector>
+
+// A small pool of threads used to split work (scaling, rasterization) in
+// horizontal bands. The calling thread takes part in the work and run() only
+// returns once every band has been processed. Both the emulation thread and
+// the presentation thread hand jobs to the pool, so jobs run one at a time.
+class WorkerPool
+{
+    public:
+        class Job
+        {
+            public:
+                virtual ~Job() {}
+                virtual void run_band(int band, int num_bands) = 0;
+        };
+
+    private:
+        vector<SDL_Thread *> threads_;
+        SDL_mutex *mutex_, *run_mutex_;
+        SDL_cond *work_cond_, *done_cond_;
+
+        Job *job_;
+        int num_bands_, next_band_, pending_bands_;
+        bool quit_;
+
+        static int thread_main(void *data);
+        void work(bool wait_for_job);
+
+    public:
+        WorkerPool();
+        ~WorkerPool();
+
+        static int cpu_count();
+
+        void init(int num_threads);
+        int size() const { return threads_.size() + 1; }
+
+        void run(Job &job, int num_bands);
+};
+
+extern WorkerPool g_workers;
+
+inline WorkerPool::WorkerPool()
+    : mutex_(NULL), run_mutex_(NULL), work_cond_(NULL), done_cond_(NULL),
+      job_(NULL), num_bands_(0), next_band_(0), pending_bands_(0),
+      quit_(false)
+{
+}
+
+#endif
@@ -0,0 +1,60 @@
+#include "common.h"
+
+#include <stdexcept>
+
+#include "inputthread.h"
+
+#include "speedlimit.h"
+
+void InputThread::start()
+{
+    quit_ = false;
+    thread_ = SDL_CreateThread(thread_main, this);
+    if (!thread_)
+        throw runtime_error(SDL_GetError());
+    cout << "Collecting input from a separate thread" << endl;
+}
+
+void InputThread::stop()
+{
+    if (!thread_)
+        return;
+
+    // Wake the thread up in case it's waiting for events
+    quit_ = true;
+    SDL_Event event;
+    event.type = SDL_USEREVENT;
+    SDL_PushEvent(&event);
+
+    SDL_WaitThread(thread_, NULL);
+    thread_ = NULL;
+}
+
+int InputThread::thread_main(void *data)
+{
+    InputThread *thread = static_cast<InputThread *>(data);
+
+    event_t item;
+    while (!thread->quit_ && SDL_WaitEvent(&item.event)) {
+        if (item.event.type == SDL_USEREVENT)
+            continue;
+
+        // Never drop events, a lost key release would leave the key stuck
+        item.when = SpeedLimit::get_nsecs();
+        while (!thread->ring_.push(item) && !thread->quit_)
+            SDL_Delay(1);
+    }
+
+    return 0;
+}
+
+bool InputThread::pop(SDL_Event &event, uint64_t &when)
+{
+    event_t item;
+    if (!ring_.pop(item))
+        return false;
+
+    event = item.event;
+    when = item.when;
+    return true;
+}
@@ -1,83 +1,90 @@
 #include "common.h"
 
+#include <algorithm>
+
 #include "joysticks.h"
 
 #include "options.h"
 
 Joysticks g_joysticks;
 
-bool Joysticks::handle_key_down(const SDL_keysym &keysym)
+// Taken by reference by fill()
+const uint8_t Joysticks::UNBOUND;
+
+void Joysticks::bind(int index, SDLKey key, int bit)
+{
+    // The first control that uses a key wins
+    if (bindings_[key] == UNBOUND)
+        bindings_[key] = index << 3 | bit;
+}
+
+void Joysticks::init()
 {
+    fill(bindings_, bindings_ + SDLK_LAST, UNBOUND);
+
     for (int i = 0; i < 2; ++i) {
-        if (!g_options.controls[i].enabled)
+        const controls_t &controls = g_options.controls[i];
+        if (!controls.enabled)
             continue;
 
-        if (keysym.sym == g_options.controls[i].up) {
-            buses_[i] &= ~(1 << JOYSTICK_UP);
-            return true;
-        }
-        else if (keysym.sym == g_options.controls[i].down) {
-            buses_[i] &= ~(1 << JOYSTICK_DOWN);
-            return true;
-        }
-        else if (keysym.sym == g_options.controls[i].left) {
-            buses_[i] &= ~(1 << JOYSTICK_LEFT);
-            return true;
-        }
-        else if (keysym.sym == g_options.controls[i].right) {
-            buses_[i] &= ~(1 << JOYSTICK_RIGHT);
-            return true;
-        }
-        else if (keysym.sym == g_options.controls[i].action) {
-            buses_[i] &= ~(1 << JOYSTICK_ACTION);
-            return true;
-        }
+        bind(i, controls.up, JOYSTICK_UP);
+        bind(i, controls.down, JOYSTICK_DOWN);
+        bind(i, controls.left, JOYSTICK_LEFT);
+        bind(i, controls.right, JOYSTICK_RIGHT);
+        bind(i, controls.action, JOYSTICK_ACTION);
     }
+}
 
-    return false;
+uint8_t Joysticks::get_bus()
+{
+    if (!(g_p1 & 1 << 3 && g_p2 & 1 << 4))
+        return 0;
+
+    int index = g_p2 & (1 << 0 | 1 << 1 | 1 << 2);
+    if (index > 1)
+        return 0;
+    else if (reference_scan_)
+        return scan_bus(index);
+    else
+        return buses_[index];
 }
 
-bool Joysticks::handle_key_up(const SDL_keysym &keysym)
+uint8_t Joysticks::scan_binding(SDLKey key)
 {
     for (int i = 0; i < 2; ++i) {
-        if (!g_options.controls[i].enabled)
+        const controls_t &controls = g_options.controls[i];
+        if (!controls.enabled)
             continue;
 
-        if (keysym.sym == g_options.controls[i].up) {
-            buses_[i] |= 1 << JOYSTICK_UP;
-            return true;
-        }
-        else if (keysym.sym == g_options.controls[i].down) {
-            buses_[i] |= 1 << JOYSTICK_DOWN;
-            return true;
-        }
-        else if (keysym.sym == g_options.controls[i].left) {
-            buses_[i] |= 1 << JOYSTICK_LEFT;
-            return true;
-        }
-        else if (keysym.sym == g_options.controls[i].right) {
-            buses_[i] |= 1 << JOYSTICK_RIGHT;
-            return true;
-        }
-        else if (keysym.sym == g_options.controls[i].action) {
-            buses_[i] |= 1 << JOYSTICK_ACTION;
-            return true;
-        }
+        if (key == controls.up)
+            return i << 3 | JOYSTICK_UP;
+        else if (key == controls.down)
+            return i << 3 | JOYSTICK_DOWN;
+        else if (key == controls.left)
+            return i << 3 | JOYSTICK_LEFT;
+        else if (key == controls.right)
+            return i << 3 | JOYSTICK_RIGHT;
+        else if (key == controls.action)
+            return i << 3 | JOYSTICK_ACTION;
     }
 
-    return false;
+    return UNBOUND;
 }
 
-uint8_t Joysticks::get_bus()
+uint8_t Joysticks::scan_bus(int index) const
 {
-    if (!(g_p1 & 1 << 3 && g_p2 & 1 << 4))
-        return 0;
+    uint8_t bus = (1 << (JOYSTICK_ACTION + 1)) - 1;
+    for (int i = 0; i < 2; ++i) {
+        const controls_t &controls = g_options.controls[i];
+        if (!controls.enabled)
+            continue;
 
-    int index = g_p2 & (1 << 0 | 1 << 1 | 1 << 2);
-    if (index == 0)
-        return buses_[0];
-    else if (index == 1)
-        return buses_[1];
-    else
-        return 0;
+        const SDLKey keys[] = {controls.up, controls.down, controls.left, controls.right, controls.action};
+        for (int k = 0; k < 5; ++k) {
+            uint8_t binding = scan_binding(keys[k]);
+            if (held_[keys[k]] && binding >> 3 == index)
+                bus &= ~(1 << (binding & 7));
+        }
+    }
+    return bus;
 }
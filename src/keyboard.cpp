@@ -1,5 +1,7 @@
 #include "common.h"
 
+#include <algorithm>
+
 #include "keyboard.h"
 
 Keyboard g_keyboard;
@@ -13,22 +15,81 @@ const SDLKey Keyboard::keymap_[6][8] = {
     {SDLK_KP_MINUS, SDLK_KP_MULTIPLY, SDLK_KP_DIVIDE, SDLK_EQUALS, SDLK_y, SDLK_n, SDLK_BACKSPACE, SDLK_KP_ENTER}
 };
 
+const SDLKey Keyboard::aliases_[NUM_ALIASES][2] = {
+    {SDLK_SLASH, SDLK_QUESTION}, // the slash is generally below the question mark
+    {SDLK_PLUS, SDLK_KP_PLUS},
+    {SDLK_PERIOD, SDLK_KP_PERIOD},
+    {SDLK_MINUS, SDLK_KP_MINUS},
+    {SDLK_ASTERISK, SDLK_KP_MULTIPLY},
+    {SDLK_DELETE, SDLK_BACKSPACE},
+    {SDLK_RETURN, SDLK_KP_ENTER}
+};
+
 Keyboard::Keyboard()
-    : pressed_(SDLK_UNKNOWN)
+    : pressed_(SDLK_UNKNOWN), pressed_key_(SDLK_UNKNOWN), reference_scan_(false)
+{
+    fill(translations_, translations_ + SDLK_LAST, SDLK_UNKNOWN);
+
+    // Aliases first, so that keys that are in the keymap take precedence
+    for (int i = 0; i < NUM_ALIASES; ++i)
+        translations_[aliases_[i][0]] = aliases_[i][1];
+
+    // Rows that have no key pressed read as 0xf0, rows 6 and 7 don't exist
+    for (int key = 0; key < SDLK_LAST; ++key) {
+        fill(p2_columns_[key], p2_columns_[key] + 6, 0xf0);
+        fill(p2_columns_[key] + 6, p2_columns_[key] + 8, key == SDLK_UNKNOWN ? 0xf0 : P2_UNCHANGED);
+    }
+
+    for (int row = 0; row < 6; ++row) {
+        for (int col = 0; col < 8; ++col) {
+            SDLKey key = keymap_[row][col];
+            if (key == SDLK_UNKNOWN)
+                continue;
+            translations_[key] = key;
+            if (p2_columns_[key][row] == 0xf0)
+                p2_columns_[key][row] = (col ^ (1 << 0 | 1 << 1 | 1 << 2)) << 5;
+        }
+    }
+}
+
+SDLKey Keyboard::scan_key(SDLKey key) const
 {
-    // Fill the set of possible keys
-    for (int i = 0; i < 6; ++i) {
-        for (int j = 0; j < 8; ++j) {
-            if (keymap_[i][j] != SDLK_UNKNOWN)
-                possible_keys_.insert(keymap_[i][j]);
+    if (key == SDLK_UNKNOWN)
+        return SDLK_UNKNOWN;
+
+    for (int row = 0; row < 6; ++row) {
+        for (int col = 0; col < 8; ++col) {
+            if (keymap_[row][col] == key)
+                return key;
+        }
+    }
+
+    for (int i = 0; i < NUM_ALIASES; ++i) {
+        if (aliases_[i][0] == key)
+            return aliases_[i][1];
+    }
+
+    return SDLK_UNKNOWN;
+}
+
+void Keyboard::calculate_p2_reference()
+{
+    SDLKey pressed = scan_key(pressed_key_);
+    if (pressed == SDLK_UNKNOWN || g_p1 & (1 << 2)) {
+        g_p2 |= 0xf0; // no key pressed or keyboard scan disabled
+        return;
+    }
+
+    int row = g_p2 & (1 << 0 | 1 << 1 | 1 << 2);
+    if (row > 5)
+        return;
+
+    for (int col = 0; col < 8; ++col) {
+        if (pressed == keymap_[row][col]) {
+            g_p2 = (g_p2 & 0x0f) | (col ^ (1 << 0 | 1 << 1 | 1 << 2)) << 5;
+            return;
         }
     }
 
-    aliases_[SDLK_SLASH] = SDLK_QUESTION; // the slash is generally below the question mark
-    aliases_[SDLK_PLUS] = SDLK_KP_PLUS;
-    aliases_[SDLK_PERIOD] = SDLK_KP_PERIOD;
-    aliases_[SDLK_MINUS] = SDLK_KP_MINUS;
-    aliases_[SDLK_ASTERISK] = SDLK_KP_MULTIPLY;
-    aliases_[SDLK_DELETE] = SDLK_BACKSPACE;
-    aliases_[SDLK_RETURN] = SDLK_KP_ENTER;
+    g_p2 |= 0xf0;
 }
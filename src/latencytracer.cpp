@@ -0,0 +1,49 @@
+#include "common.h"
+
+#include <algorithm>
+#include <iomanip>
+
+#include "latencytracer.h"
+
+#include "speedlimit.h"
+
+LatencyTracer g_latency_tracer;
+
+void LatencyTracer::mark_scanned()
+{
+    uint64_t now = SpeedLimit::get_nsecs();
+    for (vector<uint64_t>::const_iterator it = pending_.begin(); it != pending_.end(); ++it)
+        scanned_.push_back(make_pair(*it, now));
+    pending_.clear();
+}
+
+void LatencyTracer::frame_presented(uint64_t when)
+{
+    for (vector<pair<uint64_t, uint64_t> >::const_iterator it = scanned_.begin(); it != scanned_.end(); ++it) {
+        input_to_scan_.push_back(it->second - it->first);
+        input_to_present_.push_back(when - it->first);
+    }
+    scanned_.clear();
+}
+
+void LatencyTracer::print_percentiles(ostream &out, vector<uint64_t> samples)
+{
+    sort(samples.begin(), samples.end());
+    out << "p50 " << samples[samples.size() / 2] / 1e6
+        << " ms, p99 " << samples[samples.size() * 99 / 100] / 1e6
+        << " ms, max " << samples.back() / 1e6 << " ms";
+}
+
+void LatencyTracer::debug_print_stats(ostream &out) const
+{
+    if (input_to_present_.empty())
+        return;
+
+    out << "Input latency over " << input_to_present_.size() << " events: to scan ";
+    out << fixed << setprecision(2);
+    print_percentiles(out, input_to_scan_);
+    out << ", to present ";
+    print_percentiles(out, input_to_present_);
+    out << endl;
+    out.unsetf(ios::floatfield);
+}
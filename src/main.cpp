@@ -5,6 +5,7 @@
 #include <stdexcept>
 
 #include "options.h"
+#include "validator.h"
 #include "vmachine.h"
 
 uint8_t g_junk;
@@ -34,5 +35,6 @@ int main(int argc, char **argv)
         return EXIT_FAILURE;
     }
 
-    return EXIT_SUCCESS;
+    // Lets scripts tell which ROMs made the fast and reference paths diverge
+    return g_validator.diverged() ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -1,12 +1,16 @@
 #include "common.h"
 
 #include <SDL_opengl.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include <stdexcept>
 
 #include "opengl_framebuffer.h"
 
+#include "chars.h"
 #include "options.h"
 
 #ifndef GLAPIENTRY
@@ -34,6 +38,41 @@ typedef void (GLAPIENTRY *glBegin_t)(GLenum);
 typedef void (GLAPIENTRY *glEnd_t)();
 typedef void (GLAPIENTRY *glTexCoord2f_t)(GLfloat, GLfloat);
 typedef void (GLAPIENTRY *glVertex2i_t)(GLint, GLint);
+typedef void (GLAPIENTRY *glPixelStorei_t)(GLenum, GLint);
+typedef void (GLAPIENTRY *glActiveTexture_t)(GLenum);
+typedef GLuint (GLAPIENTRY *glCreateShader_t)(GLenum);
+typedef void (GLAPIENTRY *glShaderSource_t)(GLuint, GLsizei, const GLchar **, const GLint *);
+typedef void (GLAPIENTRY *glCompileShader_t)(GLuint);
+typedef void (GLAPIENTRY *glGetShaderiv_t)(GLuint, GLenum, GLint *);
+typedef void (GLAPIENTRY *glGetShaderInfoLog_t)(GLuint, GLsizei, GLsizei *, GLchar *);
+typedef void (GLAPIENTRY *glDeleteShader_t)(GLuint);
+typedef GLuint (GLAPIENTRY *glCreateProgram_t)();
+typedef void (GLAPIENTRY *glAttachShader_t)(GLuint, GLuint);
+typedef void (GLAPIENTRY *glLinkProgram_t)(GLuint);
+typedef void (GLAPIENTRY *glGetProgramiv_t)(GLuint, GLenum, GLint *);
+typedef void (GLAPIENTRY *glUseProgram_t)(GLuint);
+typedef void (GLAPIENTRY *glDeleteProgram_t)(GLuint);
+typedef GLint (GLAPIENTRY *glGetUniformLocation_t)(GLuint, const GLchar *);
+typedef void (GLAPIENTRY *glUniform1i_t)(GLint, GLint);
+typedef void (GLAPIENTRY *glUniform2f_t)(GLint, GLfloat, GLfloat);
+typedef void (GLAPIENTRY *glGenBuffers_t)(GLsizei, GLuint *);
+typedef void (GLAPIENTRY *glDeleteBuffers_t)(GLsizei, const GLuint *);
+typedef void (GLAPIENTRY *glBindBuffer_t)(GLenum, GLuint);
+typedef void (GLAPIENTRY *glBufferData_t)(GLenum, GLsizeiptrARB, const GLvoid *, GLenum);
+typedef GLvoid *(GLAPIENTRY *glMapBuffer_t)(GLenum, GLenum);
+typedef GLboolean (GLAPIENTRY *glUnmapBuffer_t)(GLenum);
+typedef void (GLAPIENTRY *glReadPixels_t)(GLint, GLint, GLsizei, GLsizei, GLenum, GLenum, GLvoid *);
+typedef void (GLAPIENTRY *glBindAttribLocation_t)(GLuint, GLuint, const GLchar *);
+typedef void (GLAPIENTRY *glVertexAttribPointer_t)(GLuint, GLint, GLenum, GLboolean, GLsizei, const GLvoid *);
+typedef void (GLAPIENTRY *glEnableVertexAttribArray_t)(GLuint);
+typedef void (GLAPIENTRY *glDisableVertexAttribArray_t)(GLuint);
+typedef void (GLAPIENTRY *glVertexAttribDivisor_t)(GLuint, GLuint);
+typedef void (GLAPIENTRY *glDrawArraysInstanced_t)(GLenum, GLint, GLsizei, GLsizei);
+typedef void (GLAPIENTRY *glGenFramebuffers_t)(GLsizei, GLuint *);
+typedef void (GLAPIENTRY *glDeleteFramebuffers_t)(GLsizei, const GLuint *);
+typedef void (GLAPIENTRY *glBindFramebuffer_t)(GLenum, GLuint);
+typedef void (GLAPIENTRY *glFramebufferTexture2D_t)(GLenum, GLenum, GLenum, GLuint, GLint);
+typedef GLenum (GLAPIENTRY *glCheckFramebufferStatus_t)(GLenum);
 
 static glGetString_t s_glGetString;
 static glEnable_t s_glEnable;
@@ -55,11 +94,152 @@ static glBegin_t s_glBegin;
 static glEnd_t s_glEnd;
 static glTexCoord2f_t s_glTexCoord2f;
 static glVertex2i_t s_glVertex2i;
+static glPixelStorei_t s_glPixelStorei;
+static glActiveTexture_t s_glActiveTexture;
+static glCreateShader_t s_glCreateShader;
+static glShaderSource_t s_glShaderSource;
+static glCompileShader_t s_glCompileShader;
+static glGetShaderiv_t s_glGetShaderiv;
+static glGetShaderInfoLog_t s_glGetShaderInfoLog;
+static glDeleteShader_t s_glDeleteShader;
+static glCreateProgram_t s_glCreateProgram;
+static glAttachShader_t s_glAttachShader;
+static glLinkProgram_t s_glLinkProgram;
+static glGetProgramiv_t s_glGetProgramiv;
+static glUseProgram_t s_glUseProgram;
+static glDeleteProgram_t s_glDeleteProgram;
+static glGetUniformLocation_t s_glGetUniformLocation;
+static glUniform1i_t s_glUniform1i;
+static glUniform2f_t s_glUniform2f;
+static glGenBuffers_t s_glGenBuffers;
+static glDeleteBuffers_t s_glDeleteBuffers;
+static glBindBuffer_t s_glBindBuffer;
+static glBufferData_t s_glBufferData;
+static glMapBuffer_t s_glMapBuffer;
+static glUnmapBuffer_t s_glUnmapBuffer;
+static glReadPixels_t s_glReadPixels;
+static glBindAttribLocation_t s_glBindAttribLocation;
+static glVertexAttribPointer_t s_glVertexAttribPointer;
+static glEnableVertexAttribArray_t s_glEnableVertexAttribArray;
+static glDisableVertexAttribArray_t s_glDisableVertexAttribArray;
+static glVertexAttribDivisor_t s_glVertexAttribDivisor;
+static glDrawArraysInstanced_t s_glDrawArraysInstanced;
+static glGenFramebuffers_t s_glGenFramebuffers;
+static glDeleteFramebuffers_t s_glDeleteFramebuffers;
+static glBindFramebuffer_t s_glBindFramebuffer;
+static glFramebufferTexture2D_t s_glFramebufferTexture2D;
+static glCheckFramebufferStatus_t s_glCheckFramebufferStatus;
+
+// The frame is uploaded as color indices, which are looked up in a 16x1
+// palette texture. Linear filtering has to be done by hand, as filtering the
+// indices themselves would make no sense.
+static const char *s_vertex_shader =
+    "varying vec2 tex_coord;\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    tex_coord = gl_MultiTexCoord0.xy;\n"
+    "    gl_Position = ftransform();\n"
+    "}\n";
+
+static const char *s_fragment_shader =
+    "uniform sampler2D frame;\n"
+    "uniform sampler2D palette;\n"
+    "uniform vec2 frame_size;\n"
+    "varying vec2 tex_coord;\n"
+    "\n"
+    "vec4 lookup(vec2 coord)\n"
+    "{\n"
+    "    float index = texture2D(frame, coord).r * 255.0;\n"
+    "    return texture2D(palette, vec2((index + 0.5) / 16.0, 0.5));\n"
+    "}\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "#ifdef LINEAR\n"
+    "    vec2 pos = tex_coord * frame_size - 0.5;\n"
+    "    vec2 f = fract(pos);\n"
+    "    vec2 coord = (floor(pos) + 0.5) / frame_size;\n"
+    "    vec2 dx = vec2(1.0 / frame_size.x, 0.0);\n"
+    "    vec2 dy = vec2(0.0, 1.0 / frame_size.y);\n"
+    "    gl_FragColor = mix(mix(lookup(coord), lookup(coord + dx), f.x),\n"
+    "            mix(lookup(coord + dy), lookup(coord + dx + dy), f.x), f.y);\n"
+    "#else\n"
+    "    gl_FragColor = lookup(tex_coord);\n"
+    "#endif\n"
+    "}\n";
+
+// The compositor draws every object as an instance of a unit quad. Solid
+// objects have a negative pattern row, the others look up their bits in the
+// pattern atlas, one texel per bit. The frame ends up in the frame texture as
+// color indices, ready for the palette lookup shader.
+static const char *s_compositor_vertex_shader =
+    "attribute vec2 corner;\n"
+    "attribute vec4 rect;\n"
+    "attribute vec4 clip;\n"
+    "attribute vec4 pattern;\n"
+    "attribute float color;\n"
+    "uniform vec2 screen_size;\n"
+    "varying vec2 local;\n"
+    "varying vec4 object_pattern;\n"
+    "varying float object_color;\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    // Objects are clipped by shrinking their quads\n"
+    "    vec2 pos = clamp(rect.xy + corner * rect.zw, clip.xy, clip.zw);\n"
+    "    local = pos - rect.xy;\n"
+    "    object_pattern = pattern;\n"
+    "    object_color = color;\n"
+    "    gl_Position = vec4(pos / screen_size * 2.0 - 1.0, 0.0, 1.0);\n"
+    "}\n";
+
+static const char *s_compositor_fragment_shader =
+    "uniform sampler2D atlas;\n"
+    "uniform vec2 atlas_size;\n"
+    "varying vec2 local;\n"
+    "varying vec4 object_pattern;\n"
+    "varying float object_color;\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    if (object_pattern.x >= 0.0) {\n"
+    "        vec2 texel = floor(local / object_pattern.yz);\n"
+    "        vec2 coord = (vec2(texel.x, object_pattern.x + texel.y) + 0.5) / atlas_size;\n"
+    "        if (local.x < object_pattern.w || texture2D(atlas, coord).r < 0.5)\n"
+    "            discard;\n"
+    "    }\n"
+    "    gl_FragColor = vec4(object_color / 255.0, 0.0, 0.0, 1.0);\n"
+    "}\n";
 
 OpenGLFramebuffer::~OpenGLFramebuffer()
 {
     SDL_FreeSurface(buffer_);
     s_glDeleteTextures(1, &texture_);
+    if (indexed_) {
+        s_glUseProgram(0);
+        s_glDeleteProgram(program_);
+        s_glDeleteTextures(1, &palette_texture_);
+    }
+    if (pbo_support_)
+        s_glDeleteBuffers(NUM_PBOS, pbos_);
+    if (compositing_) {
+        s_glDeleteProgram(compositor_program_);
+        s_glDeleteTextures(1, &atlas_texture_);
+        s_glDeleteFramebuffers(1, &framebuffer_object_);
+        s_glDeleteBuffers(1, &quad_buffer_);
+        s_glDeleteBuffers(1, &instance_buffer_);
+    }
+
+    debug_print_stats(cout);
+}
+
+void OpenGLFramebuffer::debug_print_stats(ostream &out) const
+{
+    if (frames_composed_)
+        out << "Composed " << objects_composed_ / frames_composed_ << " objects per frame on average" << endl;
+    if (rows_drawn_)
+        out << "Uploaded " << rows_uploaded_ << " of " << rows_drawn_ << " redrawn rows" << endl;
 }
 
 template<typename T> void OpenGLFramebuffer::load_proc(T &var, const char *procname)
@@ -69,11 +249,25 @@ template<typename T> void OpenGLFramebuffer::load_proc(T &var, const char *procn
         throw runtime_error(string("Unable to load ") + procname);
 }
 
+template<typename T> bool OpenGLFramebuffer::try_load_proc(T &var, const char *procname)
+{
+    var = (T)SDL_GL_GetProcAddress(procname);
+    if (!var)
+        var = (T)SDL_GL_GetProcAddress((string(procname) + "ARB").c_str());
+    if (!var)
+        var = (T)SDL_GL_GetProcAddress((string(procname) + "EXT").c_str());
+    return var != NULL;
+}
+
 void OpenGLFramebuffer::init()
 {
     if (SDL_GL_LoadLibrary(NULL))
         throw runtime_error("Unable to load OpenGL library");
 
+    // The GL context belongs to the thread that created it
+    if (g_options.present_thread)
+        LOGWARNING << "Presenting from a separate thread is not supported with OpenGL" << endl;
+
     Uint32 flags = SDL_OPENGL;
     if (g_options.fullscreen)
         flags |= SDL_FULLSCREEN;
@@ -114,8 +308,21 @@ void OpenGLFramebuffer::init()
     load_proc(s_glEnd, "glEnd");
     load_proc(s_glTexCoord2f, "glTexCoord2f");
     load_proc(s_glVertex2i, "glVertex2i");
+    load_proc(s_glPixelStorei, "glPixelStorei");
 
-    {
+    if (g_options.opengl_shaders)
+        indexed_ = init_shaders();
+
+    if (indexed_) {
+        // The shader samples a regular 2D texture
+        arbrect_support_ = false;
+        texture_target_ = GL_TEXTURE_2D;
+        texture_x_ = (float)SCREEN_WIDTH / SCREEN_WIDTH_POWER2;
+        texture_y_ = (float)SCREEN_HEIGHT / SCREEN_HEIGHT_POWER2;
+        texture_width_ = SCREEN_WIDTH_POWER2;
+        texture_height_ = SCREEN_HEIGHT_POWER2;
+    }
+    else {
         const char *extensions = (const char *)s_glGetString(GL_EXTENSIONS);
         if (strstr(extensions, "ARB_texture_rectangle")) {
             cout << "ARB_texture_rectangle extension detected" << endl;
@@ -136,13 +343,32 @@ void OpenGLFramebuffer::init()
         }
     }
 
-    buffer_ = SDL_CreateRGBSurface(SDL_HWSURFACE, texture_width_, texture_height_, 32, 0, 0, 0, 0);
-    if (!buffer_)
-        throw runtime_error(SDL_GetError());
+    if (indexed_) {
+        // All the surfaces share the same palette, so blits don't need any conversion
+        memset(palette_, 0, sizeof(palette_));
+        for (int i = 0; i < COLORTABLE_SIZE; ++i) {
+            palette_[i].r = colortable_[i][0];
+            palette_[i].g = colortable_[i][1];
+            palette_[i].b = colortable_[i][2];
+        }
+
+        buffer_ = create_indexed_surface(texture_width_, texture_height_);
+        for (int i = 0; i < COLORTABLE_SIZE; ++i)
+            colormap_[i] = i;
+        upload_format_ = GL_LUMINANCE;
+    }
+    else {
+        buffer_ = SDL_CreateRGBSurface(SDL_HWSURFACE, texture_width_, texture_height_, 32, 0, 0, 0, 0);
+        if (!buffer_)
+            throw runtime_error(SDL_GetError());
+
+        for (int i = 0; i < COLORTABLE_SIZE; ++i)
+            colormap_[i] = SDL_MapRGB(buffer_->format, colortable_[i][0], colortable_[i][1], colortable_[i][2]);
+        upload_format_ = GL_BGRA;
+    }
+    upload_width_ = min((GLsizei)SCREEN_WIDTH, texture_width_);
+    row_size_ = upload_width_ * buffer_->format->BytesPerPixel;
 
-    for (int i = 0; i < COLORTABLE_SIZE; ++i)
-        colormap_[i] = SDL_MapRGB(buffer_->format, colortable_[i][0], colortable_[i][1], colortable_[i][2]);
- 
     s_glShadeModel(GL_FLAT);
     s_glHint(GL_PERSPECTIVE_CORRECTION_HINT, GL_FASTEST);
     s_glDisable(GL_CULL_FACE);
@@ -159,15 +385,55 @@ void OpenGLFramebuffer::init()
     s_glMatrixMode(GL_MODELVIEW);
     s_glLoadIdentity();
 
+    // Rows of indices aren't necessarily 4-byte aligned
+    s_glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    if (indexed_) {
+        s_glActiveTexture(GL_TEXTURE1);
+        s_glGenTextures(1, &palette_texture_);
+        s_glBindTexture(GL_TEXTURE_2D, palette_texture_);
+        s_glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        s_glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        s_glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, COLORTABLE_SIZE, 1, 0, GL_RGB, GL_UNSIGNED_BYTE, colortable_);
+        s_glActiveTexture(GL_TEXTURE0);
+    }
+
     s_glGenTextures(1, &texture_);
     s_glBindTexture(texture_target_, texture_);
     {
-        GLenum mode = g_options.scaling_mode == Options::SCALING_MODE_NEAREST ? GL_NEAREST : GL_LINEAR;
+        GLenum mode = g_options.scaling_mode == Options::SCALING_MODE_NEAREST || indexed_ ? GL_NEAREST : GL_LINEAR;
         s_glTexParameteri(texture_target_, GL_TEXTURE_MIN_FILTER, mode);
         s_glTexParameteri(texture_target_, GL_TEXTURE_MAG_FILTER, mode);
     }
-    s_glTexImage2D(texture_target_, 0, GL_RGB, texture_width_, texture_height_,
-            0, GL_BGRA, GL_UNSIGNED_BYTE, buffer_->pixels);
+    if (indexed_ && g_options.compositing == Options::COMPOSITING_GPU)
+        compositing_ = init_compositor();
+    else if (g_options.compositing == Options::COMPOSITING_GPU)
+        LOGWARNING << "GPU compositing requires shader support" << endl;
+
+    // The compositor renders to the frame texture, which must be color-renderable
+    s_glTexImage2D(texture_target_, 0, compositing_ ? GL_RGBA8 : indexed_ ? GL_LUMINANCE8 : GL_RGB,
+            texture_width_, texture_height_, 0, upload_format_, GL_UNSIGNED_BYTE, buffer_->pixels);
+    if (compositing_) {
+        s_glBindFramebuffer(GL_FRAMEBUFFER_EXT, framebuffer_object_);
+        s_glFramebufferTexture2D(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, texture_target_, texture_, 0);
+        if (s_glCheckFramebufferStatus(GL_FRAMEBUFFER_EXT) != GL_FRAMEBUFFER_COMPLETE_EXT)
+            throw runtime_error("Unable to render to the frame texture");
+        s_glClear(GL_COLOR_BUFFER_BIT);
+        s_glBindFramebuffer(GL_FRAMEBUFFER_EXT, 0);
+    }
+
+    // Keep a copy of what's in the texture to tell which rows have changed
+    dirty_rows_.resize(SCREEN_HEIGHT);
+    changed_rows_.resize(SCREEN_HEIGHT);
+    texture_copy_.resize(row_size_ * SCREEN_HEIGHT);
+    for (int y = 0; y < SCREEN_HEIGHT; ++y)
+        memcpy(&texture_copy_[y * row_size_], (Uint8 *)buffer_->pixels + y * buffer_->pitch, row_size_);
+
+    // Composed frames are drawn in order, they can't be split in bands
+    if (!compositing_) {
+        init_pbos();
+        create_bands(buffer_, colormap_);
+    }
 
     s_glClear(GL_COLOR_BUFFER_BIT);
     if (g_options.double_buffering) {
@@ -176,16 +442,364 @@ void OpenGLFramebuffer::init()
     }
 }
 
+bool OpenGLFramebuffer::init_shaders()
+{
+    const char *version = (const char *)s_glGetString(GL_VERSION);
+    if (!version || atoi(version) < 2)
+        return false;
+
+    if (!try_load_proc(s_glActiveTexture, "glActiveTexture")
+            || !try_load_proc(s_glCreateShader, "glCreateShader")
+            || !try_load_proc(s_glShaderSource, "glShaderSource")
+            || !try_load_proc(s_glCompileShader, "glCompileShader")
+            || !try_load_proc(s_glGetShaderiv, "glGetShaderiv")
+            || !try_load_proc(s_glGetShaderInfoLog, "glGetShaderInfoLog")
+            || !try_load_proc(s_glDeleteShader, "glDeleteShader")
+            || !try_load_proc(s_glCreateProgram, "glCreateProgram")
+            || !try_load_proc(s_glAttachShader, "glAttachShader")
+            || !try_load_proc(s_glLinkProgram, "glLinkProgram")
+            || !try_load_proc(s_glGetProgramiv, "glGetProgramiv")
+            || !try_load_proc(s_glUseProgram, "glUseProgram")
+            || !try_load_proc(s_glDeleteProgram, "glDeleteProgram")
+            || !try_load_proc(s_glGetUniformLocation, "glGetUniformLocation")
+            || !try_load_proc(s_glUniform1i, "glUniform1i")
+            || !try_load_proc(s_glUniform2f, "glUniform2f")) {
+        LOGWARNING << "Unable to load the shader functions" << endl;
+        return false;
+    }
+
+    const char *prologue = g_options.scaling_mode == Options::SCALING_MODE_LINEAR ? "#define LINEAR\n" : "";
+    GLuint vertex_shader = compile_shader(GL_VERTEX_SHADER, "", s_vertex_shader);
+    GLuint fragment_shader = compile_shader(GL_FRAGMENT_SHADER, prologue, s_fragment_shader);
+    if (!vertex_shader || !fragment_shader) {
+        s_glDeleteShader(vertex_shader);
+        s_glDeleteShader(fragment_shader);
+        return false;
+    }
+
+    program_ = link_program(vertex_shader, fragment_shader, NULL);
+    if (!program_) {
+        LOGWARNING << "Unable to link the palette lookup shader" << endl;
+        return false;
+    }
+
+    s_glUseProgram(program_);
+    s_glUniform1i(s_glGetUniformLocation(program_, "frame"), 0);
+    s_glUniform1i(s_glGetUniformLocation(program_, "palette"), 1);
+    s_glUniform2f(s_glGetUniformLocation(program_, "frame_size"), SCREEN_WIDTH_POWER2, SCREEN_HEIGHT_POWER2);
+
+    cout << "Using shaders for palette lookup" << endl;
+    return true;
+}
+
+GLuint OpenGLFramebuffer::compile_shader(GLenum type, const char *prologue, const char *source)
+{
+    GLuint shader = s_glCreateShader(type);
+    const GLchar *sources[] = {prologue, source};
+    s_glShaderSource(shader, 2, sources, NULL);
+    s_glCompileShader(shader);
+
+    GLint status;
+    s_glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (!status) {
+        char log[1024];
+        s_glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        LOGWARNING << "Unable to compile shader: " << log << endl;
+        s_glDeleteShader(shader);
+        return 0;
+    }
+
+    return shader;
+}
+
+GLuint OpenGLFramebuffer::link_program(GLuint vertex_shader, GLuint fragment_shader, const char **attributes)
+{
+    GLuint program = s_glCreateProgram();
+    s_glAttachShader(program, vertex_shader);
+    s_glAttachShader(program, fragment_shader);
+
+    // Attributes, if any, are bound to consecutive locations
+    for (int i = 0; attributes && attributes[i]; ++i)
+        s_glBindAttribLocation(program, i, attributes[i]);
+
+    s_glLinkProgram(program);
+    s_glDeleteShader(vertex_shader);
+    s_glDeleteShader(fragment_shader);
+
+    GLint status;
+    s_glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (!status) {
+        s_glDeleteProgram(program);
+        return 0;
+    }
+
+    return program;
+}
+
+SDL_Surface *OpenGLFramebuffer::create_indexed_surface(int w, int h)
+{
+    SDL_Surface *surface = SDL_CreateRGBSurface(SDL_SWSURFACE, w, h, 8, 0, 0, 0, 0);
+    if (!surface)
+        throw runtime_error(SDL_GetError());
+    SDL_SetColors(surface, palette_, 0, 256);
+    return surface;
+}
+
+SDL_Surface *OpenGLFramebuffer::create_object_surface(int w, int h)
+{
+    if (!indexed_)
+        return Framebuffer::create_object_surface(w, h);
+
+    SDL_Surface *surface = create_indexed_surface(w, h);
+    SDL_SetColorKey(surface, SDL_SRCCOLORKEY, TRANSPARENT_INDEX);
+    return surface;
+}
+
+void OpenGLFramebuffer::init_pbos()
+{
+    const char *extensions = (const char *)s_glGetString(GL_EXTENSIONS);
+    if (!strstr(extensions, "ARB_pixel_buffer_object"))
+        return;
+
+    if (!try_load_proc(s_glGenBuffers, "glGenBuffers")
+            || !try_load_proc(s_glDeleteBuffers, "glDeleteBuffers")
+            || !try_load_proc(s_glBindBuffer, "glBindBuffer")
+            || !try_load_proc(s_glBufferData, "glBufferData")
+            || !try_load_proc(s_glMapBuffer, "glMapBuffer")
+            || !try_load_proc(s_glUnmapBuffer, "glUnmapBuffer")) {
+        LOGWARNING << "Unable to load the pixel buffer object functions" << endl;
+        return;
+    }
+
+    s_glGenBuffers(NUM_PBOS, pbos_);
+    for (int i = 0; i < NUM_PBOS; ++i) {
+        s_glBindBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, pbos_[i]);
+        s_glBufferData(GL_PIXEL_UNPACK_BUFFER_ARB, texture_copy_.size(), NULL, GL_STREAM_DRAW_ARB);
+    }
+    s_glBindBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+
+    cout << "ARB_pixel_buffer_object extension detected" << endl;
+    pbo_support_ = true;
+}
+
+bool OpenGLFramebuffer::init_compositor()
+{
+    if (!try_load_proc(s_glReadPixels, "glReadPixels")
+            || !try_load_proc(s_glBindAttribLocation, "glBindAttribLocation")
+            || !try_load_proc(s_glVertexAttribPointer, "glVertexAttribPointer")
+            || !try_load_proc(s_glEnableVertexAttribArray, "glEnableVertexAttribArray")
+            || !try_load_proc(s_glDisableVertexAttribArray, "glDisableVertexAttribArray")
+            || !try_load_proc(s_glVertexAttribDivisor, "glVertexAttribDivisor")
+            || !try_load_proc(s_glDrawArraysInstanced, "glDrawArraysInstanced")
+            || !try_load_proc(s_glGenFramebuffers, "glGenFramebuffers")
+            || !try_load_proc(s_glDeleteFramebuffers, "glDeleteFramebuffers")
+            || !try_load_proc(s_glBindFramebuffer, "glBindFramebuffer")
+            || !try_load_proc(s_glFramebufferTexture2D, "glFramebufferTexture2D")
+            || !try_load_proc(s_glCheckFramebufferStatus, "glCheckFramebufferStatus")
+            || !try_load_proc(s_glGenBuffers, "glGenBuffers")
+            || !try_load_proc(s_glDeleteBuffers, "glDeleteBuffers")
+            || !try_load_proc(s_glBindBuffer, "glBindBuffer")
+            || !try_load_proc(s_glBufferData, "glBufferData")) {
+        LOGWARNING << "GPU compositing requires framebuffer objects and instancing" << endl;
+        return false;
+    }
+
+    GLuint vertex_shader = compile_shader(GL_VERTEX_SHADER, "", s_compositor_vertex_shader);
+    GLuint fragment_shader = compile_shader(GL_FRAGMENT_SHADER, "", s_compositor_fragment_shader);
+    if (!vertex_shader || !fragment_shader) {
+        s_glDeleteShader(vertex_shader);
+        s_glDeleteShader(fragment_shader);
+        return false;
+    }
+    static const char *attributes[] = {"corner", "rect", "clip", "pattern", "color", NULL};
+    compositor_program_ = link_program(vertex_shader, fragment_shader, attributes);
+    if (!compositor_program_) {
+        LOGWARNING << "Unable to link the compositor shader" << endl;
+        return false;
+    }
+
+    s_glUseProgram(compositor_program_);
+    s_glUniform1i(s_glGetUniformLocation(compositor_program_, "atlas"), 2);
+    s_glUniform2f(s_glGetUniformLocation(compositor_program_, "atlas_size"), ATLAS_WIDTH, ATLAS_HEIGHT);
+    s_glUniform2f(s_glGetUniformLocation(compositor_program_, "screen_size"), SCREEN_WIDTH, SCREEN_HEIGHT);
+    s_glUseProgram(program_);
+
+    // Build the pattern atlas: chars are drawn highest bit first, sprites lowest bit first
+    vector<Uint8> atlas(ATLAS_WIDTH * ATLAS_HEIGHT);
+    for (int row = 0; row < Chars::NUM_PATTERN_ROWS; ++row) {
+        for (int bit = 0; bit < 8; ++bit)
+            atlas[row * ATLAS_WIDTH + bit] = Chars::charset()[row] & 1 << (7 - bit) ? 0xff : 0;
+    }
+    for (int value = 0; value < 256; ++value) {
+        for (int bit = 0; bit < 8; ++bit)
+            atlas[(PATTERN_SPRITE_START + value) * ATLAS_WIDTH + bit] = value & 1 << bit ? 0xff : 0;
+    }
+
+    s_glActiveTexture(GL_TEXTURE2);
+    s_glGenTextures(1, &atlas_texture_);
+    s_glBindTexture(GL_TEXTURE_2D, atlas_texture_);
+    s_glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    s_glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    s_glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE8, ATLAS_WIDTH, ATLAS_HEIGHT, 0,
+            GL_LUMINANCE, GL_UNSIGNED_BYTE, &atlas[0]);
+    s_glActiveTexture(GL_TEXTURE0);
+
+    // The unit quad every object is an instance of, the rest of the
+    // attributes advance once per instance
+    static const GLfloat quad[] = {0, 0, 1, 0, 0, 1, 1, 1};
+    s_glGenBuffers(1, &quad_buffer_);
+    s_glBindBuffer(GL_ARRAY_BUFFER_ARB, quad_buffer_);
+    s_glBufferData(GL_ARRAY_BUFFER_ARB, sizeof(quad), quad, GL_STATIC_DRAW_ARB);
+    s_glGenBuffers(1, &instance_buffer_);
+    s_glBindBuffer(GL_ARRAY_BUFFER_ARB, 0);
+    for (int i = 1; attributes[i]; ++i)
+        s_glVertexAttribDivisor(i, 1);
+
+    s_glGenFramebuffers(1, &framebuffer_object_);
+
+    cout << "Using GPU compositing" << endl;
+    return true;
+}
+
+void OpenGLFramebuffer::compose_objects()
+{
+    s_glBindFramebuffer(GL_FRAMEBUFFER_EXT, framebuffer_object_);
+    s_glViewport(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+
+    if (!objects_.empty()) {
+        s_glUseProgram(compositor_program_);
+
+        s_glBindBuffer(GL_ARRAY_BUFFER_ARB, quad_buffer_);
+        s_glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+        s_glBindBuffer(GL_ARRAY_BUFFER_ARB, instance_buffer_);
+        s_glBufferData(GL_ARRAY_BUFFER_ARB, objects_.size() * sizeof(ObjectInstance),
+                &objects_[0], GL_STREAM_DRAW_ARB);
+        s_glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(ObjectInstance),
+                (const GLvoid *)offsetof(ObjectInstance, rect));
+        s_glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(ObjectInstance),
+                (const GLvoid *)offsetof(ObjectInstance, clip));
+        s_glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(ObjectInstance),
+                (const GLvoid *)offsetof(ObjectInstance, pattern));
+        s_glVertexAttribPointer(4, 1, GL_FLOAT, GL_FALSE, sizeof(ObjectInstance),
+                (const GLvoid *)offsetof(ObjectInstance, color));
+
+        // Instances are drawn in order, so later segments of the frame
+        // overwrite earlier ones just like they do in software
+        for (int i = 0; i < 5; ++i)
+            s_glEnableVertexAttribArray(i);
+        s_glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, objects_.size());
+        for (int i = 0; i < 5; ++i)
+            s_glDisableVertexAttribArray(i);
+        s_glBindBuffer(GL_ARRAY_BUFFER_ARB, 0);
+
+        s_glUseProgram(program_);
+
+        objects_composed_ += objects_.size();
+        ++frames_composed_;
+        objects_.clear();
+    }
+
+    // Snapshots are taken from the indexed buffer, which isn't drawn to otherwise
+    if (!snapshot_.empty()) {
+        s_glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        s_glPixelStorei(GL_PACK_ROW_LENGTH, buffer_->pitch);
+        s_glReadPixels(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, GL_RED, GL_UNSIGNED_BYTE, buffer_->pixels);
+    }
+
+    s_glBindFramebuffer(GL_FRAMEBUFFER_EXT, 0);
+    s_glViewport(0, 0, g_options.x_res, g_options.y_res);
+}
+
+int OpenGLFramebuffer::find_changed_rows()
+{
+    fill(changed_rows_.begin(), changed_rows_.end(), 0);
+
+    int num_rows = 0;
+    if (!dirty_rows_.empty()) {
+        for (int y = dirty_rows_.first(); y <= dirty_rows_.last(); ++y) {
+            if (!dirty_rows_[y])
+                continue;
+            ++rows_drawn_;
+
+            // Rows are often redrawn with exactly the same contents
+            const Uint8 *row = (const Uint8 *)buffer_->pixels + y * buffer_->pitch;
+            Uint8 *copy = &texture_copy_[y * row_size_];
+            if (memcmp(row, copy, row_size_)) {
+                memcpy(copy, row, row_size_);
+                changed_rows_[y] = 1;
+                ++num_rows;
+            }
+        }
+        dirty_rows_.clear();
+    }
+
+    return num_rows;
+}
+
+void OpenGLFramebuffer::upload_rows(int num_rows)
+{
+    rows_uploaded_ += num_rows;
+
+    // Without PBOs the rows are uploaded straight from our copy of the texture
+    const Uint8 *base = &texture_copy_[0];
+    bool pbo_bound = false;
+    if (pbo_support_) {
+        // Orphan the buffer so that we don't have to wait for the GPU to be
+        // done with it, and alternate between them to overlap transfers
+        s_glBindBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, pbos_[cur_pbo_]);
+        s_glBufferData(GL_PIXEL_UNPACK_BUFFER_ARB, texture_copy_.size(), NULL, GL_STREAM_DRAW_ARB);
+        Uint8 *mapped = (Uint8 *)s_glMapBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, GL_WRITE_ONLY_ARB);
+        if (mapped) {
+            // Rows are placed in the buffer at the same offsets they have in the
+            // texture, so that runs of consecutive rows upload in one go
+            for (int y = 0; y < SCREEN_HEIGHT; ++y) {
+                if (changed_rows_[y])
+                    memcpy(&mapped[y * row_size_], &texture_copy_[y * row_size_], row_size_);
+            }
+            s_glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER_ARB);
+            base = NULL;
+            pbo_bound = true;
+            cur_pbo_ = (cur_pbo_ + 1) % NUM_PBOS;
+        }
+        else {
+            s_glBindBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+        }
+    }
+
+    for (int y = 0; y < SCREEN_HEIGHT;) {
+        if (!changed_rows_[y]) {
+            ++y;
+            continue;
+        }
+
+        int end = y + 1;
+        while (end < SCREEN_HEIGHT && changed_rows_[end])
+            ++end;
+        s_glTexSubImage2D(texture_target_, 0, 0, y, upload_width_, end - y, upload_format_, GL_UNSIGNED_BYTE,
+                base + y * row_size_);
+        y = end;
+    }
+
+    if (pbo_bound)
+        s_glBindBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+}
+
 void OpenGLFramebuffer::blit()
 {
+    if (compositing_) {
+        compose_objects();
+    }
+    else {
+        int num_rows = find_changed_rows();
+        if (num_rows)
+            upload_rows(num_rows);
+    }
+
     if (!snapshot_.empty()) {
         SDL_SaveBMP(buffer_, snapshot_.c_str());
         snapshot_.clear();
     }
 
-    s_glTexSubImage2D(texture_target_, 0, 0, 0, texture_width_, texture_height_,
-            GL_BGRA, GL_UNSIGNED_BYTE, buffer_->pixels);
-
     const GLfloat tex_x = texture_x_;
     const GLfloat tex_y = texture_y_;
     const GLint x_size = window_size_.x;
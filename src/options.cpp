@@ -25,11 +25,13 @@ Options g_options;
 
 Options::Options()
     : pal_emulation(false),
-      speed_limit(100),
-      debug(false), debug_on_ill(true),
-      opengl(true), x_res(640), y_res(480),
+      speed_limit(100), threads(0), input_thread(false), max_frames(0),
+      debug(false), debug_on_ill(true), counters_interval(60), guest_profile(false),
+      validate_interval(0), headless(false), opengl(true), opengl_shaders(true), x_res(640), y_res(480),
       fullscreen(false), double_buffering(true),
-      keep_aspect(true), scaling_mode(SCALING_MODE_NEAREST)
+      keep_aspect(true), scaling_mode(SCALING_MODE_NEAREST),
+      compositing(COMPOSITING_SOFTWARE),
+      present_thread(false), line_cache(false)
 {
     controls[0].enabled = true;
     controls[0].left = SDLK_LEFT;
@@ -103,32 +105,55 @@ void Options::show_usage(const char *progname, ostream &out)
            "Check the LICENSE file in the source distribution root for details\n"
            "\n"
            "Usage:\n"
-           "  " << progname << " [-b <file>] [-c <file>] [-dip] <ROM image>\n"
+           "  " << progname << " [-b <file>] [-c <file>] [-f <count>] [-l <count>] [-dinp] <ROM image>\n"
            "  " << progname << " [-h]\n"
            "  " << progname << " [-V]\n"
            "\n"
            "  The following command line switches are recognized:\n"
            "\n"
 #ifdef HAVE_GETOPT_LONG
-           "    (-V|--version)       Display version information and exit\n"
-           "    (-b|--bios) <file>   Specify what BIOS image file to use\n"
-           "    (-c|--config) <file> Read defaults from config file\n"
-           "    (-d|--debug)         Start in debug mode\n"
-           "    (-i|--invert)        Invert the joystick controls\n"
-           "    (-p|--pal)           Use PAL timing instead of NTSC\n"
-           "    (-h|--help)          Display this usage information and exit\n"
+           "    (-V|--version)          Display version information and exit\n"
+           "    (-b|--bios) <file>      Specify what BIOS image file to use\n"
+           "    (-c|--config) <file>    Read defaults from config file\n"
+           "    (-d|--debug)            Start in debug mode\n"
+           "    (-f|--frames) <count>   Quit after running this many frames\n"
+           "    (-i|--invert)           Invert the joystick controls\n"
+           "    (-l|--lockstep) <count> Check every <count> instructions against the\n"
+           "                            reference execution path\n"
+           "    (-n|--headless)         Run without a window and without a speed limit\n"
+           "    (-p|--pal)              Use PAL timing instead of NTSC\n"
+           "    (-h|--help)             Display this usage information and exit\n"
 #else
-           "    -V        Display version information and exit\n"
-           "    -b <file> Specify what BIOS image file to use\n"
-           "    -c <file> Read defaults from config file\n"
-           "    -d        Start in debug mode\n"
-           "    -i        Invert the joystick controls\n"
-           "    -p        Use PAL timing instead of NTSC\n"
-           "    -h        Display this usage information and exit\n"
+           "    -V         Display version information and exit\n"
+           "    -b <file>  Specify what BIOS image file to use\n"
+           "    -c <file>  Read defaults from config file\n"
+           "    -d         Start in debug mode\n"
+           "    -f <count> Quit after running this many frames\n"
+           "    -i         Invert the joystick controls\n"
+           "    -l <count> Check every <count> instructions against the reference\n"
+           "               execution path\n"
+           "    -n         Run without a window and without a speed limit\n"
+           "    -p         Use PAL timing instead of NTSC\n"
+           "    -h         Display this usage information and exit\n"
 #endif
         << endl;
 }
 
+unsigned int Options::parse_count(const char *arg, const char *what)
+{
+    // Streams take a sign and wrap negative numbers around, so only digits
+    // are allowed
+    istringstream iss(arg);
+    unsigned int count;
+    iss >> count;
+    if (arg[0] < '0' || arg[0] > '9' || iss.fail() || !iss.eof()) {
+        ostringstream oss;
+        oss << "Invalid " << what << " \"" << arg << '"';
+        throw runtime_error(oss.str().c_str());
+    }
+    return count;
+}
+
 inline SDLKey Options::parse_key(IniParser &parser, const string &name, const string &section)
 {
     string keyname;
@@ -149,23 +174,27 @@ bool Options::parse(int argc, char **argv)
 {
     string config_file;
     bool bios_touched = false, debug_touched = false, pal_touched = false;
+    bool frames_touched = false, lockstep_touched = false, headless_touched = false;
     bool swap_controls = false;
 
     int c;
 #ifdef HAVE_GETOPT_LONG
     static option options[] = {
-        { "version", no_argument,       NULL, 'V' },
-        { "bios",    required_argument, NULL, 'b' },
-        { "config",  required_argument, NULL, 'c' },
-        { "debug",   no_argument,       NULL, 'd' },
-        { "invert",  no_argument,       NULL, 'i' },
-        { "help",    no_argument,       NULL, 'h' },
-        { "pal",     no_argument,       NULL, 'p' },
-        { NULL,      no_argument,       NULL,  0  }
+        { "version",  no_argument,       NULL, 'V' },
+        { "bios",     required_argument, NULL, 'b' },
+        { "config",   required_argument, NULL, 'c' },
+        { "debug",    no_argument,       NULL, 'd' },
+        { "frames",   required_argument, NULL, 'f' },
+        { "invert",   no_argument,       NULL, 'i' },
+        { "help",     no_argument,       NULL, 'h' },
+        { "lockstep", required_argument, NULL, 'l' },
+        { "headless", no_argument,       NULL, 'n' },
+        { "pal",      no_argument,       NULL, 'p' },
+        { NULL,       no_argument,       NULL,  0  }
     };
-    while ((c = getopt_long(argc, argv, "b:c:dihpV", options, NULL)) != -1) {
+    while ((c = getopt_long(argc, argv, "b:c:df:ihl:npV", options, NULL)) != -1) {
 #else
-    while ((c = getopt(argc, argv, "b:c:dihpV")) != -1) {
+    while ((c = getopt(argc, argv, "b:c:df:ihl:npV")) != -1) {
 #endif
         switch (c) {
             case 'V':
@@ -183,9 +212,21 @@ bool Options::parse(int argc, char **argv)
                 debug = true;
                 debug_touched = true;
                 break;
+            case 'f':
+                max_frames = parse_count(optarg, "frame count");
+                frames_touched = true;
+                break;
             case 'i':
                 swap_controls = true;
                 break;
+            case 'l':
+                validate_interval = parse_count(optarg, "lockstep interval");
+                lockstep_touched = true;
+                break;
+            case 'n':
+                headless = true;
+                headless_touched = true;
+                break;
             case 'h':
                 show_usage(argv[0], cout);
                 return false;
@@ -222,9 +263,16 @@ bool Options::parse(int argc, char **argv)
         if (!pal_touched)
             parser.get(pal_emulation, "pal_emulation", "system");
         parser.get(speed_limit, "speed_limit", "system");
+        parser.get(threads, "threads", "system");
+        parser.get(input_thread, "input_thread", "system");
+        if (!frames_touched)
+            parser.get(max_frames, "max_frames", "system");
 
         // video
+        if (!headless_touched)
+            parser.get(headless, "headless", "video");
         parser.get(opengl, "opengl", "video");
+        parser.get(opengl_shaders, "opengl_shaders", "video");
         {
             string res;
             parser.get(res, "resolution", "video");
@@ -263,11 +311,35 @@ bool Options::parse(int argc, char **argv)
                     throw runtime_error("Invalid scaling mode");
             }
         }
+        {
+            string mode;
+            parser.get(mode, "compositing", "video");
+            if (!mode.empty()) {
+                if (mode == "software")
+                    compositing = COMPOSITING_SOFTWARE;
+                else if (mode == "gpu")
+                    compositing = COMPOSITING_GPU;
+                else
+                    throw runtime_error("Invalid compositing mode");
+            }
+        }
+        parser.get(present_thread, "present_thread", "video");
+        parser.get(line_cache, "line_cache", "video");
 
         // debugger
         if (!debug_touched)
             parser.get(debug, "debug_mode", "debugger");
         parser.get(debug_on_ill, "debug_on_ill", "debugger");
+        parser.get(counters_output, "counters_output", "debugger");
+        parser.get(counters_interval, "counters_interval", "debugger");
+        parser.get(profiler_trace, "profiler_trace", "debugger");
+        parser.get(guest_profile, "guest_profile", "debugger");
+        parser.get(coverage_output, "coverage_output", "debugger");
+        parser.get(heatmap_csv, "heatmap_csv", "debugger");
+        parser.get(heatmap_image, "heatmap_image", "debugger");
+        parser.get(trace_crash_dump, "trace_crash_dump", "debugger");
+        if (!lockstep_touched)
+            parser.get(validate_interval, "validate_interval", "debugger");
 
         // controls/playerX
         for (int i = 0; i < 2; ++i) {
@@ -291,6 +363,14 @@ bool Options::parse(int argc, char **argv)
         throw runtime_error("BIOS image file not specified");
     }
 
+    // There's nothing to look at, so run as fast as possible. Nobody's there
+    // to type debugger commands either, illegal instructions are only reported
+    if (headless) {
+        opengl = false;
+        speed_limit = 0;
+        debug = debug_on_ill = false;
+    }
+
     if (swap_controls) {
         Joysticks::controls_t temp = controls[0];
         controls[0] = controls[1];
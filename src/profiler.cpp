@@ -0,0 +1,145 @@
+#include "common.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
+#include <stdexcept>
+
+#include "profiler.h"
+
+Profiler g_profiler;
+
+const char *const Profiler::names_[NUM_ZONES] = {
+    "cpu",
+    "vdc",
+    "background",
+    "grid",
+    "chars",
+    "sprites",
+    "bands",
+    "blit",
+    "pacing"
+};
+
+__thread bool Profiler::profiled_thread_ = false;
+
+Profiler::Profiler()
+    : depth_(0), last_(0), frames_(0),
+      start_ticks_(0), start_nsecs_(0), nsecs_per_tick_(1.0),
+      trace_(NULL), trace_events_(0)
+{
+    fill(frame_, frame_ + NUM_ZONES, 0);
+    fill(total_, total_ + NUM_ZONES, 0);
+    fill(max_, max_ + NUM_ZONES, 0);
+}
+
+Profiler::~Profiler()
+{
+    if (trace_) {
+        fputs("\n]\n", trace_);
+        fclose(trace_);
+    }
+}
+
+void Profiler::init(const string &trace)
+{
+#ifdef ENABLE_PROFILER
+    profiled_thread_ = true;
+    start_ticks_ = ticks();
+    start_nsecs_ = SpeedLimit::get_nsecs();
+
+    // Get a first estimate of the tick rate, it's refined on every frame
+    while (SpeedLimit::get_nsecs() < start_nsecs_ + 10000000)
+        ;
+    calibrate();
+
+    if (!trace.empty()) {
+        trace_ = fopen(trace.c_str(), "w");
+        if (!trace_)
+            throw runtime_error(string("Unable to open ") + trace + ": " + strerror(errno));
+        fputs("[", trace_);
+        cout << "Writing a profiler trace to " << trace << endl;
+    }
+#else
+    if (!trace.empty())
+        LOGWARNING << "The profiler wasn't enabled at build time, ignoring profiler_trace" << endl;
+#endif
+}
+
+void Profiler::calibrate()
+{
+    uint64_t ticks_elapsed = ticks() - start_ticks_;
+    if (ticks_elapsed)
+        nsecs_per_tick_ = (double)(SpeedLimit::get_nsecs() - start_nsecs_) / ticks_elapsed;
+}
+
+double Profiler::to_usecs(uint64_t ticks) const
+{
+    return ticks * nsecs_per_tick_ / 1000.0;
+}
+
+void Profiler::begin_trace_event()
+{
+    fputs(trace_events_ ? ",\n" : "\n", trace_);
+    ++trace_events_;
+}
+
+void Profiler::trace_zone(zone_t zone, uint64_t begin, uint64_t end)
+{
+    begin_trace_event();
+    fprintf(trace_, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, \"ts\": %.3f, \"dur\": %.3f}",
+            names_[zone], to_usecs(begin - start_ticks_), to_usecs(end - begin));
+}
+
+void Profiler::end_frame()
+{
+    if (!profiled_thread_)
+        return;
+
+    // Charge the zone we're in, if any, up to the end of the frame
+    uint64_t now = ticks();
+    if (depth_)
+        frame_[stack_[depth_ - 1]] += now - last_;
+    last_ = now;
+
+    calibrate();
+    ++frames_;
+
+    // The time spent in every zone during the frame, in milliseconds
+    if (trace_) {
+        begin_trace_event();
+        fprintf(trace_, "{\"name\": \"zones\", \"ph\": \"C\", \"pid\": 1, \"ts\": %.3f, \"args\": {",
+                to_usecs(now - start_ticks_));
+        for (int i = 0; i < NUM_ZONES; ++i)
+            fprintf(trace_, "%s\"%s\": %.3f", i ? ", " : "", names_[i], to_usecs(frame_[i]) / 1000.0);
+        fputs("}}", trace_);
+    }
+
+    for (int i = 0; i < NUM_ZONES; ++i) {
+        total_[i] += frame_[i];
+        max_[i] = max(max_[i], frame_[i]);
+        frame_[i] = 0;
+    }
+}
+
+void Profiler::debug_print_stats(ostream &out) const
+{
+    if (!frames_)
+        return;
+
+    uint64_t total = 0;
+    for (int i = 0; i < NUM_ZONES; ++i)
+        total += total_[i];
+
+    out << "Host time over " << frames_ << " frames (total, per frame average and maximum):" << endl;
+    out << fixed << setprecision(2);
+    for (int i = 0; i < NUM_ZONES; ++i) {
+        out << "  " << setw(10) << left << names_[i] << right
+            << setw(10) << to_usecs(total_[i]) / 1000.0 << " ms "
+            << setw(8) << to_usecs(total_[i]) / 1000.0 / frames_ << " ms "
+            << setw(8) << to_usecs(max_[i]) / 1000.0 << " ms "
+            << setw(6) << (total ? 100.0 * total_[i] / total : 0.0) << '%' << endl;
+    }
+    out.unsetf(ios::floatfield);
+}
@@ -0,0 +1,97 @@
+#include "common.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <vector>
+
+#include "redrawlog.h"
+
+#include "cpu.h"
+
+RedrawLog g_redraw_log;
+
+namespace {
+    typedef pair<int, uint64_t> work_t;
+
+    bool more_work(const work_t &a, const work_t &b)
+    {
+        return a.second > b.second;
+    }
+
+    void print_pc(ostream &out, int pc)
+    {
+        out << (pc >> 12) << ":0x" << hex << setw(3) << setfill('0') << (pc & 0xfff) << dec;
+    }
+}
+
+void RedrawLog::record(uint8_t offset, uint8_t old_value, uint8_t new_value, int line, int x, int pixels)
+{
+    if (muted_)
+        return;
+
+    record_t &r = ring_[recorded_++ % RING_SIZE];
+    r.frame = frame_;
+    r.pixels = pixels;
+    r.pc = (g_p1 & (1 << 0 | 1 << 1)) << 12 | g_cpu.debug_get_pc();
+    r.line = line;
+    r.x = x;
+    r.offset = offset;
+    r.old_value = old_value;
+    r.new_value = new_value;
+
+    total_t &by_offset = offsets_[offset];
+    ++by_offset.redraws;
+    by_offset.pixels += pixels;
+
+    total_t &by_pc = pcs_[r.pc];
+    ++by_pc.redraws;
+    by_pc.pixels += pixels;
+}
+
+void RedrawLog::debug_dump(ostream &out, int count) const
+{
+    unsigned long first = recorded_ - min(recorded_, (unsigned long)min(count, (int)RING_SIZE));
+    for (unsigned long i = first; i < recorded_; ++i) {
+        const record_t &r = ring_[i % RING_SIZE];
+        out << "frame " << r.frame << " line " << r.line << " x " << r.x << ": ";
+        print_pc(out, r.pc);
+        out << " wrote 0x" << hex << setw(2) << setfill('0') << (int)r.offset
+            << " (0x" << setw(2) << (int)r.old_value << " -> 0x" << setw(2) << (int)r.new_value << ')'
+            << dec << ", redrew " << r.pixels << " pixels\n";
+    }
+    out << setfill(' ');
+    out.flush();
+}
+
+void RedrawLog::print_totals(ostream &out, const char *what, const map<int, total_t> &totals, bool pcs) const
+{
+    vector<work_t> work;
+    for (map<int, total_t>::const_iterator it = totals.begin(); it != totals.end(); ++it)
+        work.push_back(work_t(it->first, it->second.pixels));
+    sort(work.begin(), work.end(), more_work);
+    if (work.size() > (size_t)NUM_SHOWN)
+        work.resize(NUM_SHOWN);
+
+    out << "Redraws by " << what << ", per frame:\n" << fixed << setprecision(2);
+    for (vector<work_t>::const_iterator it = work.begin(); it != work.end(); ++it) {
+        out << "    ";
+        if (pcs)
+            print_pc(out, it->first);
+        else
+            out << "0x" << hex << setw(2) << setfill('0') << it->first << dec;
+        out << setfill(' ') << ": " << (double)totals.find(it->first)->second.redraws / frame_
+            << " redraws, " << (double)it->second / frame_ << " pixels\n";
+    }
+    out.unsetf(ios::floatfield);
+}
+
+void RedrawLog::debug_print_stats(ostream &out) const
+{
+    if (!recorded_ || !frame_)
+        return;
+
+    out << "Mid-frame screen redraws: " << recorded_ << " over " << frame_ << " frames" << endl;
+    print_totals(out, "VDC register", offsets_, false);
+    print_totals(out, "ROM address", pcs_, true);
+    out.flush();
+}
@@ -0,0 +1,200 @@
+#include "common.h"
+
+#include <cstring>
+#include <iostream>
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+# define SCALER_X86
+# include <immintrin.h>
+#endif
+
+#include "scaler.h"
+
+#include "workerpool.h"
+
+static void scale_row_copy(const Uint32 *src, Uint32 *dst, const int *, unsigned int width, int)
+{
+    memcpy(dst, src, width * sizeof(Uint32));
+}
+
+static void scale_row_table(const Uint32 *src, Uint32 *dst, const int *x_table, unsigned int width, int)
+{
+    for (unsigned int x = 0; x < width; ++x)
+        dst[x] = src[x_table[x]];
+}
+
+static void scale_row_integer(const Uint32 *src, Uint32 *dst, const int *, unsigned int width, int factor)
+{
+    for (unsigned int x = 0; x < width; ++src) {
+        for (int i = 0; i < factor && x < width; ++i)
+            dst[x++] = *src;
+    }
+}
+
+#ifdef SCALER_X86
+# ifdef __SSE2__
+static void scale_row_integer_sse2(const Uint32 *src, Uint32 *dst, const int *x_table,
+        unsigned int width, int factor)
+{
+    unsigned int x = 0;
+    if (factor == 2) {
+        for (; x + 8 <= width; x += 8, src += 4) {
+            __m128i px = _mm_loadu_si128((const __m128i *)src);
+            _mm_storeu_si128((__m128i *)&dst[x], _mm_unpacklo_epi32(px, px));
+            _mm_storeu_si128((__m128i *)&dst[x + 4], _mm_unpackhi_epi32(px, px));
+        }
+    }
+    else {
+        // Broadcast every source pixel, the extra lanes get overwritten by the next one
+        unsigned int span = (factor + 3) & ~3;
+        for (; x + span <= width; x += factor, ++src) {
+            __m128i px = _mm_set1_epi32(*src);
+            for (int i = 0; i < factor; i += 4)
+                _mm_storeu_si128((__m128i *)&dst[x + i], px);
+        }
+    }
+    scale_row_integer(src, dst + x, x_table, width - x, factor);
+}
+# endif
+
+__attribute__((target("avx2")))
+static void scale_row_table_avx2(const Uint32 *src, Uint32 *dst, const int *x_table,
+        unsigned int width, int factor)
+{
+    unsigned int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m256i idx = _mm256_loadu_si256((const __m256i *)&x_table[x]);
+        __m256i px = _mm256_i32gather_epi32((const int *)src, idx, 4);
+        _mm256_storeu_si256((__m256i *)&dst[x], px);
+    }
+    scale_row_table(src, dst + x, x_table + x, width - x, factor);
+}
+
+__attribute__((target("avx2")))
+static void scale_row_integer_avx2(const Uint32 *src, Uint32 *dst, const int *x_table,
+        unsigned int width, int factor)
+{
+    unsigned int x = 0;
+    if (factor == 2) {
+        const __m256i pairs = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+        for (; x + 8 <= width; x += 8, src += 4) {
+            __m256i px = _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)src));
+            _mm256_storeu_si256((__m256i *)&dst[x], _mm256_permutevar8x32_epi32(px, pairs));
+        }
+    }
+    else {
+        // Broadcast every source pixel, the extra lanes get overwritten by the next one
+        unsigned int span = (factor + 7) & ~7;
+        for (; x + span <= width; x += factor, ++src) {
+            __m256i px = _mm256_set1_epi32(*src);
+            for (int i = 0; i < factor; i += 8)
+                _mm256_storeu_si256((__m256i *)&dst[x + i], px);
+        }
+    }
+    scale_row_integer(src, dst + x, x_table, width - x, factor);
+}
+#endif
+
+void Scaler::init(unsigned int width, unsigned int height, float x_scale, float y_scale)
+{
+    x_table_.resize(width);
+    for (unsigned int x = 0; x < width; ++x)
+        x_table_[x] = (int)(x / x_scale);
+
+    y_table_.resize(height);
+    for (unsigned int y = 0; y < height; ++y)
+        y_table_[y] = (int)(y / y_scale);
+
+    // Check whether the horizontal scale factor is an integer, in which case
+    // we can replicate pixels instead of looking up every one of them
+    x_factor_ = (int)(x_scale + 0.5f);
+    for (unsigned int x = 0; x_factor_ && x < width; ++x) {
+        if (x_table_[x] != (int)(x / x_factor_))
+            x_factor_ = 0;
+    }
+
+    const char *kernel_name;
+    if (x_factor_ == 1) {
+        row_kernel_ = scale_row_copy;
+        kernel_name = "copy";
+    }
+    else if (x_factor_) {
+        row_kernel_ = scale_row_integer;
+        kernel_name = "integer";
+#ifdef SCALER_X86
+# ifdef __SSE2__
+        row_kernel_ = scale_row_integer_sse2;
+        kernel_name = "integer (SSE2)";
+# endif
+        if (__builtin_cpu_supports("avx2")) {
+            row_kernel_ = scale_row_integer_avx2;
+            kernel_name = "integer (AVX2)";
+        }
+#endif
+    }
+    else {
+        row_kernel_ = scale_row_table;
+        kernel_name = "table";
+#ifdef SCALER_X86
+        if (__builtin_cpu_supports("avx2")) {
+            row_kernel_ = scale_row_table_avx2;
+            kernel_name = "table (AVX2)";
+        }
+#endif
+    }
+    cout << "Using " << kernel_name << " scaler" << endl;
+}
+
+class Scaler::ScaleJob : public WorkerPool::Job
+{
+    private:
+        const Scaler &scaler_;
+        const Uint32 *src_;
+        unsigned int src_pitch_;
+        Uint32 *dst_;
+        unsigned int dst_pitch_;
+        unsigned int y_begin_, y_end_;
+
+    public:
+        ScaleJob(const Scaler &scaler, const Uint32 *src, unsigned int src_pitch,
+                Uint32 *dst, unsigned int dst_pitch, unsigned int y_begin, unsigned int y_end)
+            : scaler_(scaler), src_(src), src_pitch_(src_pitch), dst_(dst), dst_pitch_(dst_pitch),
+              y_begin_(y_begin), y_end_(y_end) {}
+
+        void run_band(int band, int num_bands)
+        {
+            unsigned int rows = y_end_ - y_begin_;
+            scaler_.scale_rows_serial(src_, src_pitch_, dst_, dst_pitch_,
+                    y_begin_ + rows * band / num_bands, y_begin_ + rows * (band + 1) / num_bands);
+        }
+};
+
+void Scaler::scale_rows(const Uint32 *src, unsigned int src_pitch, Uint32 *dst, unsigned int dst_pitch,
+        unsigned int y_begin, unsigned int y_end) const
+{
+    if (y_begin >= y_end)
+        return;
+
+    // Split big outputs into bands, each of them scaled by a different thread
+    if ((y_end - y_begin) * x_table_.size() > PARALLEL_THRESHOLD && g_workers.size() > 1) {
+        ScaleJob job(*this, src, src_pitch, dst, dst_pitch, y_begin, y_end);
+        g_workers.run(job, g_workers.size());
+    }
+    else {
+        scale_rows_serial(src, src_pitch, dst, dst_pitch, y_begin, y_end);
+    }
+}
+
+void Scaler::scale_rows_serial(const Uint32 *src, unsigned int src_pitch, Uint32 *dst, unsigned int dst_pitch,
+        unsigned int y_begin, unsigned int y_end) const
+{
+    unsigned int width = x_table_.size();
+    const int *x_table = &x_table_[0];
+    for (unsigned int y = y_begin; y < y_end; ++y) {
+        Uint32 *dst_row = dst + y * dst_pitch;
+        if (y != y_begin && y_table_[y] == y_table_[y - 1])
+            memcpy(dst_row, dst_row - dst_pitch, width * sizeof(Uint32));
+        else
+            row_kernel_(src + y_table_[y] * src_pitch, dst_row, x_table, width, x_factor_);
+    }
+}
@@ -4,6 +4,47 @@
 
 #include "options.h"
 
+static uint64_t hash_rows(const SDL_Surface *surface, int y_begin, int y_end)
+{
+    // FNV-1a over whole pixels
+    uint64_t hash = 14695981039346656037ULL;
+    for (int y = y_begin; y < y_end; ++y) {
+        const Uint32 *row = (const Uint32 *)((const Uint8 *)surface->pixels + y * surface->pitch);
+        for (int x = 0; x < Framebuffer::SCREEN_WIDTH; ++x)
+            hash = (hash ^ row[x]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+SoftwareFramebuffer::~SoftwareFramebuffer()
+{
+    if (presenter_) {
+        quit_ = true;
+        SDL_SemPost(frame_sem_);
+        SDL_WaitThread(presenter_, NULL);
+        SDL_DestroySemaphore(frame_sem_);
+        SDL_DestroyMutex(snapshot_mutex_);
+
+        cout << "Presentation thread dropped " << frames_dropped_ << " of "
+             << frames_published_ << " frames" << endl;
+    }
+
+    for (int i = 0; i < NUM_BUFFERS; ++i)
+        SDL_FreeSurface(buffers_[i]);
+
+    debug_print_stats(cout);
+}
+
+SDL_Surface *SoftwareFramebuffer::create_buffer()
+{
+    SDL_Surface *buffer = SDL_CreateRGBSurface(SDL_SWSURFACE, SCREEN_WIDTH, SCREEN_HEIGHT, 32, 0, 0, 0, 0);
+    if (!buffer)
+        throw runtime_error(SDL_GetError());
+    else if (buffer->format->BitsPerPixel != 32)
+        throw runtime_error("Unable to create a 32bpp surface");
+    return buffer;
+}
+
 void SoftwareFramebuffer::init()
 {
     Uint32 flags = SDL_SWSURFACE;
@@ -22,51 +63,172 @@ void SoftwareFramebuffer::init()
     else
         cout << " (no double buffering)" << endl;
 
+    // When page flipping, the back page holds what was presented two frames ago
+    num_pages_ = screen_->flags & SDL_DOUBLEBUF ? 2 : 1;
+    for (int i = 0; i < NUM_BUFFERS; ++i) {
+        dirty_rows_[i].resize(SCREEN_HEIGHT);
+        dirty_rows_[i].mark_all();
+    }
+    fill(&page_hashes_[0][0], &page_hashes_[0][0] + 2 * NUM_BANDS, 0);
+
     // Create a buffer to which we'll plot
-    buffer_ = SDL_CreateRGBSurface(SDL_SWSURFACE, SCREEN_WIDTH, SCREEN_HEIGHT, 32, 0, 0, 0, 0);
-    if (!buffer_)
-        throw runtime_error(SDL_GetError());
-    else if (buffer_->format->BitsPerPixel != 32)
-        throw runtime_error("Unable to create a 32bpp surface");
+    buffers_[0] = buffer_ = create_buffer();
 
     // Set up the colormap
     for (int i = 0; i < COLORTABLE_SIZE; ++i)
         colormap_[i] = SDL_MapRGB(buffer_->format, colortable_[i][0], colortable_[i][1], colortable_[i][2]);
+    create_bands(buffer_, colormap_);
+
+    // Generate the scaling tables
+    scaler_.init(window_size_.x_end - window_size_.x, window_size_.y_end - window_size_.y,
+            window_size_.x_scale, window_size_.y_scale);
+
+    if (g_options.present_thread)
+        start_presenter();
+}
+
+void SoftwareFramebuffer::start_presenter()
+{
+    for (int i = 1; i < NUM_BUFFERS; ++i)
+        buffers_[i] = create_buffer();
+    triple_buffer_.reset();
+    buffer_ = buffers_[triple_buffer_.back()];
+
+    frame_sem_ = SDL_CreateSemaphore(0);
+    snapshot_mutex_ = SDL_CreateMutex();
+    if (!frame_sem_ || !snapshot_mutex_)
+        throw runtime_error(SDL_GetError());
+
+    presenter_ = SDL_CreateThread(presenter_main, this);
+    if (!presenter_)
+        throw runtime_error(SDL_GetError());
+    cout << "Presenting frames from a separate thread" << endl;
+}
 
-    // Generate the scaling table
-    unsigned int width = window_size_.x_end - window_size_.x;
-    unsigned int height = window_size_.y_end - window_size_.y;
-    unsigned int buffer_pitch = buffer_->pitch / 4;
-    scaling_table_.resize(width * height);
-    for (unsigned int y = 0; y < height; ++y)
-        for (unsigned int x = 0; x < width; ++x) {
-            scaling_table_[y * width + x]
-                = (int)(y / window_size_.y_scale) * buffer_pitch + (int)(x / window_size_.x_scale);
+int SoftwareFramebuffer::presenter_main(void *data)
+{
+    SoftwareFramebuffer *fb = static_cast<SoftwareFramebuffer *>(data);
+
+    while (true) {
+        SDL_SemWait(fb->frame_sem_);
+        if (fb->quit_)
+            break;
+
+        // We might have been woken up for a frame that we've already picked
+        // up in a previous iteration, in which case there's nothing to do
+        if (fb->triple_buffer_.fetch())
+            fb->present(fb->triple_buffer_.front());
+
+        SDL_mutexP(fb->snapshot_mutex_);
+        if (!fb->snapshot_.empty()) {
+            SDL_SaveBMP(fb->screen_, fb->snapshot_.c_str());
+            fb->snapshot_.clear();
+        }
+        SDL_mutexV(fb->snapshot_mutex_);
     }
+
+    return 0;
 }
 
-void SoftwareFramebuffer::blit()
+void SoftwareFramebuffer::present(int index)
 {
-    Uint32 *src = (Uint32 *)buffer_->pixels;
+    SDL_Surface *frame = buffers_[index];
+    DirtyRows &dirty_rows = dirty_rows_[index];
+    uint64_t *hashes = buffer_hashes_[index];
+
+    // Rehash the bands that were drawn to, the rest of them still hold what
+    // they held the last time this buffer was presented
+    if (!dirty_rows.empty()) {
+        for (int band = dirty_rows.first() / BAND_HEIGHT; band <= dirty_rows.last() / BAND_HEIGHT; ++band) {
+            int y_begin = band * BAND_HEIGHT;
+            int y_end = min(y_begin + BAND_HEIGHT, (int)SCREEN_HEIGHT);
+            for (int y = y_begin; y < y_end; ++y) {
+                if (dirty_rows[y]) {
+                    hashes[band] = hash_rows(frame, y_begin, y_end);
+                    break;
+                }
+            }
+        }
+        dirty_rows.clear();
+    }
+
+    ++frames_presented_;
+    bands_presented_ += NUM_BANDS;
+
+    // Nothing to do if the frame is already being shown
+    const uint64_t *front_hashes = page_hashes_[num_pages_ == 2 ? back_page_ ^ 1 : back_page_];
+    if (equal(hashes, hashes + NUM_BANDS, front_hashes)) {
+        ++frames_skipped_;
+        return;
+    }
+
+    Uint32 *src = (Uint32 *)frame->pixels;
     Uint32 *dst = (Uint32 *)screen_->pixels;
     unsigned int dst_pitch = screen_->pitch / 4;
+    dst += window_size_.y * dst_pitch + window_size_.x;
 
     if (SDL_MUSTLOCK(screen_))
         SDL_LockSurface(screen_);
 
-    unsigned int width = window_size_.x_end - window_size_.x;
-    unsigned int &x_start = window_size_.x;
-    unsigned int &y_start = window_size_.y;
-    for (unsigned int y = window_size_.y; y < window_size_.y_end; ++y) {
-        for (unsigned int x = window_size_.x; x < window_size_.x_end; ++x)
-            dst[y * dst_pitch + x] = src[scaling_table_[(y - y_start) * width + x - x_start]];
+    // Rescale runs of bands that differ from what's on the back page
+    uint64_t *back_hashes = page_hashes_[back_page_];
+    SDL_Rect rects[NUM_BANDS];
+    int num_rects = 0;
+    for (int band = 0; band < NUM_BANDS;) {
+        if (hashes[band] == back_hashes[band]) {
+            ++band;
+            continue;
+        }
+
+        int first = band;
+        for (; band < NUM_BANDS && hashes[band] != back_hashes[band]; ++band)
+            back_hashes[band] = hashes[band];
+        bands_scaled_ += band - first;
+
+        unsigned int y_begin = scaler_.first_row_from(first * BAND_HEIGHT);
+        unsigned int y_end = scaler_.first_row_from(band * BAND_HEIGHT);
+        scaler_.scale_rows(src, frame->pitch / 4, dst, dst_pitch, y_begin, y_end);
+
+        SDL_Rect r = {window_size_.x, window_size_.y + y_begin, scaler_.width(), y_end - y_begin};
+        rects[num_rects++] = r;
     }
 
     if (SDL_MUSTLOCK(screen_))
         SDL_UnlockSurface(screen_);
 
-    if (g_options.double_buffering)
+    if (num_pages_ == 2) {
         SDL_Flip(screen_);
-    else
-        SDL_UpdateRect(screen_, window_size_.x, window_size_.y, window_size_.x_end, window_size_.y_end);
+        back_page_ ^= 1;
+    }
+    else {
+        SDL_UpdateRects(screen_, num_rects, rects);
+    }
+}
+
+void SoftwareFramebuffer::blit()
+{
+    if (!presenter_) {
+        present(0);
+        return;
+    }
+
+    // Hand the frame over and carry on rendering into a free buffer, the
+    // whole screen gets redrawn at the start of the next frame anyway. The
+    // published frame isn't written to until it comes back as the back buffer
+    previous_ = triple_buffer_.back();
+    ++frames_published_;
+    if (triple_buffer_.publish())
+        ++frames_dropped_;
+    buffer_ = buffers_[triple_buffer_.back()];
+    SDL_SemPost(frame_sem_);
+}
+
+void SoftwareFramebuffer::debug_print_stats(ostream &out) const
+{
+    if (!frames_presented_)
+        return;
+
+    out << "Skipped " << frames_skipped_ << " of " << frames_presented_ << " unchanged frames, rescaled "
+        << bands_scaled_ << " of " << bands_presented_ << " bands ("
+        << (100 * bands_scaled_ / bands_presented_) << "%)" << endl;
 }
@@ -0,0 +1,119 @@
+#include "common.h"
+
+#include <algorithm>
+#include <iomanip>
+
+#ifdef HAVE_TIME_H
+# include <time.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+# include <sys/time.h>
+#endif
+
+#include "speedlimit.h"
+
+#include "options.h"
+#include "profiler.h"
+#include "vdc.h"
+
+SpeedLimit::SpeedLimit()
+    : frame_nsecs_(NSECS_PER_SEC / (Vdc::frame_rate(g_options.pal_emulation) * g_options.speed_limit / 100.0)),
+      start_(get_nsecs()), frames_(0), last_frame_end_(start_),
+      histogram_(NUM_BUCKETS + 1), frames_measured_(0), max_frame_nsecs_(0)
+{
+}
+
+SpeedLimit::~SpeedLimit()
+{
+    debug_print_stats(cout);
+}
+
+uint64_t SpeedLimit::get_nsecs()
+{
+#ifdef HAVE_CLOCK_GETTIME
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NSECS_PER_SEC + now.tv_nsec;
+#elif defined(HAVE_GETTIMEOFDAY)
+    timeval now;
+    gettimeofday(&now, 0);
+    return now.tv_sec * NSECS_PER_SEC + now.tv_usec * 1000ULL;
+#else
+    return SDL_GetTicks() * 1000000ULL;
+#endif
+}
+
+void SpeedLimit::sleep_until(uint64_t deadline)
+{
+    PROFILE_ZONE(PACING);
+
+    uint64_t now = get_nsecs();
+    if (now + SPIN_NSECS < deadline) {
+#if defined(HAVE_CLOCK_GETTIME) && defined(HAVE_CLOCK_NANOSLEEP)
+        timespec wakeup;
+        wakeup.tv_sec = (deadline - SPIN_NSECS) / NSECS_PER_SEC;
+        wakeup.tv_nsec = (deadline - SPIN_NSECS) % NSECS_PER_SEC;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeup, NULL))
+            ; // interrupted by a signal
+#else
+        SDL_Delay((deadline - SPIN_NSECS - now) / 1000000);
+#endif
+    }
+
+    while (get_nsecs() < deadline)
+        ;
+}
+
+void SpeedLimit::limit_on_frame_end()
+{
+    ++frames_;
+    uint64_t deadline = start_ + (uint64_t)(frames_ * frame_nsecs_);
+
+    // If we're way behind (e.g. the window was being dragged) start counting
+    // from now instead of running flat out until we catch up
+    uint64_t now = get_nsecs();
+    if (now > deadline + MAX_LAG_NSECS) {
+        start_ = now;
+        frames_ = 0;
+    }
+    else {
+        sleep_until(deadline);
+        now = get_nsecs();
+    }
+
+    measure(now - last_frame_end_);
+    last_frame_end_ = now;
+}
+
+void SpeedLimit::measure(uint64_t frame_nsecs)
+{
+    ++histogram_[min(frame_nsecs / BUCKET_NSECS, (uint64_t)NUM_BUCKETS)];
+    ++frames_measured_;
+    if (frame_nsecs > max_frame_nsecs_)
+        max_frame_nsecs_ = frame_nsecs;
+}
+
+double SpeedLimit::percentile(int percent) const
+{
+    // Upper bound of the bucket holding the percentile, in milliseconds
+    unsigned long target = (frames_measured_ * percent + 99) / 100;
+    unsigned long count = 0;
+    for (int i = 0; i < NUM_BUCKETS; ++i) {
+        count += histogram_[i];
+        if (count >= target)
+            return (i + 1) * BUCKET_NSECS / 1e6;
+    }
+    return max_frame_nsecs_ / 1e6;
+}
+
+void SpeedLimit::debug_print_stats(ostream &out) const
+{
+    if (!frames_measured_)
+        return;
+
+    out << "Frame times over " << frames_measured_ << " frames (target "
+        << fixed << setprecision(2) << frame_nsecs_ / 1e6 << " ms): p50 "
+        << percentile(50) << " ms, p99 " << percentile(99) << " ms, max "
+        << max_frame_nsecs_ / 1e6 << " ms" << endl;
+    out.unsetf(ios::floatfield);
+}
@@ -1,11 +1,14 @@
 #include "common.h"
 
+#include <algorithm>
 #include <stdexcept>
 
 #include "sprites.h"
 
 #include "colors.h"
+#include "counters.h"
 #include "framebuffer.h"
+#include "profiler.h"
 
 // TODO Implement shape caching
 
@@ -14,29 +17,18 @@ Sprites g_sprites;
 void Sprites::init()
 {
     // Create the surface
-    surface_ = SDL_CreateRGBSurface(SDL_HWSURFACE,
-            16 * Framebuffer::SCREEN_WIDTH_MULTIPLIER, 32, 32,
-            TRANSPARENT_RMASK, TRANSPARENT_GMASK, TRANSPARENT_BMASK, TRANSPARENT_AMASK);
-    if (!surface_)
-        throw runtime_error(SDL_GetError());
-    else if (surface_->format->BitsPerPixel != 32)
-        throw runtime_error("Unable to create a 32bpp surface");
+    surface_ = g_framebuffer->create_object_surface(SURFACE_WIDTH, 32);
 
     // Initialize the colormap
     for (int i = 0; i < 8; ++i)
-        colormap_[i] = SDL_MapRGB(surface_->format, colortable[i + COLORTABLE_SPRITE_OFFSET][0],
-                colortable[i + COLORTABLE_SPRITE_OFFSET][1], colortable[i + COLORTABLE_SPRITE_OFFSET][2]);
+        colormap_[i] = g_framebuffer->map_object_color(surface_, i + COLORTABLE_SPRITE_OFFSET);
 }
 
-inline void Sprites::draw_sprite(uint8_t *ptr, uint8_t *shape, SDL_Rect &clip_r)
+inline void Sprites::draw_sprite(Canvas &canvas, uint8_t *ptr, uint8_t *shape, SDL_Rect &clip_r)
 {
     int y = ptr[0];
     int x = ptr[1] % 228 + 4;
 
-    // TODO Optimize using clipping rect
-
-    memset(surface_->pixels, SDL_ALPHA_TRANSPARENT, surface_->pitch * 32);
-
     int control = ptr[2];
 
     static const int shift_table[4][2] = {
@@ -49,9 +41,31 @@ inline void Sprites::draw_sprite(uint8_t *ptr, uint8_t *shape, SDL_Rect &clip_r)
     int shift_even = shift_table[shift_index][0];
     int shift_odd = shift_table[shift_index][1];
 
-    int color = colormap_[(control & (1 << 3 | 1 << 4 | 1 << 5)) >> 3];
+    int color_index = (control & (1 << 3 | 1 << 4 | 1 << 5)) >> 3;
     int multiplier = control & 1 << 2 ? 2 : 1;
 
+    if (canvas.composes_objects()) {
+        // Every row is a pattern, the first column of every sprite being
+        // 1/Framebuffer::SCREEN_WIDTH_MULTIPLIER shorter is the gap
+        for (int i = 0; i < 8; ++i) {
+            if (!shape[i])
+                continue;
+            int shift = i % 2 ? shift_odd : shift_even;
+            SDL_Rect r = {x * Framebuffer::SCREEN_WIDTH_MULTIPLIER + shift, y + i * multiplier * 2,
+                min(8 * multiplier * Framebuffer::SCREEN_WIDTH_MULTIPLIER, SURFACE_WIDTH - shift),
+                multiplier * 2};
+            canvas.draw_pattern(r, Framebuffer::PATTERN_SPRITE_START + shape[i],
+                    multiplier * Framebuffer::SCREEN_WIDTH_MULTIPLIER, multiplier * 2, 1, color_index);
+        }
+        return;
+    }
+
+    // TODO Optimize using clipping rect
+
+    g_framebuffer->clear_object_surface(surface_);
+
+    int color = colormap_[color_index];
+
     for (int i = 0; i < 8; ++i) {
         int shift = i % 2 ? shift_odd : shift_even;
 
@@ -73,17 +87,32 @@ inline void Sprites::draw_sprite(uint8_t *ptr, uint8_t *shape, SDL_Rect &clip_r)
         }
     }
 
-    g_framebuffer->paste_surface(x * Framebuffer::SCREEN_WIDTH_MULTIPLIER, y, surface_);
+    COUNT_SHARED(SURFACES_PASTED, 1);
+    canvas.paste_surface(x * Framebuffer::SCREEN_WIDTH_MULTIPLIER, y, surface_);
 }
 
-void Sprites::draw(uint8_t *mem, SDL_Rect &clip_r)
+void Sprites::draw(Canvas &canvas, uint8_t *mem, SDL_Rect &clip_r, uint32_t objects)
 {
+    PROFILE_ZONE(SPRITES);
+
+    // Composed sprites don't use the shared surface, so they can be drawn
+    // to several canvases at once
+    if (canvas.composes_objects()) {
+        for (int i = 3; i >= 0; --i) {
+            if (objects & 1 << (SLOTS_START + i))
+                draw_sprite(canvas, &mem[SPRITE_CONTROL_START + i * 4], &mem[SPRITE_SHAPE_START + i * 8], clip_r);
+        }
+        return;
+    }
+
     if (SDL_MUSTLOCK(surface_)) {
         if (SDL_LockSurface(surface_))
             throw runtime_error(SDL_GetError());
     }
-    for (int i = 3; i >= 0; --i)
-        draw_sprite(&mem[SPRITE_CONTROL_START + i * 4], &mem[SPRITE_SHAPE_START + i * 8], clip_r);
+    for (int i = 3; i >= 0; --i) {
+        if (objects & 1 << (SLOTS_START + i))
+            draw_sprite(canvas, &mem[SPRITE_CONTROL_START + i * 4], &mem[SPRITE_SHAPE_START + i * 8], clip_r);
+    }
     if (SDL_MUSTLOCK(surface_))
         SDL_UnlockSurface(surface_);
 }
@@ -0,0 +1,50 @@
+#include "common.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "tracering.h"
+
+// Turns the traces saved by the emulator into text, one event per line
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        cerr << "Usage: " << argv[0] << " <trace file>" << endl;
+        return EXIT_FAILURE;
+    }
+
+    FILE *file = fopen(argv[1], "rb");
+    if (!file) {
+        LOGERROR << "Unable to open " << argv[1] << endl;
+        return EXIT_FAILURE;
+    }
+
+    TraceRing::header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+            || memcmp(header.magic, TraceRing::MAGIC, sizeof(TraceRing::MAGIC))) {
+        LOGERROR << argv[1] << " isn't a " PACKAGE_NAME " trace" << endl;
+        fclose(file);
+        return EXIT_FAILURE;
+    }
+    if (header.version != TraceRing::VERSION || header.event_size != sizeof(TraceRing::event_t)) {
+        LOGERROR << argv[1] << " was saved by an incompatible version of " PACKAGE_NAME << endl;
+        fclose(file);
+        return EXIT_FAILURE;
+    }
+
+    TraceRing::event_t event;
+    uint64_t num_events = 0;
+    while (num_events < header.num_events && fread(&event, sizeof(event), 1, file) == 1) {
+        TraceRing::format(cout, event);
+        ++num_events;
+    }
+    fclose(file);
+
+    if (num_events != header.num_events) {
+        LOGWARNING << "The trace is truncated, only " << num_events << " of "
+                   << header.num_events << " events could be read" << endl;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,149 @@
+#include "common.h"
+
+#include <algorithm>
+#include <csignal>
+#include <cstring>
+#include <iomanip>
+#include <stdexcept>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+# include <fcntl.h>
+#endif
+
+#include "tracering.h"
+
+#include "opcodes.h"
+
+TraceRing g_trace_ring;
+
+const char TraceRing::MAGIC[8] = {'T', 'T', 'E', 'A', 'R', 'T', 'R', 'C'};
+
+char TraceRing::crash_path_[1024];
+
+void TraceRing::init(const string &crash_path)
+{
+#ifdef ENABLE_TRACE
+    ring_.resize(RING_SIZE);
+
+    if (!crash_path.empty()) {
+# if defined(HAVE_UNISTD_H) && defined(HAVE_FCNTL_H)
+        if (crash_path.size() >= sizeof(crash_path_))
+            throw runtime_error("Trace crash dump path is too long");
+        strcpy(crash_path_, crash_path.c_str());
+        signal(SIGSEGV, crash_handler);
+        signal(SIGBUS, crash_handler);
+        signal(SIGFPE, crash_handler);
+        signal(SIGABRT, crash_handler);
+        cout << "The trace will be saved to " << crash_path << " if the emulator crashes" << endl;
+# else
+        LOGWARNING << "Saving the trace on crashes isn't supported on this platform" << endl;
+# endif
+    }
+#else
+    if (!crash_path.empty())
+        LOGWARNING << "Tracing wasn't enabled at build time, ignoring trace_crash_dump" << endl;
+#endif
+}
+
+void TraceRing::crash_handler(int sig)
+{
+#if defined(HAVE_UNISTD_H) && defined(HAVE_FCNTL_H)
+    // Only async-signal-safe calls from here on
+    int fd = open(crash_path_, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd != -1) {
+        const TraceRing &ring = g_trace_ring;
+        uint64_t num_events = min(ring.added_, (uint64_t)RING_SIZE);
+        header_t header;
+        memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = VERSION;
+        header.event_size = sizeof(event_t);
+        header.num_events = num_events;
+
+        // Oldest events first, they might wrap around the end of the ring
+        size_t first = (ring.added_ - num_events) & (RING_SIZE - 1);
+        size_t tail = min((uint64_t)(RING_SIZE - first), num_events);
+        if (write(fd, &header, sizeof(header)) == sizeof(header)
+                && write(fd, &ring.ring_[first], tail * sizeof(event_t)) >= 0
+                && write(fd, &ring.ring_[0], (num_events - tail) * sizeof(event_t)) >= 0)
+            fsync(fd);
+        close(fd);
+    }
+#endif
+
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+void TraceRing::write_events(FILE *file) const
+{
+    uint64_t num_events = min(added_, (uint64_t)RING_SIZE);
+    for (uint64_t i = added_ - num_events; i < added_; ++i)
+        fwrite(&ring_[i & (RING_SIZE - 1)], sizeof(event_t), 1, file);
+}
+
+bool TraceRing::save(const string &path) const
+{
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+
+    header_t header;
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.event_size = sizeof(event_t);
+    header.num_events = min(added_, (uint64_t)RING_SIZE);
+    fwrite(&header, sizeof(header), 1, file);
+    write_events(file);
+
+    bool ok = !ferror(file);
+    return fclose(file) == 0 && ok;
+}
+
+void TraceRing::format(ostream &out, const event_t &event)
+{
+    out << dec << setfill(' ') << setw(6) << event.frame << ' '
+        << (event.pc >> 12) << ":0x" << hex << setfill('0') << setw(3) << (event.pc & 0xfff) << ' ';
+
+    switch (event.type) {
+        case EVENT_INSTRUCTION:
+            out << opcode_names[event.arg0 & 0xff] << " (A: 0x" << setw(2) << event.arg1 << ')';
+            break;
+        case EVENT_IRQ:
+            out << "IRQ to 0x" << setw(3) << event.arg0;
+            break;
+        case EVENT_VDC_READ:
+        case EVENT_VDC_WRITE:
+            out << (event.type == EVENT_VDC_READ ? "VDC read 0x" : "VDC write 0x")
+                << setw(2) << (event.arg0 & 0xff) << ": 0x" << setw(2) << (event.arg0 >> 8 & 0xff)
+                << dec << " at line " << (int16_t)(event.arg1 >> 16) << " x " << (event.arg1 & 0xffff);
+            break;
+        case EVENT_REDRAW:
+            out << dec << "Redrew " << event.arg0 << " pixels from line "
+                << (int16_t)(event.arg1 >> 16) << " x " << (event.arg1 & 0xffff);
+            break;
+        case EVENT_VBLANK:
+            out << "Entered VBLANK";
+            break;
+        case EVENT_ILLEGAL:
+            out << "Illegal instruction 0x" << setw(2) << event.arg0;
+            break;
+        case EVENT_BREAKPOINT:
+            out << "Breakpoint reached";
+            break;
+        default:
+            out << "Unknown event " << dec << event.type;
+            break;
+    }
+
+    out << dec << setfill(' ') << '\n';
+}
+
+void TraceRing::debug_dump(ostream &out, int count) const
+{
+    uint64_t num_events = min(added_, (uint64_t)min(count, (int)RING_SIZE));
+    for (uint64_t i = added_ - num_events; i < added_; ++i)
+        format(out, ring_[i & (RING_SIZE - 1)]);
+    out.flush();
+}
@@ -0,0 +1,227 @@
+#include "common.h"
+
+#include <iomanip>
+
+#include "validator.h"
+
+#include "counters.h"
+#include "heatmap.h"
+#include "joysticks.h"
+#include "keyboard.h"
+#include "latencytracer.h"
+#include "opcodes.h"
+#include "redrawlog.h"
+#include "rom.h"
+#include "tracering.h"
+
+Validator g_validator;
+
+#define COMPARE(field) \
+    if (fast.field != reference.field) { \
+        if (out) \
+            *out << #field ": fast 0x" << hex << (uint64_t)fast.field \
+                 << ", reference 0x" << (uint64_t)reference.field << dec << '\n'; \
+        same = false; \
+    }
+
+#define COMPARE_ARRAY(field, size) \
+    for (int i = 0; i < (size); ++i) { \
+        if (fast.field[i] != reference.field[i]) { \
+            if (out) \
+                *out << #field "[0x" << hex << setw(2) << setfill('0') << i << "]: fast 0x" \
+                     << setw(2) << (int)fast.field[i] << ", reference 0x" << setw(2) \
+                     << (int)reference.field[i] << dec << setfill(' ') << '\n'; \
+            same = false; \
+        } \
+    }
+
+void Validator::save(machine_state_t &state)
+{
+    g_cpu.save_state(state.cpu);
+    g_vdc.save_state(state.vdc);
+    g_extstorage.save_state(state.extstorage);
+    state.p1 = g_p1;
+    state.p2 = g_p2;
+    state.t1 = g_t1;
+}
+
+void Validator::load(const machine_state_t &state)
+{
+    g_p1 = state.p1;
+    g_p2 = state.p2;
+    g_t1 = state.t1;
+    g_rom.calculate_current_bank();
+    g_extstorage.calculate_bus_targets();
+
+    g_cpu.load_state(state.cpu);
+    g_vdc.load_state(state.vdc);
+    g_extstorage.load_state(state.extstorage);
+}
+
+void Validator::set_reference(bool enabled)
+{
+    g_cpu.set_reference_timer(enabled);
+    g_extstorage.set_reference_decode(enabled);
+    g_keyboard.set_reference_scan(enabled);
+    g_joysticks.set_reference_scan(enabled);
+}
+
+void Validator::set_replaying(bool replaying)
+{
+    g_counters.set_muted(replaying);
+    g_heatmap.set_muted(replaying);
+    g_latency_tracer.set_muted(replaying);
+    g_trace_ring.set_muted(replaying);
+    g_redraw_log.set_muted(replaying);
+    g_vdc.set_replaying(replaying);
+}
+
+bool Validator::compare(const machine_state_t &fast, const machine_state_t &reference, ostream *out)
+{
+    bool same = true;
+
+    COMPARE(cpu.pc)
+    COMPARE(cpu.last_pc)
+    COMPARE(cpu.a11_on)
+    COMPARE(cpu.acc)
+    COMPARE(cpu.f1)
+    COMPARE(cpu.psw)
+    COMPARE(cpu.tcnt_status)
+    COMPARE(cpu.tcnt_overflow)
+    COMPARE(cpu.tcnt)
+    COMPARE(cpu.prescaler)
+    COMPARE(cpu.cycles)
+    COMPARE(cpu.extirq_en)
+    COMPARE(cpu.tcntirq_en)
+    COMPARE(cpu.extirq_pending)
+    COMPARE(cpu.tcntirq_pending)
+    COMPARE(cpu.in_irq)
+    COMPARE_ARRAY(cpu.intram, (int)sizeof(fast.cpu.intram))
+
+    COMPARE(vdc.cycles)
+    COMPARE(vdc.scanlines)
+    COMPARE(vdc.cur_frame)
+    COMPARE(vdc.entered_vblank)
+    COMPARE(vdc.latched_x)
+    COMPARE(vdc.latched_y)
+    COMPARE_ARRAY(vdc.mem, (int)sizeof(fast.vdc.mem))
+
+    COMPARE_ARRAY(extstorage.extram, (int)sizeof(fast.extstorage.extram))
+
+    COMPARE(p1)
+    COMPARE(p2)
+    COMPARE(t1)
+
+    return same;
+}
+
+template<bool pal>
+inline bool Validator::step(uint64_t index)
+{
+    int bank = g_p1 & (1 << 0 | 1 << 1);
+    int cycles = g_cpu.step();
+    window_[index % WINDOW_SIZE] = bank << 12 | g_cpu.debug_get_pc();
+
+    g_vdc.step<pal>((pal ? 10 : 9) * cycles);
+    return g_vdc.entered_vblank();
+}
+
+template<bool pal>
+bool Validator::run_chunk()
+{
+    save(start_);
+
+    // The fast path sets the length of the chunk, it ends early on VBLANK so
+    // that input is still applied between frames
+    unsigned long count = 0;
+    bool vblank = false;
+    while (count < interval_ && !vblank)
+        vblank = step<pal>(instructions_ + count++);
+    save(fast_);
+
+    set_replaying(true);
+    load(start_);
+    set_reference(true);
+    for (unsigned long i = 0; i < count; ++i)
+        step<pal>(instructions_ + i);
+    set_reference(false);
+    save(reference_);
+
+    if (!compare(fast_, reference_, NULL)) {
+        diverged_ = true;
+        // The chunk may have been cut short, so VBLANK is whatever the
+        // reference path reached where the machine carries on from
+        count = find_divergence<pal>(count, vblank);
+        load(reference_);
+    }
+    set_replaying(false);
+
+    instructions_ += count;
+    ++chunks_;
+    return vblank;
+}
+
+template<bool pal>
+unsigned long Validator::find_divergence(unsigned long count, bool &vblank)
+{
+    machine_state_t chunk_fast = fast_;
+
+    load(start_);
+    for (unsigned long i = 0; i < count; ++i) {
+        save(start_);
+        step<pal>(instructions_ + i);
+        save(fast_);
+
+        load(start_);
+        set_reference(true);
+        vblank = step<pal>(instructions_ + i);
+        set_reference(false);
+        save(reference_);
+
+        if (!compare(fast_, reference_, NULL)) {
+            cout << "The fast and reference paths diverged at instruction " << (instructions_ + i) << endl;
+            print_window(cout, instructions_ + i + 1);
+            compare(fast_, reference_, &cout);
+            cout.flush();
+            return i + 1;
+        }
+    }
+
+    // Every instruction agrees when run on its own, so the difference builds
+    // up across them. Report the whole chunk instead
+    cout << "The fast and reference paths diverged between instructions " << instructions_
+         << " and " << (instructions_ + count) << endl;
+    print_window(cout, instructions_ + count);
+    compare(chunk_fast, reference_, &cout);
+    cout.flush();
+    return count;
+}
+
+void Validator::print_window(ostream &out, uint64_t end) const
+{
+    uint64_t first = end - min(end, (uint64_t)WINDOW_SIZE);
+    out << "Latest instructions:\n";
+    for (uint64_t i = first; i < end; ++i) {
+        int entry = window_[i % WINDOW_SIZE];
+        int bank = entry >> 12, pc = entry & 0xfff;
+        out << dec << setw(12) << setfill(' ') << i << "  " << bank << ":0x" << hex << setw(3)
+            << setfill('0') << pc << "  " << opcode_names[g_rom.at(bank, pc)] << '\n';
+    }
+    out << dec << setfill(' ');
+}
+
+void Validator::debug_print_stats(ostream &out) const
+{
+    if (!chunks_)
+        return;
+
+    out << "Validated " << instructions_ << " instructions in " << chunks_
+        << " chunks against the reference path";
+    if (diverged_)
+        out << ", the paths diverged" << endl;
+    else
+        out << ", no divergence found" << endl;
+}
+
+template bool Validator::run_chunk<false>();
+template bool Validator::run_chunk<true>();
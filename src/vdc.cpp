@@ -6,17 +6,42 @@
 #include "vdc.h"
 
 #include "chars.h"
+#include "counters.h"
 #include "cpu.h"
 #include "framebuffer.h"
+#include "hud.h"
+#include "profiler.h"
+#include "redrawlog.h"
+#include "tracering.h"
+#include "speedlimit.h"
 #include "sprites.h"
+#include "workerpool.h"
 
 Vdc g_vdc;
 
 bool Vdc::entered_vblank_;
 
+static const uint64_t HASH_BASIS = 14695981039346656037ULL;
+
+static inline uint64_t hash_mix(uint64_t hash, uint64_t value)
+{
+    return (hash ^ value) * 1099511628211ULL;
+}
+
+static uint64_t hash_bytes(uint64_t hash, const uint8_t *bytes, int size)
+{
+    for (int i = 0; i < size; ++i)
+        hash = hash_mix(hash, bytes[i]);
+    return hash;
+}
+
 Vdc::Vdc()
     : mem_(MEMORY_SIZE),
-      first_drawing_scanline_(g_options.pal_emulation ? 70 : 21)
+      first_drawing_scanline_(g_options.pal_emulation ? PAL_FIRST_DRAWING_SCANLINE : NTSC_FIRST_DRAWING_SCANLINE),
+      replaying_(false), line_cache_(false),
+      line_hashes_(Framebuffer::SCREEN_HEIGHT), prev_line_hashes_(Framebuffer::SCREEN_HEIGHT),
+      line_valid_(Framebuffer::SCREEN_HEIGHT),
+      line_hits_(0), line_misses_(0)
 {
 }
 
@@ -26,19 +51,109 @@ void Vdc::reset()
     cycles_ = 0;
     scanlines_ = 0;
     cur_frame_ = 0;
+    redraws_ = 0;
+    rebuild_bins();
+
+    // Framebuffers that compose the objects themselves need them every frame
+    line_cache_ = g_options.line_cache && !g_framebuffer->composes_objects();
+    fill(line_valid_.begin(), line_valid_.end(), 0);
+}
+
+void Vdc::save_state(state_t &state) const
+{
+    copy(mem_.begin(), mem_.end(), state.mem);
+    state.cycles = cycles_;
+    state.scanlines = scanlines_;
+    state.cur_frame = cur_frame_;
+    state.entered_vblank = entered_vblank_;
+    state.screen_drawn = screen_drawn_;
+    state.redraws = redraws_;
+    state.latched_x = latched_x_;
+    state.latched_y = latched_y_;
+}
+
+void Vdc::load_state(const state_t &state)
+{
+    copy(state.mem, state.mem + MEMORY_SIZE, mem_.begin());
+    cycles_ = state.cycles;
+    scanlines_ = state.scanlines;
+    cur_frame_ = state.cur_frame;
+    entered_vblank_ = state.entered_vblank;
+    screen_drawn_ = state.screen_drawn;
+    redraws_ = state.redraws;
+    latched_x_ = state.latched_x;
+    latched_y_ = state.latched_y;
+
+    rebuild_bins();
+    fill(line_valid_.begin(), line_valid_.end(), 0);
+}
+
+void Vdc::bin_object(int slot, int y, int h)
+{
+    uint32_t bit = 1 << slot;
+    for (int i = 0; i < NUM_BINS; ++i)
+        bins_[i] &= ~bit;
+
+    int y_end = min(y + h, (int)Framebuffer::SCREEN_HEIGHT);
+    for (int i = y / BIN_HEIGHT; y < y_end && i <= (y_end - 1) / BIN_HEIGHT; ++i)
+        bins_[i] |= bit;
 }
 
-void Vdc::draw_background(SDL_Rect &clip_r)
+void Vdc::update_bins(int offset)
 {
+    // Only the vertical position of the objects and the size of the sprites matter
+    if (offset < CHARS_START) {
+        if (offset % 4 == 0 || offset % 4 == 2) {
+            const uint8_t *control = &mem_[offset & ~3];
+            bin_object(Sprites::SLOTS_START + offset / 4, control[0], control[2] & 1 << 2 ? 32 : 16);
+        }
+    }
+    else if (offset < QUADS_START) {
+        if (offset % 4 == 0)
+            bin_object(Chars::SINGLE_SLOTS_START + (offset - CHARS_START) / 4, mem_[offset], 16);
+    }
+    else if (offset < SPRITE_SHAPE_START) {
+        if (offset % 16 == 0) {
+            int slot = Chars::QUAD_SLOTS_START + (offset - QUADS_START) / 16 * 4;
+            for (int i = 0; i < 4; ++i)
+                bin_object(slot + i, mem_[offset], 16);
+        }
+    }
+}
+
+void Vdc::rebuild_bins()
+{
+    fill(bins_, bins_ + NUM_BINS, 0);
+    for (int offset = 0; offset < SPRITE_SHAPE_START; offset += 2)
+        update_bins(offset);
+}
+
+uint32_t Vdc::objects_in(const SDL_Rect &r) const
+{
+    int first = max((int)r.y, 0) / BIN_HEIGHT;
+    int last = min(r.y + r.h, (int)Framebuffer::SCREEN_HEIGHT) - 1;
+    uint32_t objects = 0;
+    for (int i = first; i <= last / BIN_HEIGHT; ++i)
+        objects |= bins_[i];
+    return objects;
+}
+
+void Vdc::draw_background(Canvas &canvas, SDL_Rect &clip_r)
+{
+    PROFILE_ZONE(BACKGROUND);
+
     int color = (mem_[COLOR_REGISTER] & (1 << 3 | 1 << 4 | 1 << 5)) >> 3;
     if (g_p1 & (1 << 7))
         color += 8; // luminescence bit
 
-    g_framebuffer->fill_rect(clip_r, color);
+    COUNT_SHARED(RECTS_FILLED, 1);
+    canvas.fill_rect(clip_r, color);
 }
 
-void Vdc::draw_grid(SDL_Rect &clip_r)
+void Vdc::draw_grid(Canvas &canvas, SDL_Rect &clip_r)
 {
+    PROFILE_ZONE(GRID);
+
     // TODO Implement shape caching
 
     int color = mem_[COLOR_REGISTER] & (1 << 0 | 1 << 1 | 1 << 2);
@@ -56,7 +171,8 @@ void Vdc::draw_grid(SDL_Rect &clip_r)
                 r.y = j * 24 + 24;
                 r.w = 18 * Framebuffer::SCREEN_WIDTH_MULTIPLIER;
                 r.h = 4;
-                g_framebuffer->fill_rect(r, color);
+                COUNT_SHARED(RECTS_FILLED, 1);
+                canvas.fill_rect(r, color);
             }
         }
     }
@@ -68,7 +184,8 @@ void Vdc::draw_grid(SDL_Rect &clip_r)
             r.y = 9 * 24;
             r.w = 18 * Framebuffer::SCREEN_WIDTH_MULTIPLIER;
             r.h = 4;
-            g_framebuffer->fill_rect(r, color);
+            COUNT_SHARED(RECTS_FILLED, 1);
+            canvas.fill_rect(r, color);
         }
     }
 
@@ -83,13 +200,14 @@ void Vdc::draw_grid(SDL_Rect &clip_r)
                 r.y = j * 24 + 24;
                 r.w = vert_width * Framebuffer::SCREEN_WIDTH_MULTIPLIER;
                 r.h = vert_height;
-                g_framebuffer->fill_rect(r, color);
+                COUNT_SHARED(RECTS_FILLED, 1);
+                canvas.fill_rect(r, color);
             }
         }
     }
 }
 
-inline void Vdc::draw_rect(SDL_Rect &clip_r)
+inline void Vdc::draw_rect(Canvas &canvas, SDL_Rect &clip_r)
 {
 #ifdef DEBUG
     if (clip_r.x != 0 || clip_r.y != 0 || clip_r.w != Framebuffer::SCREEN_WIDTH
@@ -99,109 +217,277 @@ inline void Vdc::draw_rect(SDL_Rect &clip_r)
              << ", " << (clip_r.w / Framebuffer::SCREEN_WIDTH_MULTIPLIER) << ", " << clip_r.h << "}" << endl;
 #endif
 
-    draw_background(clip_r);
+    draw_background(canvas, clip_r);
 
     if (grid_enabled())
-        draw_grid(clip_r);
+        draw_grid(canvas, clip_r);
 
     if (foreground_enabled()) {
-        g_chars.draw(&*mem_.begin(), clip_r);
-        g_sprites.draw(&*mem_.begin(), clip_r);
+        uint32_t objects = objects_in(clip_r);
+        g_chars.draw(canvas, &*mem_.begin(), clip_r, objects);
+        g_sprites.draw(canvas, &*mem_.begin(), clip_r, objects);
     }
 }
 
+void Vdc::hash_lines(vector<uint64_t> &hashes)
+{
+    // What applies to every line: the colors, the control bits that affect
+    // the graphics and the luminescence bit
+    uint64_t hash = HASH_BASIS;
+    hash = hash_mix(hash, mem_[COLOR_REGISTER]);
+    hash = hash_mix(hash, mem_[CONTROL_REGISTER] & ~(1 << 0 | 1 << 1 | 1 << 2));
+    hash = hash_mix(hash, g_p1 & 1 << 7);
+    fill(hashes.begin(), hashes.end(), hash);
+
+    // The grid, one hash for every row of it
+    if (grid_enabled()) {
+        for (int j = 0; j < 9; ++j) {
+            uint64_t row_hash = HASH_BASIS;
+            for (int i = 0; i < 9; ++i)
+                row_hash = hash_mix(row_hash, j < 8 ? mem_[HORIZONTAL_GRID_START + i] & 1 << j
+                        : mem_[HORIZONTAL_GRID9_START + i] & 1 << 0);
+            for (int i = 0; j < 8 && i < 10; ++i)
+                row_hash = hash_mix(row_hash, mem_[VERTICAL_GRID_START + i] & 1 << j);
+
+            int y_end = min(j * 24 + 48, (int)Framebuffer::SCREEN_HEIGHT);
+            for (int y = j * 24 + 24; y < y_end; ++y)
+                hashes[y] = hash_mix(hashes[y], row_hash);
+        }
+    }
+
+    // The objects, in the order they're drawn, on every line they can reach
+    if (foreground_enabled()) {
+        for (int offset = CHARS_START; offset < SPRITE_SHAPE_START; offset += offset < QUADS_START ? 4 : 16) {
+            int size = offset < QUADS_START ? 4 : 16;
+            uint64_t object_hash = hash_bytes(hash_mix(HASH_BASIS, offset), &mem_[offset], size);
+            int y_end = min(mem_[offset] + 16, (int)Framebuffer::SCREEN_HEIGHT);
+            for (int y = mem_[offset]; y < y_end; ++y)
+                hashes[y] = hash_mix(hashes[y], object_hash);
+        }
+        for (int i = 3; i >= 0; --i) {
+            const uint8_t *control = &mem_[SPRITE_CONTROL_START + i * 4];
+            uint64_t object_hash = hash_bytes(hash_mix(HASH_BASIS, i), control, 3);
+            object_hash = hash_bytes(object_hash, &mem_[SPRITE_SHAPE_START + i * 8], 8);
+            int y_end = min(control[0] + (control[2] & 1 << 2 ? 32 : 16), (int)Framebuffer::SCREEN_HEIGHT);
+            for (int y = control[0]; y < y_end; ++y)
+                hashes[y] = hash_mix(hashes[y], object_hash);
+        }
+    }
+}
+
+void Vdc::draw_screen_cached()
+{
+    hash_lines(line_hashes_);
+
+    // Keep runs of lines that haven't changed, draw the rest
+    for (int y = 0; y < Framebuffer::SCREEN_HEIGHT;) {
+        bool hit = line_valid_[y] && line_hashes_[y] == prev_line_hashes_[y];
+        int y_end = y + 1;
+        while (y_end < Framebuffer::SCREEN_HEIGHT
+                && hit == (line_valid_[y_end] && line_hashes_[y_end] == prev_line_hashes_[y_end]))
+            ++y_end;
+
+        if (hit) {
+            g_framebuffer->copy_previous_lines(y, y_end - y);
+            line_hits_ += y_end - y;
+        }
+        else {
+            SDL_Rect r = {0, y, Framebuffer::SCREEN_WIDTH, y_end - y};
+            g_framebuffer->set_clip_rect(r);
+            draw_rect(*g_framebuffer, r);
+            line_misses_ += y_end - y;
+        }
+        y = y_end;
+    }
+    g_framebuffer->clear_clip_rect();
+
+    line_hashes_.swap(prev_line_hashes_);
+    fill(line_valid_.begin(), line_valid_.end(), 1);
+}
+
+class Vdc::DrawJob : public WorkerPool::Job
+{
+    private:
+        Vdc &vdc_;
+
+    public:
+        DrawJob(Vdc &vdc) : vdc_(vdc) {}
+
+        void run_band(int band, int num_bands)
+        {
+            // Every band does its own clipping, the objects outside of it
+            // are discarded by the canvas
+            int y = Framebuffer::SCREEN_HEIGHT * band / num_bands;
+            int y_end = Framebuffer::SCREEN_HEIGHT * (band + 1) / num_bands;
+            SDL_Rect r = {0, y, Framebuffer::SCREEN_WIDTH, y_end - y};
+            Canvas &canvas = g_framebuffer->band(band);
+            canvas.set_clip_rect(r);
+            vdc_.draw_rect(canvas, r);
+        }
+};
+
 inline void Vdc::draw_screen()
 {
-    static SDL_Rect whole_screen = {0, 0, Framebuffer::SCREEN_WIDTH, Framebuffer::SCREEN_HEIGHT};
-    draw_rect(whole_screen);
+    int num_bands;
+    if (line_cache_) {
+        draw_screen_cached();
+    }
+    else if ((num_bands = g_framebuffer->begin_bands())) {
+        PROFILE_ZONE(BANDS);
+        DrawJob job(*this);
+        g_workers.run(job, num_bands);
+    }
+    else {
+        static SDL_Rect whole_screen = {0, 0, Framebuffer::SCREEN_WIDTH, Framebuffer::SCREEN_HEIGHT};
+        draw_rect(*g_framebuffer, whole_screen);
+    }
 
     screen_drawn_ = true;
 }
 
-inline void Vdc::update_screen()
+static inline int visible_area(const SDL_Rect &r)
+{
+    int y_begin = max((int)r.y, 0);
+    int y_end = min(r.y + r.h, (int)Framebuffer::SCREEN_HEIGHT);
+    return y_end > y_begin ? r.w * (y_end - y_begin) : 0;
+}
+
+inline void Vdc::update_screen(uint8_t offset, uint8_t old_value, uint8_t new_value)
 {
     int curline = scanlines_ - first_drawing_scanline_;
+    if (curline >= 0 && curline < Framebuffer::SCREEN_HEIGHT)
+        fill(line_valid_.begin() + curline, line_valid_.end(), 0);
+
+    int pixels = 0;
     if (cycles_ == 0) {
         SDL_Rect r = {0, curline, Framebuffer::SCREEN_WIDTH, Framebuffer::SCREEN_HEIGHT - curline};
+        pixels += visible_area(r);
         g_framebuffer->set_clip_rect(r);
-        draw_rect(r);
+        draw_rect(*g_framebuffer, r);
     }
     else {
         if (scanlines_ + 1 != Framebuffer::SCREEN_HEIGHT) {
             SDL_Rect r = {0, curline + 1, cycles_, Framebuffer::SCREEN_HEIGHT - curline - 1};
+            pixels += visible_area(r);
             g_framebuffer->set_clip_rect(r);
-            draw_rect(r);
+            draw_rect(*g_framebuffer, r);
         }
         SDL_Rect r = {cycles_, curline, Framebuffer::SCREEN_WIDTH - cycles_,
             Framebuffer::SCREEN_HEIGHT - curline};
+        pixels += visible_area(r);
         g_framebuffer->set_clip_rect(r);
-        draw_rect(r);
+        draw_rect(*g_framebuffer, r);
     }
     g_framebuffer->clear_clip_rect();
+
+    COUNT(SCREEN_UPDATES, 1);
+    COUNT(PIXELS_REDRAWN, pixels);
+    ++redraws_;
+    TRACE(REDRAW, pixels, beam_position());
+    g_redraw_log.record(offset, old_value, new_value, curline, cycles_, pixels);
 }
 
-void Vdc::step()
+template<bool pal>
+void Vdc::step(int cycles)
 {
-    int scanlines_end = g_options.pal_emulation ?
-        CYCLES_PER_SCANLINE : CYCLES_PER_SCANLINE - scanlines_ % 2;
-    if (cycles_ >= scanlines_end) {
-        cycles_ -= scanlines_end;
-
-        if (scanlines_ == Framebuffer::SCREEN_HEIGHT + first_drawing_scanline_ + cur_frame_ % 2) {
-#ifdef DEBUG
-            cout << "entered vblank " << endl;
+    PROFILE_ZONE(VDC);
+
+    for (; cycles > 0; --cycles) {
+        int scanlines_end = pal ? CYCLES_PER_SCANLINE : CYCLES_PER_SCANLINE - scanlines_ % 2;
+        if (cycles_ >= scanlines_end) {
+            cycles_ -= scanlines_end;
+
+            if (scanlines_ == Framebuffer::SCREEN_HEIGHT + first_drawing_scanline_ + cur_frame_ % 2) {
+                TRACE(VBLANK, 0, 0);
+
+                // Entered VBLANK
+                entered_vblank_ = true;
+                scanlines_ = 0;
+                ++cur_frame_;
+
+                // Let the running program know
+                mem_[STATUS_REGISTER] |= 1 << 3;
+                g_t1 = true;
+                g_cpu.external_irq();
+
+                if (!replaying_) {
+                    // The overlay is drawn over the lines it covers, so they
+                    // can't be kept for the next frame
+                    if (g_hud.enabled()) {
+                        g_hud.draw(*g_framebuffer, redraws_);
+                        fill(line_valid_.begin(), line_valid_.begin() + Hud::HEIGHT, 0);
+                    }
+
+                    // Do the blitting
+                    PROFILE_ZONE(BLIT);
+#ifdef ENABLE_COUNTERS
+                    uint64_t blit_start = SpeedLimit::get_nsecs();
+                    g_framebuffer->blit();
+                    COUNT(BLIT_NSECS, SpeedLimit::get_nsecs() - blit_start);
+#else
+                    g_framebuffer->blit();
 #endif
-            // Entered VBLANK
-            entered_vblank_ = true;
-            scanlines_ = 0;
-            ++cur_frame_;
-
-            // Let the running program know
-            mem_[STATUS_REGISTER] |= 1 << 3;
-            g_t1 = true;
-            g_cpu.external_irq();
-
-            // Do the blitting, set the screen as not drawn yet
-            g_framebuffer->blit();
-            screen_drawn_ = false;
-        }
+                }
 
-        else if (scanlines_ == first_drawing_scanline_) {
-            // Out of VBLANK
-            g_t1 = false;
+                // Set the screen as not drawn yet
+                redraws_ = 0;
+                screen_drawn_ = false;
+            }
+
+            else if (scanlines_ == first_drawing_scanline_) {
+                // Out of VBLANK
+                g_t1 = false;
+
+                // If we haven't drawn the screen yet, drawn it (will overwrite everything on screen)
+                if (!screen_drawn_)
+                    draw_screen();
+            }
+
+            else if (pal && scanlines_ == 21) {
+                // Clear external IRQ on line 21 for PAL
+                g_cpu.clear_external_irq();
+            }
 
-            // If we haven't drawn the screen yet, drawn it (will overwrite everything on screen)
-            if (!screen_drawn_)
-                draw_screen();
+            ++scanlines_;
         }
 
-        else if (g_options.pal_emulation && scanlines_ == 21) {
-            // Clear external IRQ on line 21 for PAL
-            g_cpu.clear_external_irq();
+        if (cycles_ == HBLANK_START) {
+            // Entered HBLANK, let the running program know
+            mem_[STATUS_REGISTER] &= ~(1 << 0);
+            if (mem_[CONTROL_REGISTER] & 1 << 0)
+                g_cpu.external_irq();
         }
 
-        ++scanlines_;
-    }
+        else if (cycles_ == HBLANK_END) {
+            // Out of HBLANK, let the running program know
+            mem_[STATUS_REGISTER] |= 1 << 0;
+            if (scanlines_ >= first_drawing_scanline_)
+                g_cpu.counter_increment();
+        }
 
-    if (cycles_ == HBLANK_START) {
-        // Entered HBLANK, let the running program know
-        mem_[STATUS_REGISTER] &= ~(1 << 0);
-        if (mem_[CONTROL_REGISTER] & 1 << 0)
-            g_cpu.external_irq();
+        ++cycles_;
     }
+}
 
-    else if (cycles_ == HBLANK_END) {
-        // Out of HBLANK, let the running program know
-        mem_[STATUS_REGISTER] |= 1 << 0;
-        if (scanlines_ >= first_drawing_scanline_)
-            g_cpu.counter_increment();
-    }
+template void Vdc::step<false>(int cycles);
+template void Vdc::step<true>(int cycles);
 
-    ++cycles_;
+double Vdc::frame_rate(bool pal)
+{
+    // The VDC is clocked from the colour subcarrier. NTSC scanlines alternate
+    // between 228 and 227 cycles, and in both standards frames alternate
+    // between two line counts (see step()).
+    double clock = pal ? 3546895.0 : 3579545.0;
+    double cycles_per_line = pal ? CYCLES_PER_SCANLINE : CYCLES_PER_SCANLINE - 0.5;
+    double lines = Framebuffer::SCREEN_HEIGHT + 1.5 +
+        (pal ? PAL_FIRST_DRAWING_SCANLINE : NTSC_FIRST_DRAWING_SCANLINE);
+    return clock / (cycles_per_line * lines);
 }
 
 uint8_t Vdc::read(uint8_t offset)
 {
+    HEAT(VDC, READ, offset);
+
     uint8_t val;
 
     switch (offset)
@@ -213,6 +499,7 @@ uint8_t Vdc::read(uint8_t offset)
             break;
         case COLLISION_REGISTER:
             //return calculate_collisions();
+            TRACE(VDC_READ, offset, beam_position());
             return 0; // TODO
             break;
         case Y_REGISTER:
@@ -222,16 +509,22 @@ uint8_t Vdc::read(uint8_t offset)
             val = mem_[CONTROL_REGISTER] & 1 << 1 ? latched_x_ : (uint8_t)cycles_;
             break;
         default:
+            TRACE(VDC_READ, mem_[offset] << 8 | offset, beam_position());
             return mem_[offset];
             break;
     }
 
+    TRACE(VDC_READ, val << 8 | offset, beam_position());
+
     // Write back so that the right value shows up in the debugger
     return mem_[offset] = val;
 }
 
 void Vdc::write(uint8_t offset, uint8_t value)
 {
+    HEAT(VDC, WRITE, offset);
+    TRACE(VDC_WRITE, value << 8 | offset, beam_position());
+
     // Don't allow writes to those registers when they're set to be displayed
     if (foreground_enabled() && !(offset & 1 << 7))
         return;
@@ -247,6 +540,7 @@ void Vdc::write(uint8_t offset, uint8_t value)
         offset &= ~(1 << 1 | 1 << 2 | 1 << 3);
         for (int i = 0; i < 4; ++i)
             mem_[offset + i * 4] = value;
+        update_bins(offset);
     }
 
     else {
@@ -270,14 +564,7 @@ void Vdc::write(uint8_t offset, uint8_t value)
             // The screen needs to be redrawn if the graphics have been changed
             if (screen_drawn_) {
                 if (diff & ~(1 << 0 | 1 << 1 | 1 << 2)) {
-#ifdef DEBUG
-                    cout << "updating screen because of CONTROL_REGISTER change (diff: 0x"
-                         << setw(2) << setfill('0') << hex << (int)(diff & ~(1 << 0 | 1 << 1 | 1 << 2))
-                         << " value: 0x" << setw(2) << setfill('0') << hex << (int)value
-                         << " scanline: " << dec << scanlines_
-                         << " x: " << (cycles_ / Framebuffer::SCREEN_WIDTH_MULTIPLIER) << ')' << endl;
-#endif
-                    update_screen();
+                    update_screen(offset, value ^ diff, value);
                 }
             }
         }
@@ -286,6 +573,9 @@ void Vdc::write(uint8_t offset, uint8_t value)
             if (!diff)
                 return;
 
+            if (offset < SPRITE_SHAPE_START)
+                update_bins(offset);
+
             if (offset == COLLISION_REGISTER) {
                 // A change to the collision register indicates what collisions
                 // we will check for in the next frame
@@ -296,13 +586,7 @@ void Vdc::write(uint8_t offset, uint8_t value)
                 // The screen needs to be redrawn if foreground objects, the grid
                 // or the color register have been changed
                 if (screen_drawn_ && (!(offset & 1 << 7) || offset == COLOR_REGISTER)) {
-#ifdef DEBUG
-                    cout << "updating screen because of other change (offset: 0x"
-                         << setw(2) << setfill('0') << hex << (int)offset
-                         << " scanline: " << dec << scanlines_
-                         << " x: " << (cycles_ / Framebuffer::SCREEN_WIDTH_MULTIPLIER) << ')' << endl;
-#endif
-                    update_screen();
+                    update_screen(offset, value ^ diff, value);
                 }
             }
         }
@@ -316,3 +600,11 @@ void Vdc::debug_print_timing(ostream &out)
     out << "Scanline: " << dec << scanlines_ << " (0x" << hex << scanlines_
         << ") Beam: " << dec << cycles_ << " (0x" << hex << cycles_ << ')' << endl;
 }
+
+void Vdc::debug_print_stats(ostream &out) const
+{
+    unsigned long lines = line_hits_ + line_misses_;
+    if (lines)
+        out << "Line cache hit " << line_hits_ << " of " << lines << " lines ("
+            << (100 * line_hits_ / lines) << "%)" << endl;
+}
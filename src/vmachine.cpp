@@ -2,40 +2,76 @@
 
 #include <iomanip>
 #include <iostream>
+#include <sstream>
 #include <stdexcept>
 #include <string>
 
 #include "vmachine.h"
 
 #include "chars.h"
+#include "counters.h"
 #include "cpu.h"
+#include "guestprofiler.h"
+#include "heatmap.h"
+#include "hud.h"
 #include "joysticks.h"
 #include "keyboard.h"
+#include "latencytracer.h"
 #include "opengl_framebuffer.h"
 #include "options.h"
+#include "profiler.h"
+#include "redrawlog.h"
 #include "rom.h"
 #include "software_framebuffer.h"
 #include "speedlimit.h"
 #include "sprites.h"
+#include "tracering.h"
+#include "validator.h"
 #include "vdc.h"
+#include "workerpool.h"
 
 void VirtualMachine::init(const char *romfile, const char *biosfile)
 {
     g_rom.load(romfile, biosfile);
 
+    // Events can only be collected from our own input thread if SDL
+    // pumps them from its event thread, which isn't supported everywhere.
+    // SDL_WasInit() doesn't report the event thread, so remember it here
+    bool event_thread = g_options.input_thread;
     {
         const SDL_version *version = SDL_Linked_Version();
         cout << "Initializing SDL version " << (int)version->major
              << '.' << (int)version->minor << '.' << (int)version->patch << endl;
 
-        if (SDL_Init(SDL_INIT_VIDEO) < 0)
+        // Without a window, SDL still needs a video driver for the surfaces
+        // we draw to and for the event queue
+        if (g_options.headless) {
+            static char driver[] = "SDL_VIDEODRIVER=dummy";
+            SDL_putenv(driver);
+        }
+
+        if (event_thread && SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTTHREAD) < 0) {
+            LOGWARNING << "Unable to initialize SDL with an event thread: " << SDL_GetError() << endl;
+            LOGWARNING << "Falling back to collecting input from the emulation thread" << endl;
+            event_thread = false;
+        }
+        if (!event_thread && SDL_Init(SDL_INIT_VIDEO) < 0)
             throw runtime_error(SDL_GetError());
     }
     SDL_ShowCursor(SDL_DISABLE);
     SDL_EnableKeyRepeat(0, 0);
 
-    g_chars.init();
-    g_sprites.init();
+    g_workers.init(g_options.threads);
+    g_counters.init(g_options.counters_output, g_options.counters_interval);
+    g_profiler.init(g_options.profiler_trace);
+    g_heatmap.init(g_options.heatmap_csv, g_options.heatmap_image);
+    g_trace_ring.init(g_options.trace_crash_dump);
+    if (g_options.guest_profile || !g_options.coverage_output.empty())
+        g_guest_profiler.enable();
+    g_validator.init(g_options.validate_interval);
+    if (g_validator.enabled())
+        cout << "Checking every " << g_options.validate_interval
+             << " instructions against the reference path" << endl;
 
     if (g_options.opengl) {
         g_framebuffer = new OpenGLFramebuffer;
@@ -47,6 +83,7 @@ void VirtualMachine::init(const char *romfile, const char *biosfile)
             LOGWARNING << "Falling back to software rendering mode" << endl;
             delete g_framebuffer;
             g_framebuffer = new SoftwareFramebuffer;
+            g_framebuffer->init();
         }
     }
     else {
@@ -54,6 +91,15 @@ void VirtualMachine::init(const char *romfile, const char *biosfile)
         g_framebuffer->init();
     }
     SDL_WM_SetCaption(PACKAGE_NAME " " PACKAGE_VERSION, PACKAGE_NAME);
+
+    // Chars and sprites are created in a format that depends on the framebuffer
+    g_chars.init();
+    g_sprites.init();
+
+    g_joysticks.init();
+    if (event_thread)
+        input_thread_.start();
+
     if (g_options.debug)
         SDL_WM_IconifyWindow();
 
@@ -62,6 +108,17 @@ void VirtualMachine::init(const char *romfile, const char *biosfile)
 
 VirtualMachine::~VirtualMachine()
 {
+    input_thread_.stop();
+
+    g_vdc.debug_print_stats(cout);
+    g_latency_tracer.debug_print_stats(cout);
+    g_profiler.debug_print_stats(cout);
+    g_heatmap.debug_print_stats(cout);
+    g_heatmap.save_image();
+    g_redraw_log.debug_print_stats(cout);
+    g_validator.debug_print_stats(cout);
+    if (!g_options.coverage_output.empty())
+        write_coverage(g_options.coverage_output);
     delete g_framebuffer;
 
     SDL_Quit();
@@ -72,6 +129,7 @@ inline void VirtualMachine::reset()
 {
     g_p1 = g_p2 = 0xff;
     g_rom.calculate_current_bank();
+    g_extstorage.calculate_bus_targets();
 
     g_t1 = true;
 
@@ -79,13 +137,235 @@ inline void VirtualMachine::reset()
     g_vdc.reset();
 }
 
-void VirtualMachine::run()
+template<bool profiling>
+inline int VirtualMachine::step_cpu()
 {
-    cout << "Emulation started" << endl;
+    if (!profiling)
+        return g_cpu.step();
+
+    // The instruction might switch banks, so get the one it's fetched from first
+    int bank = g_p1 & (1 << 0 | 1 << 1);
+    bool in_irq = g_cpu.debug_in_irq();
+    int cycles = g_cpu.step();
+
+    // Only taking an interrupt gets the CPU into one
+    if (!in_irq && g_cpu.debug_in_irq())
+        g_guest_profiler.record_interrupt(bank, g_cpu.debug_get_pc(), g_cpu.debug_get_next_pc(), cycles);
+    else
+        g_guest_profiler.record(bank, g_cpu.debug_get_pc(), cycles);
+    return cycles;
+}
+
+bool VirtualMachine::debug_stop(int bank)
+{
+    int watchpoint = breakpoints_.after_step();
+    int pc = g_cpu.debug_get_pc();
+
+    if (breakpoints_.hit(bank, pc)) {
+        TRACE(BREAKPOINT, 0, 0);
+        cout << "Breakpoint reached" << endl;
+    }
+    else if (watchpoint != -1) {
+        cout << "Watchpoint ";
+        breakpoints_.debug_print_watchpoint(cout, watchpoint);
+        cout << " hit" << endl;
+    }
+    else {
+        uint8_t opcode;
+        switch (run_until_) {
+            case RUN_INSTRUCTIONS:
+                if (--run_count_)
+                    return false;
+                cout << "Finished running" << endl;
+                break;
+            case RUN_UNTIL_SCANLINE:
+                if (g_vdc.debug_get_scanline() != (int)run_count_)
+                    return false;
+                cout << "Reached scanline " << dec << run_count_ << endl;
+                break;
+            case RUN_UNTIL_RETURN:
+                // RET or RETR back to the caller
+                opcode = g_rom.at(bank, pc);
+                if ((opcode != 0x83 && opcode != 0x93) || g_cpu.debug_get_sp() != (int)run_count_)
+                    return false;
+                cout << "Returned from the routine" << endl;
+                break;
+            default:
+                return false;
+        }
+    }
+
+    debug_break();
+    return true;
+}
+
+void VirtualMachine::debug_break()
+{
+    run_until_ = RUN_FREELY;
+    g_trace_ring.debug_dump(cout, NUM_TRACE_EVENTS_SHOWN);
+    g_cpu.debug_print(cout);
+    g_options.debug = true;
+}
+
+template<bool pal, bool debugging, bool profiling>
+bool VirtualMachine::run_frame()
+{
+    PROFILE_ZONE(CPU);
+
+    // The VDC runs 10 cycles per CPU cycle on PAL machines, 9 on NTSC ones
+    const int time_units = pal ? 10 : 9;
+
+    while (!g_vdc.entered_vblank()) {
+        int bank = 0;
+        if (debugging) {
+            bank = g_p1 & (1 << 0 | 1 << 1);
+            breakpoints_.before_step();
+        }
+
+        g_vdc.step<pal>(time_units * step_cpu<profiling>());
+
+        if (debugging && debug_stop(bank))
+            return false;
+    }
+
+    if (debugging && run_until_ == RUN_UNTIL_VBLANK) {
+        cout << "Entered VBLANK" << endl;
+        debug_break();
+    }
+    return true;
+}
+
+template<bool pal>
+bool VirtualMachine::run_frame_validated()
+{
+    PROFILE_ZONE(CPU);
+
+    bool vblank;
+    do {
+        vblank = g_validator.run_chunk<pal>();
+    } while (!vblank && !g_validator.diverged());
+
+    if (g_validator.diverged() && !g_options.headless)
+        debug_break();
+    return vblank;
+}
+
+template<bool pal>
+void VirtualMachine::step_instruction()
+{
+    int cycles = g_guest_profiler.enabled() ? step_cpu<true>() : step_cpu<false>();
+    g_vdc.step<pal>((pal ? 10 : 9) * cycles);
+}
+
+void VirtualMachine::select_run_frame()
+{
+    // Indexed by TV standard, debugging and profiling. Without breakpoints,
+    // watchpoints, a run command or the guest profiler the loop doesn't pay
+    // for checking them
+    static const run_frame_t variants[2][2][2] = {
+        {
+            { &VirtualMachine::run_frame<false, false, false>, &VirtualMachine::run_frame<false, false, true> },
+            { &VirtualMachine::run_frame<false, true, false>, &VirtualMachine::run_frame<false, true, true> }
+        },
+        {
+            { &VirtualMachine::run_frame<true, false, false>, &VirtualMachine::run_frame<true, false, true> },
+            { &VirtualMachine::run_frame<true, true, false>, &VirtualMachine::run_frame<true, true, true> }
+        }
+    };
+    bool debugging = !breakpoints_.empty() || run_until_ != RUN_FREELY;
+
+    // Breakpoints, run commands and the guest profiler are left out while
+    // validating, the validator runs every instruction itself
+    if (g_validator.enabled() && !debugging) {
+        if (g_options.pal_emulation)
+            run_frame_ = &VirtualMachine::run_frame_validated<true>;
+        else
+            run_frame_ = &VirtualMachine::run_frame_validated<false>;
+        return;
+    }
+
+    run_frame_ = variants[g_options.pal_emulation][debugging][g_guest_profiler.enabled()];
+}
+
+void VirtualMachine::write_coverage(const string &path)
+{
+    if (g_guest_profiler.write_coverage(path))
+        cout << "Wrote guest code coverage to " << path << endl;
+    else
+        LOGWARNING << "Unable to write guest code coverage to " << path << endl;
+}
 
-    const int time_units = g_options.pal_emulation ? 10 : 9;
+bool VirtualMachine::drop_stale_input()
+{
+    // Whatever was typed into the window while at the prompt is stale by
+    // now. Only key releases are kept, so that no key is left pressed, and
+    // so are requests to quit, which are reported by returning false
+    SDL_Event event;
+    uint64_t when;
+    while (input_thread_.running() ? input_thread_.pop(event, when) : SDL_PollEvent(&event)) {
+        if (event.type == SDL_QUIT)
+            return false;
+        if (event.type == SDL_KEYUP) {
+            if (event.key.keysym.sym == SDLK_ESCAPE)
+                return false;
+            g_joysticks.handle_key_up(event.key.keysym);
+            g_keyboard.handle_key_up(event.key.keysym);
+        }
+    }
+    return true;
+}
 
-    int breakpoint = -1;
+bool VirtualMachine::handle_event(const SDL_Event &event, uint64_t when)
+{
+    switch (event.type) {
+        case SDL_QUIT:
+            return false;
+            break;
+        case SDL_KEYDOWN:
+            if ((!(event.key.keysym.mod & KMOD_CAPS) && g_joysticks.handle_key_down(event.key.keysym))
+                    || g_keyboard.handle_key_down(event.key.keysym))
+                g_latency_tracer.input(when);
+            break;
+        case SDL_KEYUP:
+            switch (event.key.keysym.sym) {
+                case SDLK_ESCAPE:
+                    return false;
+                    break;
+                case SDLK_F1:
+                    if (paused_)
+                        cout << "Returning to emulation" << endl;
+                    else
+                        cout << "-- PAUSED (press F1 to return to emulation) --" << endl;
+                    paused_ = !paused_;
+                    break;
+                case SDLK_F2:
+                    g_hud.toggle();
+                    break;
+                case SDLK_F4:
+                    g_options.debug = true;
+                    break;
+                case SDLK_F5:
+                    reset();
+                    cout << "Reset the virtual machine" << endl;
+                    break;
+                case SDLK_PRINT:
+                    g_framebuffer->take_snapshot();
+                    break;
+                default:
+                    if ((!(event.key.keysym.mod & KMOD_CAPS) && g_joysticks.handle_key_up(event.key.keysym))
+                            || g_keyboard.handle_key_up(event.key.keysym))
+                        g_latency_tracer.input(when);
+                    break;
+            }
+            break;
+    }
+
+    return true;
+}
+
+void VirtualMachine::run()
+{
+    cout << "Emulation started" << endl;
 
     while (true) {
         if (g_options.debug) {
@@ -95,40 +375,87 @@ void VirtualMachine::run()
             cin >> command;
 
             if (command == "b" || command == "breakpoint") {
-                int addr;
-                cin >> hex >> addr;
-                if (cin.fail()) {
+                string addr;
+                int bank, pc;
+                cin >> addr;
+                if (!Breakpoints::parse_rom_address(addr, bank, pc)) {
                     cout << "Invalid address" << endl;
                 }
                 else {
-                    breakpoint = addr;
-                    cout << "Breakpoint set at 0x" << hex << setw(2) << setfill('0') << addr << endl;
+                    breakpoints_.set(bank, pc);
+                    cout << "Breakpoint set at " << addr << endl;
                 }
             }
             else if (command == "c" || command == "continue") {
+                run_until_ = RUN_FREELY;
                 g_options.debug = false;
             }
+            else if (command == "coverage") {
+                string path;
+                cin >> path;
+                if (!g_guest_profiler.enabled())
+                    cout << "The guest profiler is disabled, use \"profile\" to enable it" << endl;
+                else
+                    write_coverage(path);
+            }
+            else if (command == "d" || command == "delete") {
+                string addr;
+                int bank, pc;
+                cin >> addr;
+                if (!Breakpoints::parse_rom_address(addr, bank, pc))
+                    cout << "Invalid address" << endl;
+                else if (!breakpoints_.clear(bank, pc))
+                    cout << "No breakpoint at " << addr << endl;
+                else
+                    cout << "Breakpoint at " << addr << " deleted" << endl;
+            }
             else if (command == "e" || command == "extram") {
                 g_extstorage.debug_dump_extram(cout);
             }
             else if (command == "?" || command == "h" || command == "help") {
                 cout << "The following commands are recognized:\n" \
+                        "b/breakpoint Break at a ROM address, given as addr or bank:addr\n" \
                         "c/continue Return to emulation\n" \
+                        "coverage   Write the code executed in every ROM bank to a file\n" \
+                        "d/delete   Delete the breakpoint at a ROM address\n" \
                         "i/intram   Dump the contents of the internal RAM\n" \
+                        "l/list     List the breakpoints and watchpoints\n" \
                         "p/print    Print the contents of some CPU structures\n" \
+                        "profile    Start profiling the guest code or show its hottest routines\n" \
                         "q/quit     Quit " PACKAGE_NAME "\n" \
                         "r/reset    Reset the virtual machine\n" \
+                        "redraws    Show the latest screen redraws caused by VDC writes\n" \
+                        "return     Run until the current routine returns\n" \
+                        "run        Run the given number of instructions\n" \
                         "s/step     Execute a single CPU step\n" \
+                        "scanline   Run until the VDC reaches the given scanline\n" \
+                        "stats      Show rendering, input and memory access statistics\n" \
                         "t/timing   Show timing information\n" \
-                        "v/vdc      Dump the contents of the VDC memory\n";
+                        "trace      Save the latest trace events to a file\n" \
+                        "unwatch    Delete a watchpoint given its number\n" \
+                        "v/vdc      Dump the contents of the VDC memory\n" \
+                        "vblank     Run until the VDC enters VBLANK\n" \
+                        "w/watch    Break on accesses: watch intram|extram|vdc addr [r|w|rw] [value]\n";
                 cout.flush();
             }
             else if (command == "i" || command == "intram") {
                 g_cpu.debug_dump_intram(cout);
             }
+            else if (command == "l" || command == "list") {
+                breakpoints_.debug_print(cout);
+            }
             else if (command == "p" || command == "print") {
                 g_cpu.debug_print(cout);
             }
+            else if (command == "profile") {
+                if (g_guest_profiler.enabled()) {
+                    g_guest_profiler.debug_print_report(cout);
+                }
+                else {
+                    g_guest_profiler.enable();
+                    cout << "Profiling the guest code, continue emulation to collect samples" << endl;
+                }
+            }
             else if (command == "q" || command == "quit" || cin.eof()) {
                 if (cin.eof())
                     cout << endl;
@@ -138,93 +465,167 @@ void VirtualMachine::run()
                 reset();
                 cout << "Reset the virtual machine" << endl;
             }
+            else if (command == "redraws") {
+                g_redraw_log.debug_dump(cout, NUM_REDRAWS_SHOWN);
+            }
+            else if (command == "return") {
+                run_until_ = RUN_UNTIL_RETURN;
+                run_count_ = g_cpu.debug_get_caller_sp();
+                g_options.debug = false;
+            }
+            else if (command == "run" || command == "scanline") {
+                unsigned long count;
+                cin >> dec >> count;
+                if (cin.fail() || (command == "run" && !count)) {
+                    cin.clear();
+                    cout << "Invalid count" << endl;
+                }
+                else {
+                    run_until_ = command == "run" ? RUN_INSTRUCTIONS : RUN_UNTIL_SCANLINE;
+                    run_count_ = count;
+                    g_options.debug = false;
+                }
+            }
             else if (command == "s" || command == "step") {
-                const int ticks = g_cpu.step();
-                for (int i = 0; i < time_units * ticks; ++i)
-                    g_vdc.step();
+                if (g_options.pal_emulation)
+                    step_instruction<true>();
+                else
+                    step_instruction<false>();
 
                 g_cpu.debug_print(cout);
             }
+            else if (command == "stats") {
+                g_vdc.debug_print_stats(cout);
+                g_framebuffer->debug_print_stats(cout);
+                g_latency_tracer.debug_print_stats(cout);
+                g_profiler.debug_print_stats(cout);
+                g_heatmap.debug_print_stats(cout);
+                g_redraw_log.debug_print_stats(cout);
+                g_validator.debug_print_stats(cout);
+            }
+            else if (command == "trace") {
+                string path;
+                cin >> path;
+                if (!g_trace_ring.enabled())
+                    cout << "Tracing wasn't enabled at build time" << endl;
+                else if (g_trace_ring.save(path))
+                    cout << "Saved the trace to " << path << endl;
+                else
+                    LOGWARNING << "Unable to save the trace to " << path << endl;
+            }
             else if (command == "t" || command == "timing") {
                 g_vdc.debug_print_timing(cout);
             }
+            else if (command == "unwatch") {
+                unsigned int index;
+                cin >> dec >> index;
+                if (cin.fail()) {
+                    cin.clear();
+                    cout << "Invalid watchpoint" << endl;
+                }
+                else if (!breakpoints_.unwatch(index)) {
+                    cout << "No watchpoint " << index << endl;
+                }
+                else {
+                    cout << "Watchpoint " << index << " deleted" << endl;
+                }
+            }
             else if (command == "v" || command == "vdc") {
                 g_vdc.debug_dump(cout);
             }
+            else if (command == "vblank") {
+                run_until_ = RUN_UNTIL_VBLANK;
+                g_options.debug = false;
+            }
+            else if (command == "w" || command == "watch") {
+                // w <area> <address> [r|w|rw] [value]
+                string line, area, access;
+                getline(cin, line);
+                istringstream args(line);
+                Breakpoints::watchpoint_t watchpoint;
+                args >> area >> hex >> watchpoint.address;
+                if (!Breakpoints::parse_area(area, watchpoint.area) || args.fail()
+                        || watchpoint.address < 0 || watchpoint.address > 0xff) {
+                    cout << "Invalid address" << endl;
+                    continue;
+                }
+
+                if (!(args >> access))
+                    access = "rw";
+                watchpoint.read = access.find('r') != string::npos;
+                watchpoint.write = access.find('w') != string::npos;
+                if (args >> hex >> watchpoint.value)
+                    watchpoint.value &= 0xff;
+                else
+                    watchpoint.value = -1;
+
+                if (!watchpoint.read && !watchpoint.write) {
+                    cout << "Invalid access, use r, w or rw" << endl;
+                }
+                else {
+                    breakpoints_.watch(watchpoint);
+                    cout << "Watchpoint set" << endl;
+                }
+            }
             else {
                 cout << "Unknown command, use \"help\" or \"h\" for help" << endl;
             }
         }
         else {
-            bool paused = false;
+            paused_ = false;
             SpeedLimit limit;
+            select_run_frame();
+            if (!drop_stale_input())
+                return;
 
             while (!g_options.debug) {
-                // Check for SDL events
+                // Apply the input that came in since the last frame
                 SDL_Event event;
-                while (SDL_PollEvent(&event)) {
-                    switch (event.type) {
-                        case SDL_QUIT:
+                uint64_t when;
+                if (input_thread_.running()) {
+                    while (input_thread_.pop(event, when)) {
+                        if (!handle_event(event, when))
+                            return;
+                    }
+                }
+                else {
+                    while (SDL_PollEvent(&event)) {
+                        if (!handle_event(event, SpeedLimit::get_nsecs()))
                             return;
-                            break;
-                        case SDL_KEYDOWN:
-                            if (event.key.keysym.mod & KMOD_CAPS
-                                    || !g_joysticks.handle_key_down(event.key.keysym))
-                                g_keyboard.handle_key_down(event.key.keysym);
-                            break;
-                        case SDL_KEYUP:
-                            switch (event.key.keysym.sym) {
-                                case SDLK_ESCAPE:
-                                    return;
-                                    break;
-                                case SDLK_F1:
-                                    if (paused)
-                                        cout << "Returning to emulation" << endl;
-                                    else
-                                        cout << "-- PAUSED (press F1 to return to emulation) --" << endl;
-                                    paused = !paused;
-                                    break;
-                                case SDLK_F4:
-                                    g_options.debug = true;
-                                    break;
-                                case SDLK_F5:
-                                    reset();
-                                    cout << "Reset the virtual machine" << endl;
-                                    break;
-                                case SDLK_PRINT:
-                                    g_framebuffer->take_snapshot();
-                                    break;
-                                default:
-                                    if (event.key.keysym.mod & KMOD_CAPS
-                                            || !g_joysticks.handle_key_up(event.key.keysym))
-                                        g_keyboard.handle_key_up(event.key.keysym);
-                                    break;
-                            }
-                            break;
                     }
                 }
 
-                for (int i = 0; i < UNPOLLED_FRAMES; ++i) {
-                    while (!g_vdc.entered_vblank() && !paused) {
-                        const int ticks = g_cpu.step();
-                        for (int i = 0; i < time_units * ticks; ++i)
-                            g_vdc.step();
-
-                        if (g_cpu.debug_get_pc() == breakpoint) {
-                            cout << "Breakpoint reached" << endl;
-                            g_cpu.debug_print(cout);
-                            g_options.debug = true;
-                            break;
+                // Events are applied between every frame, so input is never
+                // more than a frame old by the time the game gets to see it
+                if (!paused_) {
+                    // A frame the debugger broke into is only over once
+                    // emulation resumes and gets to VBLANK
+                    if ((this->*run_frame_)()) {
+                        g_latency_tracer.frame_presented(SpeedLimit::get_nsecs());
+                        g_counters.end_frame();
+                        g_profiler.end_frame();
+                        g_heatmap.end_frame();
+                        g_redraw_log.end_frame();
+                        g_trace_ring.end_frame();
+
+                        if (g_options.max_frames && ++frames_ == g_options.max_frames) {
+                            cout << "Ran " << frames_ << " frames" << endl;
+                            return;
                         }
                     }
 
-                    if (g_options.debug)
-                        break;
-
-                    // Speed limiter
-                    if (g_options.speed_limit)
-                        limit.limit_on_frame_end();
+                    // There's nobody to look into a divergence without a window
+                    if (g_validator.diverged() && g_options.headless)
+                        return;
                 }
+
+                if (g_options.debug)
+                    break;
+
+                // Speed limiter
+                // Run commands go as fast as possible
+                if (g_options.speed_limit && run_until_ == RUN_FREELY)
+                    limit.limit_on_frame_end();
             }
 
             // Just entered debug mode
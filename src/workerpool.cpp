@@ -0,0 +1,127 @@
+#include "common.h"
+
+#include <stdexcept>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#include "workerpool.h"
+
+WorkerPool g_workers;
+
+WorkerPool::~WorkerPool()
+{
+    if (!mutex_)
+        return;
+
+    SDL_mutexP(mutex_);
+    quit_ = true;
+    SDL_CondBroadcast(work_cond_);
+    SDL_mutexV(mutex_);
+
+    for (vector<SDL_Thread *>::iterator it = threads_.begin(); it != threads_.end(); ++it)
+        SDL_WaitThread(*it, NULL);
+
+    SDL_DestroyCond(done_cond_);
+    SDL_DestroyCond(work_cond_);
+    SDL_DestroyMutex(run_mutex_);
+    SDL_DestroyMutex(mutex_);
+}
+
+int WorkerPool::cpu_count()
+{
+#ifdef HAVE_SYSCONF
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count > 0)
+        return (int)count;
+#endif
+    return 1;
+}
+
+void WorkerPool::init(int num_threads)
+{
+    if (num_threads <= 0)
+        num_threads = cpu_count();
+    if (num_threads <= 1)
+        return;
+
+    mutex_ = SDL_CreateMutex();
+    run_mutex_ = SDL_CreateMutex();
+    work_cond_ = SDL_CreateCond();
+    done_cond_ = SDL_CreateCond();
+    if (!mutex_ || !run_mutex_ || !work_cond_ || !done_cond_)
+        throw runtime_error(SDL_GetError());
+
+    // The thread calling run() does its share of the work too
+    for (int i = 0; i < num_threads - 1; ++i) {
+        SDL_Thread *thread = SDL_CreateThread(thread_main, this);
+        if (!thread) {
+            LOGWARNING << "Unable to create worker thread: " << SDL_GetError() << endl;
+            break;
+        }
+        threads_.push_back(thread);
+    }
+    cout << "Using " << size() << " threads for scaling and rendering" << endl;
+}
+
+int WorkerPool::thread_main(void *data)
+{
+    static_cast<WorkerPool *>(data)->work(true);
+    return 0;
+}
+
+void WorkerPool::work(bool wait_for_job)
+{
+    SDL_mutexP(mutex_);
+    while (true) {
+        if (next_band_ < num_bands_) {
+            Job *job = job_;
+            int band = next_band_++;
+            int num_bands = num_bands_;
+            SDL_mutexV(mutex_);
+
+            job->run_band(band, num_bands);
+
+            SDL_mutexP(mutex_);
+            if (--pending_bands_ == 0)
+                SDL_CondBroadcast(done_cond_);
+        }
+        else if (!wait_for_job || quit_) {
+            break;
+        }
+        else {
+            SDL_CondWait(work_cond_, mutex_);
+        }
+    }
+    SDL_mutexV(mutex_);
+}
+
+void WorkerPool::run(Job &job, int num_bands)
+{
+    if (threads_.empty() || num_bands <= 1) {
+        for (int i = 0; i < num_bands; ++i)
+            job.run_band(i, num_bands);
+        return;
+    }
+
+    // The job being run is shared with the workers, so another thread has to
+    // wait for it to finish before handing over its own
+    SDL_mutexP(run_mutex_);
+
+    SDL_mutexP(mutex_);
+    job_ = &job;
+    num_bands_ = num_bands;
+    next_band_ = 0;
+    pending_bands_ = num_bands;
+    SDL_CondBroadcast(work_cond_);
+    SDL_mutexV(mutex_);
+
+    work(false);
+
+    SDL_mutexP(mutex_);
+    while (pending_bands_)
+        SDL_CondWait(done_cond_, mutex_);
+    SDL_mutexV(mutex_);
+
+    SDL_mutexV(run_mutex_);
+}